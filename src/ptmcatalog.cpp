@@ -0,0 +1,584 @@
+/*
+ * ptmcatalog - Tobias Alexander Franke 2012
+ * For copyright and license see LICENSE
+ * http://www.tobias-franke.eu
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#define TAF_PTM_IMPLEMENTATION
+#include "taf_ptm.h"
+
+/**
+ * One PTM in the catalog
+ *
+ * Records have a fixed size and are sorted by their canonical path, which is stored in a string
+ * table after the last record. The modification time is in nanoseconds since the epoch. All
+ * fields are in host byte order. Offsets of planes are absolute file offsets,
+ * or 0 if the plane has no offset of its own, which is the case for lossless PTMs.
+ */
+struct CatalogRecord
+{
+    uint64_t path_offset;
+    uint64_t file_size;
+    int64_t  mtime_ns;
+    uint64_t hash;
+    uint64_t data_offset;
+    uint64_t plane_offsets[9];
+
+    uint32_t path_length;
+    uint32_t format;
+    uint32_t flags;
+    uint32_t width;
+    uint32_t height;
+    uint32_t transforms;
+    float    scale[6];
+    int32_t  bias[6];
+
+    int8_t   reference_planes[9];
+    uint8_t  plane_transforms[9];
+    uint8_t  order[9];
+    uint8_t  reserved[5];
+};
+
+static_assert(sizeof(CatalogRecord) == 216, "Catalog records must not be padded");
+
+/**
+ * Catalog header, followed by the records and the string table
+ */
+struct CatalogHeader
+{
+    char     magic[8];
+    uint64_t count;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+static const char catalog_magic[8] = { 'T', 'A', 'F', 'P', 'T', 'M', 'C', '1' };
+
+enum CatalogFlags
+{
+    CATALOG_LOSSLESS = 1
+};
+
+static const char* format_names[] = { "RGB", "LUM", "LRGB", "JPEG_RGB", "JPEG_LRGB", "JPEGLS_RGB", "JPEGLS_LRGB" };
+static const char* transform_names[] = { "NOTHING", "PLANE_INVERSION", "MOTION_COMPENSATION" };
+
+/**
+ * Content hash of a whole file
+ *
+ * A 64-bit hash in the style of FNV-1a, but not FNV-1a itself: it takes words of 8 bytes at a
+ * time instead of single bytes, and mixes the high bits back down with h ^= h >> 29 after every
+ * multiplication, since the FNV multiplication only carries low bits upwards.
+ */
+uint64_t catalog_hash(const char* filename)
+{
+    std::ifstream stream(filename, std::ios::binary);
+
+    if (!stream.good())
+        throw std::runtime_error("Can't open file");
+
+    std::vector<char> buffer(1 << 20);
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    while (stream.good())
+    {
+        stream.read(&buffer[0], buffer.size());
+        size_t n = static_cast<size_t>(stream.gcount());
+
+        // pad the tail with zeros, the file size is recorded separately
+        std::fill(buffer.begin() + n, buffer.begin() + (n + 7) / 8 * 8, 0);
+
+        for (size_t i = 0; i < n; i += 8)
+        {
+            uint64_t w;
+            std::memcpy(&w, &buffer[i], 8);
+            h = (h ^ w) * 0x100000001b3ull;
+            h ^= h >> 29;
+        }
+    }
+
+    return h;
+}
+
+/**
+ * Modification time of a file in nanoseconds since the epoch
+ */
+int64_t catalog_mtime(const struct stat& st)
+{
+#ifdef __APPLE__
+    const int64_t nsec = static_cast<int64_t>(st.st_mtimespec.tv_nsec);
+#else
+    const int64_t nsec = static_cast<int64_t>(st.st_mtim.tv_nsec);
+#endif
+
+    return static_cast<int64_t>(st.st_mtime) * 1000000000 + nsec;
+}
+
+/**
+ * Read header, plane offsets and hash of a PTM into a record
+ */
+void catalog_probe(const std::string& filename, const struct stat& st, CatalogRecord* r)
+{
+    std::memset(r, 0, sizeof(CatalogRecord));
+
+    r->file_size = static_cast<uint64_t>(st.st_size);
+    r->mtime_ns = catalog_mtime(st);
+
+    std::ifstream stream(filename.c_str(), std::ios::binary);
+
+    if (!stream.good())
+        throw std::runtime_error("Can't open file");
+
+    taf::PTMHeader12 header;
+
+    if (taf::detail::ptm_is_lossless(stream))
+    {
+        size_t tile_size;
+        std::vector<uint64_t> offsets;
+        taf::detail::ptm_read_lossless_index(stream, &header, &tile_size, &offsets);
+
+        r->flags |= CATALOG_LOSSLESS;
+        r->data_offset = offsets.empty() ? 0 : offsets[0];
+    }
+    else
+    {
+        taf::detail::ptm_read_header(stream, &header);
+        r->data_offset = static_cast<uint64_t>(stream.tellg());
+
+        const size_t epp = taf::get_epp(&header);
+
+        if (header.format == taf::PTM_FORMAT_LRGB)
+        {
+            for (size_t p = 0; p < 6; ++p)
+                r->plane_offsets[p] = r->data_offset;
+
+            for (size_t p = 6; p < 9; ++p)
+                r->plane_offsets[p] = r->data_offset + header.width * header.height * 6;
+        }
+        else
+        {
+            uint64_t offset = r->data_offset;
+
+            for (size_t p = 0; p < epp && p < 9; ++p)
+            {
+                r->plane_offsets[p] = offset;
+                r->reference_planes[p] = static_cast<int8_t>(header.ci.reference_planes[p]);
+                r->plane_transforms[p] = static_cast<uint8_t>(header.ci.transforms[p]);
+                r->order[p] = static_cast<uint8_t>(header.ci.order[p]);
+                r->transforms |= 1u << header.ci.transforms[p];
+
+                offset += header.ci.compressed_size[p] + header.ci.side_information[p];
+            }
+        }
+    }
+
+    if (header.format != taf::PTM_FORMAT_JPEG_LRGB)
+        std::fill(r->reference_planes, r->reference_planes + 9, -1);
+
+    r->format = static_cast<uint32_t>(header.format);
+    r->width = static_cast<uint32_t>(header.width);
+    r->height = static_cast<uint32_t>(header.height);
+
+    std::copy(header.scale, header.scale + 6, r->scale);
+    std::copy(header.bias, header.bias + 6, r->bias);
+
+    stream.close();
+
+    r->hash = catalog_hash(filename.c_str());
+}
+
+/**
+ * Map a catalog and check its layout and every record, so a truncated or corrupt catalog is
+ * rejected before any path is read. Returns false if the catalog doesn't exist.
+ */
+bool catalog_open(const char* catalog, taf::MappedFile* file, const CatalogHeader** header, const CatalogRecord** records, const char** strings)
+{
+    struct stat st;
+
+    if (stat(catalog, &st) != 0)
+        return false;
+
+    file->open(catalog);
+
+    const size_t size = file->size();
+
+    if (size < sizeof(CatalogHeader))
+        throw std::runtime_error("Catalog is truncated");
+
+    *header = reinterpret_cast<const CatalogHeader*>(file->data());
+
+    const CatalogHeader& h = **header;
+
+    if (!std::equal(h.magic, h.magic + 8, catalog_magic))
+        throw std::runtime_error("Not a catalog");
+
+    if (h.count > (size - sizeof(CatalogHeader)) / sizeof(CatalogRecord) ||
+        h.strings_offset != sizeof(CatalogHeader) + h.count * sizeof(CatalogRecord) ||
+        h.strings_size != size - h.strings_offset)
+        throw std::runtime_error("Catalog is truncated");
+
+    *records = reinterpret_cast<const CatalogRecord*>(file->data() + sizeof(CatalogHeader));
+    *strings = reinterpret_cast<const char*>(file->data() + h.strings_offset);
+
+    // paths must lie in the string table and be sorted, updates merge along them
+    for (size_t i = 0; i < h.count; ++i)
+    {
+        const CatalogRecord& r = (*records)[i];
+
+        if (r.path_offset > h.strings_size || r.path_length > h.strings_size - r.path_offset)
+            throw std::runtime_error("Catalog is corrupt");
+
+        if (i > 0)
+        {
+            const CatalogRecord& p = (*records)[i - 1];
+
+            const std::string previous(*strings + p.path_offset, p.path_length);
+            const std::string path(*strings + r.path_offset, r.path_length);
+
+            if (!(previous < path))
+                throw std::runtime_error("Catalog is corrupt");
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Create or update a catalog from a list of PTMs
+ *
+ * Paths are stored canonical, so updates from any working directory find the same entries.
+ * Entries of files whose size and modification time in nanoseconds are unchanged are copied from
+ * the existing catalog, all other files are probed and hashed in parallel. Entries of files that
+ * don't exist anymore are dropped and reported; entries of files that can't be checked for any
+ * other reason are kept as they are. The new catalog replaces the old one atomically.
+ */
+void catalog_update(const char* catalog, std::vector<std::string> files)
+{
+    std::vector<std::string> canonical;
+
+    for (auto& f : files)
+    {
+        char* resolved = realpath(f.c_str(), nullptr);
+
+        if (!resolved)
+        {
+            std::clog << f << ": " << std::strerror(errno) << std::endl;
+            continue;
+        }
+
+        canonical.push_back(resolved);
+        std::free(resolved);
+    }
+
+    files.swap(canonical);
+
+    std::sort(files.begin(), files.end());
+    files.erase(std::unique(files.begin(), files.end()), files.end());
+
+    taf::MappedFile old;
+    const CatalogHeader* old_header = nullptr;
+    const CatalogRecord* old_records = nullptr;
+    const char* old_strings = nullptr;
+    size_t old_count = 0;
+
+    if (catalog_open(catalog, &old, &old_header, &old_records, &old_strings))
+        old_count = static_cast<size_t>(old_header->count);
+
+    // existing entries are kept unless they vanished, new files are added
+    std::vector<std::string> paths;
+    std::vector<const CatalogRecord*> previous;
+
+    for (size_t i = 0, j = 0; i < old_count || j < files.size();)
+    {
+        std::string path;
+        const CatalogRecord* r = nullptr;
+
+        if (i < old_count)
+            path.assign(old_strings + old_records[i].path_offset, old_records[i].path_length);
+
+        if (j < files.size() && (i == old_count || files[j] <= path))
+        {
+            if (i < old_count && files[j] == path)
+                r = &old_records[i++];
+
+            path = files[j++];
+        }
+        else
+            r = &old_records[i++];
+
+        paths.push_back(path);
+        previous.push_back(r);
+    }
+
+    std::vector<CatalogRecord> records(paths.size());
+    std::vector<char> keep(paths.size(), 0);
+    std::vector<std::string> errors(paths.size());
+
+    std::atomic<size_t> probed(0);
+    std::atomic<size_t> dropped(0);
+
+    taf::detail::parallel_for(0, paths.size(), 16, [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            struct stat st;
+
+            const CatalogRecord* r = previous[i];
+
+            if (stat(paths[i].c_str(), &st) != 0)
+            {
+                if (errno == ENOENT)
+                {
+                    if (r)
+                    {
+                        errors[i] = "removed from catalog, file doesn't exist anymore";
+                        ++dropped;
+                    }
+                }
+                else
+                {
+                    // a transient error must not drop the entry
+                    errors[i] = std::strerror(errno);
+
+                    if (r)
+                    {
+                        records[i] = *r;
+                        keep[i] = 1;
+                    }
+                }
+
+                continue;
+            }
+
+            try
+            {
+                if (r && r->file_size == static_cast<uint64_t>(st.st_size) && r->mtime_ns == catalog_mtime(st))
+                    records[i] = *r;
+                else
+                {
+                    catalog_probe(paths[i], st, &records[i]);
+                    ++probed;
+                }
+
+                keep[i] = 1;
+            }
+            catch (std::exception& e)
+            {
+                errors[i] = e.what();
+            }
+        }
+    });
+
+    std::vector<char> strings;
+    size_t count = 0;
+
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        if (!errors[i].empty())
+            std::clog << paths[i] << ": " << errors[i] << std::endl;
+
+        if (!keep[i])
+            continue;
+
+        records[i].path_offset = strings.size();
+        records[i].path_length = static_cast<uint32_t>(paths[i].size());
+        strings.insert(strings.end(), paths[i].begin(), paths[i].end());
+
+        records[count++] = records[i];
+    }
+
+    records.resize(count);
+    old.close();
+
+    CatalogHeader header;
+    std::copy(catalog_magic, catalog_magic + 8, header.magic);
+    header.count = count;
+    header.strings_offset = sizeof(CatalogHeader) + count * sizeof(CatalogRecord);
+    header.strings_size = strings.size();
+
+    std::string temp = std::string(catalog) + ".tmp";
+
+    {
+        std::ofstream out(temp.c_str(), std::ios::binary);
+
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        if (count > 0)
+            out.write(reinterpret_cast<const char*>(&records[0]), count * sizeof(CatalogRecord));
+
+        if (!strings.empty())
+            out.write(&strings[0], strings.size());
+
+        if (!out.good())
+            throw std::runtime_error("Can't write catalog");
+    }
+
+    if (std::rename(temp.c_str(), catalog) != 0)
+        throw std::runtime_error("Can't replace catalog");
+
+    std::clog << catalog << ": " << count << " files, " << probed.load() << " probed, " << dropped.load() << " removed" << std::endl;
+}
+
+/**
+ * Filter of a catalog query, every condition has to match
+ */
+struct CatalogFilter
+{
+    int format = -1;
+    int transform = -1;
+    uint32_t min_width = 0, max_width = UINT32_MAX;
+    uint32_t min_height = 0, max_height = UINT32_MAX;
+    bool lossless = false;
+    bool hash = false;
+    uint64_t hash_value = 0;
+
+    bool matches(const CatalogRecord& r) const
+    {
+        return (format < 0 || r.format == static_cast<uint32_t>(format)) &&
+               (transform < 0 || (r.transforms & (1u << transform))) &&
+               r.width >= min_width && r.width <= max_width &&
+               r.height >= min_height && r.height <= max_height &&
+               (!lossless || (r.flags & CATALOG_LOSSLESS)) &&
+               (!hash || r.hash == hash_value);
+    }
+};
+
+int catalog_find(const char* const* names, size_t count, const std::string& name)
+{
+    for (size_t i = 0; i < count; ++i)
+        if (name == names[i] || name == std::string("PTM_FORMAT_") + names[i])
+            return static_cast<int>(i);
+
+    throw std::runtime_error("Unknown name: " + name);
+}
+
+/**
+ * Print the paths of all matching entries, or one line of fields per entry if verbose is set
+ */
+void catalog_query(const char* catalog, const CatalogFilter& filter, bool verbose)
+{
+    taf::MappedFile file;
+    const CatalogHeader* header;
+    const CatalogRecord* records;
+    const char* strings;
+
+    if (!catalog_open(catalog, &file, &header, &records, &strings))
+        throw std::runtime_error("Can't open catalog");
+
+    auto&& out = std::cout;
+
+    char hash[17];
+
+    for (size_t i = 0; i < header->count; ++i)
+    {
+        const CatalogRecord& r = records[i];
+
+        if (!filter.matches(r))
+            continue;
+
+        out.write(strings + r.path_offset, r.path_length);
+
+        if (verbose)
+        {
+            std::snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(r.hash));
+
+            out << "\t" << (r.format < 7 ? format_names[r.format] : "?");
+            out << (r.flags & CATALOG_LOSSLESS ? "\tlossless" : "\t-");
+            out << "\t" << r.width << "x" << r.height << "\t" << r.file_size << "\t" << hash;
+        }
+
+        out << "\n";
+    }
+
+    out.flush();
+}
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        if (argc < 3)
+            throw std::runtime_error("Usage: ptmcatalog update catalog [--manifest file] [ptm...]\n"
+                                     "       ptmcatalog query catalog [--format F] [--transform T] [--min-width N] [--max-width N]\n"
+                                     "                                [--min-height N] [--max-height N] [--lossless] [--hash H] [--long]");
+
+        std::string command = argv[1];
+        const char* catalog = argv[2];
+
+        std::vector<std::string> files;
+        CatalogFilter filter;
+        bool verbose = false;
+
+        for (int i = 3; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+
+            if (arg == "--manifest" && i + 1 < argc)
+            {
+                std::ifstream manifest(argv[++i]);
+
+                if (!manifest.good())
+                    throw std::runtime_error("Can't open manifest");
+
+                std::string line;
+
+                while (std::getline(manifest, line))
+                {
+                    line.erase(0, line.find_first_not_of(" \t\r"));
+                    line.erase(line.find_last_not_of(" \t\r") + 1);
+
+                    if (!line.empty() && line[0] != '#')
+                        files.push_back(line);
+                }
+            }
+            else if (arg == "--format" && i + 1 < argc)
+                filter.format = catalog_find(format_names, 7, argv[++i]);
+            else if (arg == "--transform" && i + 1 < argc)
+                filter.transform = catalog_find(transform_names, 3, argv[++i]);
+            else if (arg == "--min-width" && i + 1 < argc)
+                filter.min_width = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+            else if (arg == "--max-width" && i + 1 < argc)
+                filter.max_width = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+            else if (arg == "--min-height" && i + 1 < argc)
+                filter.min_height = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+            else if (arg == "--max-height" && i + 1 < argc)
+                filter.max_height = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+            else if (arg == "--lossless")
+                filter.lossless = true;
+            else if (arg == "--hash" && i + 1 < argc)
+            {
+                filter.hash = true;
+                filter.hash_value = std::strtoull(argv[++i], nullptr, 16);
+            }
+            else if (arg == "--long")
+                verbose = true;
+            else if (arg.compare(0, 2, "--") == 0)
+                throw std::runtime_error("Unknown option: " + arg);
+            else
+                files.push_back(arg);
+        }
+
+        if (command == "update")
+            catalog_update(catalog, files);
+        else if (command == "query")
+            catalog_query(catalog, filter, verbose);
+        else
+            throw std::runtime_error("Unknown command: " + command);
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
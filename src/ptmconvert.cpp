@@ -5,13 +5,26 @@
  */
 
 #include <iostream>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <csignal>
+#include <mutex>
+#include <memory>
+#include <queue>
+#include <set>
+#include <cerrno>
+#include <sys/stat.h>
 
 #define TAF_PTM_IMPLEMENTATION
 #include "taf_ptm.h"
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
-
 /**
  * Helper function to print bias, scale and size of a PTM.
  */
@@ -33,6 +46,21 @@ void ptm_print_info(const taf::PTMHeader12& ptm)
     log << std::endl;
 }
 
+/**
+ * Rebuild an LRGB PTM from a PNG triplet and its sidecar header, as written by taf::ptm_write_png
+ * with --sidecar. Images split into strips are passed by their unsplit names, e.g. coeff_h.png.
+ */
+void ptm_rebuild(const char* coeff_h, const char* coeff_l, const char* rgb, const char* sidecar, const char* out)
+{
+    taf::PTMHeader12 ptmh = taf::ptm_probe(sidecar);
+
+    taf::PTM12 ptm;
+    taf::ptm_from_png(&ptmh, coeff_h, coeff_l, rgb, &ptm);
+    taf::ptm_save(out, &ptm);
+
+    ptm_print_info(ptmh);
+}
+
 /**
  * Dump a PTM structure into three image files.
  *
@@ -47,36 +75,965 @@ void ptm_print_info(const taf::PTMHeader12& ptm)
  * from the third image. Before doing so, you'll need to adjust the luminance coefficients by their
  * scale and bias parameters!
  *
+ * With sidecar, the header is also written to header.txt for ptm_rebuild.
+ *
  * Currently, only LRGB PTMs are supported.
  */
-void ptm_dump_png(const char* filename)
+void ptm_dump_png(const char* filename, bool sidecar)
+{
+    taf::PTMFileSink sink;
+    ptm_print_info(taf::ptm_dump_png(filename, &sink, "", sidecar));
+}
+
+/**
+ * Dump a PTM into three image files without holding it in memory.
+ *
+ * Planes and images are kept in a memory mapped scratch file and processed in tiles of roughly
+ * memory_limit bytes. The output is identical to ptm_dump_png.
+ */
+void ptm_dump_png(const char* filename, const char* scratch_file, size_t memory_limit, bool sidecar)
+{
+    taf::MappedFile scratch;
+    unsigned char *coeff_h, *coeff_l, *rgb;
+
+    taf::PTMHeader12 ptmh = taf::ptm_load(filename, scratch_file, memory_limit, &scratch, &coeff_h, &coeff_l, &rgb);
+
+    taf::PTMFileSink sink;
+    taf::ptm_write_png(&ptmh, coeff_h, coeff_l, rgb, &sink, "", sidecar);
+    ptm_print_info(ptmh);
+}
+
+/**
+ * Rewrite a PTM into the lossless tiled container and report the compression ratio.
+ */
+void ptm_save_lossless(const char* filename, const char* out)
+{
+    taf::PTM12 ptm;
+    taf::ptm_load(filename, &ptm);
+
+    taf::ptm_save_lossless(out, &ptm);
+
+    std::ifstream written(out, std::ios::binary | std::ios::ate);
+    double ratio = static_cast<double>(ptm.coefficients.size()) / static_cast<double>(written.tellg());
+
+    ptm_print_info(ptm.header);
+    std::clog << "Lossless ratio: " << ratio << std::endl;
+}
+
+/**
+ * Dump a PTM decoded by a share server into three image files, without decoding it here.
+ */
+void ptm_dump_png_shared(const char* socket_path, const char* filename, bool sidecar)
 {
-    taf::uchar_vec coeff_h, coeff_l, rgb;
-    taf::PTMHeader12 ptmh = taf::ptm_load(filename, &coeff_h, &coeff_l, &rgb);
+    taf::PTMSharedView view;
+    view.acquire(socket_path, filename);
+
+    taf::PTMHeader12 ptmh = view.header();
+
+    taf::uchar_vec coeff_h(ptmh.width * ptmh.height * 3), coeff_l(coeff_h.size()), rgb(coeff_h.size());
+    unsigned char *h = &coeff_h[0], *l = &coeff_l[0], *c = &rgb[0];
+
+    taf::ptm_load(&ptmh, view.coefficients(), &h, &l, &c);
 
-    auto write_png = [&ptmh](const char* f, unsigned char* data)
+    taf::PTMFileSink sink;
+    taf::ptm_write_png(&ptmh, h, l, c, &sink, "", sidecar);
+    ptm_print_info(ptmh);
+}
+
+/**
+ * Write the library's counters in OpenMetrics format, for a metrics agent to pick up.
+ */
+void ptm_write_metrics(const char* filename)
+{
+    taf::PTMMetrics metrics;
+    taf::ptm_metrics(&metrics);
+
+    std::ofstream out(filename);
+    out << taf::ptm_metrics_openmetrics(&metrics);
+
+    if (!out.good())
+        throw std::runtime_error("Can't write metrics");
+}
+
+taf::PTMShareServer* share_server = nullptr;
+
+void ptm_stop_server(int)
+{
+    if (share_server)
+        share_server->stop();
+}
+
+/**
+ * Decode PTMs into shared memory for other processes until interrupted.
+ */
+void ptm_serve(const char* socket_path, size_t idle_limit)
+{
+    taf::PTMShareServer server(socket_path, idle_limit);
+
+    share_server = &server;
+    std::signal(SIGINT, ptm_stop_server);
+    std::signal(SIGTERM, ptm_stop_server);
+
+    std::clog << "Serving PTMs on " << socket_path << std::endl;
+    server.run();
+
+    share_server = nullptr;
+}
+
+/**
+ * Estimate the cost of converting a PTM from its header with taf::ptm_cost.
+ *
+ * Files that can't be probed cost their size in bytes, and missing files cost nothing, so every
+ * node sees the same cost for the same file. Any other error is fatal, since a cost that depends
+ * on the node would give each node a different partitioning.
+ */
+size_t ptm_estimate_cost(const char* filename)
+{
+    try
     {
-        return stbi_write_png(f, ptmh.width, ptmh.height, 3, data, 0);
-    };
+        taf::PTMHeader12 ptmh = taf::ptm_probe(filename);
 
-    if (!write_png("coeff_h.png", &coeff_h[0]) ||
-        !write_png("coeff_l.png", &coeff_l[0]) ||
-        !write_png("rgb.png",     &rgb[0]))
+        return static_cast<size_t>(taf::ptm_cost(&ptmh));
+    }
+    catch (std::exception&)
     {
-        throw std::runtime_error("Couldn't write PNG files");
+        struct stat st;
+
+        if (stat(filename, &st) == 0)
+            return static_cast<size_t>(st.st_size);
+
+        if (errno == ENOENT || errno == ENOTDIR)
+            return 0;
+
+        throw std::runtime_error(std::string("Can't estimate the cost of ") + filename);
     }
+}
 
-    ptm_print_info(ptmh);
+/**
+ * Read a manifest with one PTM file per line. Empty lines and lines starting with # are skipped.
+ */
+std::vector<std::string> ptm_read_manifest(const char* manifest)
+{
+    std::ifstream stream(manifest);
+
+    if (!stream.good())
+        throw std::runtime_error("Can't open manifest");
+
+    std::vector<std::string> files;
+    std::string line;
+
+    while (std::getline(stream, line))
+    {
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+
+        if (!line.empty() && line[0] != '#')
+            files.push_back(line);
+    }
+
+    return files;
+}
+
+/**
+ * Select the files of one shard of a manifest.
+ *
+ * All files are probed in parallel and distributed with a greedy longest-job-first schedule:
+ * ordered by decreasing cost, each file goes to the shard with the least total cost so far,
+ * which is kept on top of a min-heap.
+ * Ties are broken by path and shard number, so every node computes the same partitioning from
+ * the same manifest without any coordination. The files of the shard are returned in manifest
+ * order together with their costs.
+ */
+std::vector<std::pair<std::string, size_t>> ptm_shard(const std::vector<std::string>& files, size_t shard, size_t num_shards)
+{
+    std::vector<size_t> costs(files.size());
+
+    taf::detail::parallel_for(0, files.size(), 64, [&](size_t b, size_t e)
+    {
+        for (size_t i = b; i < e; ++i)
+            costs[i] = ptm_estimate_cost(files[i].c_str());
+    });
+
+    std::vector<size_t> order(files.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+    {
+        return costs[a] != costs[b] ? costs[a] > costs[b] : files[a] < files[b];
+    });
+
+    // shards by total cost and number, least loaded first
+    typedef std::pair<size_t, size_t> Load;
+    std::priority_queue<Load, std::vector<Load>, std::greater<Load>> load;
+
+    for (size_t s = 0; s < num_shards; ++s)
+        load.push(Load(0, s));
+
+    std::vector<bool> selected(files.size(), false);
+
+    for (auto i : order)
+    {
+        Load target = load.top();
+        load.pop();
+
+        // every file costs at least 1 so files without a cost are spread evenly
+        target.first += std::max<size_t>(costs[i], 1);
+        selected[i] = target.second == shard;
+
+        load.push(target);
+    }
+
+    std::vector<std::pair<std::string, size_t>> result;
+
+    for (size_t i = 0; i < files.size(); ++i)
+        if (selected[i])
+            result.push_back(std::make_pair(files[i], costs[i]));
+
+    return result;
+}
+
+/**
+ * Encode the path of a PTM into a file name prefix.
+ *
+ * Directory separators, drive colons and the escape character itself are percent-encoded. A
+ * trailing .ptm extension is dropped, and any other path is kept whole and marked with a single
+ * trailing '%', which can't come from an escape, so different paths never give the same prefix:
+ * a.ptm gives a, a.ptmz gives a.ptmz% and dir.v2/scan gives dir.v2%2Fscan%.
+ */
+std::string ptm_output_prefix(const std::string& path)
+{
+    static const std::string extension = ".ptm";
+
+    const size_t name = path.find_last_of("/\\:") + 1;
+    const bool stripped = path.size() >= name + extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+
+    std::string prefix;
+
+    for (char c : path.substr(0, path.size() - (stripped ? extension.size() : 0)))
+    {
+        if (c == '%')
+            prefix += "%25";
+        else if (c == '/')
+            prefix += "%2F";
+        else if (c == '\\')
+            prefix += "%5C";
+        else if (c == ':')
+            prefix += "%3A";
+        else
+            prefix += c;
+    }
+
+    if (!stripped)
+        prefix += '%';
+
+    return prefix;
+}
+
+/**
+ * Convert one shard of a manifest.
+ *
+ * The images of each PTM are written to out_dir, prefixed with the path of the PTM encoded
+ * with ptm_output_prefix. Files are converted by jobs workers in the bulk lane
+ * of a scheduler, one per core if jobs is 0, cheapest first, so small files aren't held up by
+ * large ones. Every file is converted in parallel too, so fewer workers use less memory. The
+ * result of every file is written to the result manifest out_dir/shard-i-of-N.tsv with the
+ * columns path, status, cost, milliseconds and error message, in the order the files finished.
+ *
+ * With sidecar, each PTM also gets a header.txt for ptm_rebuild. If archive is "tar" or "zip",
+ * the images aren't written as separate files but streamed into the archive
+ * out_dir/shard-i-of-N.tar or .zip. The images of a PTM are only added once all of them have been
+ * converted, so the archive holds no partial results of failed files.
+ */
+void ptm_batch(const char* manifest, size_t shard, size_t num_shards, const std::string& out_dir, const char* archive, bool sidecar, size_t jobs)
+{
+    auto files = ptm_shard(ptm_read_manifest(manifest), shard, num_shards);
+
+    std::ostringstream name;
+    name << out_dir << "/shard-" << shard << "-of-" << num_shards;
+
+    std::ofstream result((name.str() + ".tsv").c_str());
+
+    if (!result.good())
+        throw std::runtime_error("Can't write result manifest");
+
+    std::unique_ptr<taf::PTMArchive> output;
+
+    if (archive)
+    {
+        const std::string format = archive;
+
+        if (format != "tar" && format != "zip")
+            throw std::runtime_error("Unknown archive format: " + format);
+
+        output.reset(new taf::PTMArchive((name.str() + "." + format).c_str(), format == "zip" ? taf::PTM_ARCHIVE_ZIP : taf::PTM_ARCHIVE_TAR));
+    }
+
+    size_t failed = 0;
+    std::mutex result_mutex;
+
+    // workers start on the first jobs right away, so the cheapest are submitted first
+    taf::PTMScheduler scheduler(jobs);
+
+    std::stable_sort(files.begin(), files.end(), [](const std::pair<std::string, size_t>& a, const std::pair<std::string, size_t>& b)
+    {
+        return a.second < b.second;
+    });
+
+    for (auto& f : files)
+    {
+        const std::pair<std::string, size_t>* file = &f;
+
+        taf::PTMArchive* out = output.get();
+
+        scheduler.submit(taf::PTM_LANE_BULK, file->second, [&result, &result_mutex, &failed, &out_dir, file, out, sidecar]()
+        {
+            auto start = std::chrono::steady_clock::now();
+            std::string error;
+
+            try
+            {
+                std::string prefix = ptm_output_prefix(file->first);
+
+                if (out)
+                {
+                    // a file that fails halfway must not leave some of its images in the archive
+                    taf::PTMMemorySink entries;
+                    taf::ptm_dump_png(file->first.c_str(), &entries, prefix + "_", sidecar);
+
+                    for (auto& entry : entries.files)
+                        out->add(entry.first, std::move(entry.second));
+                }
+                else
+                {
+                    taf::PTMFileSink file_sink(out_dir + "/");
+                    taf::ptm_dump_png(file->first.c_str(), &file_sink, prefix + "_", sidecar);
+                }
+            }
+            catch (std::exception& e)
+            {
+                error = e.what();
+                std::replace(error.begin(), error.end(), '\t', ' ');
+                std::replace(error.begin(), error.end(), '\n', ' ');
+            }
+
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+            std::lock_guard<std::mutex> lock(result_mutex);
+
+            if (!error.empty())
+                ++failed;
+
+            result << file->first << "\t" << (error.empty() ? "ok" : "error") << "\t" << file->second << "\t" << ms << "\t" << error << std::endl;
+        });
+    }
+
+    scheduler.wait();
+
+    if (output)
+        output->close();
+
+    std::clog << "Shard " << shard << "/" << num_shards << ": " << files.size() << " files, " << failed << " failed" << std::endl;
+}
+
+/**
+ * Merge the result manifests of all shards into one, sorted by path.
+ *
+ * Every file of the input manifest must have a result, otherwise nothing is written.
+ */
+void ptm_merge_manifests(const char* output, const char* manifest, const std::vector<const char*>& inputs)
+{
+    std::vector<std::string> lines;
+
+    for (auto input : inputs)
+    {
+        std::ifstream stream(input);
+
+        if (!stream.good())
+            throw std::runtime_error(std::string("Can't open result manifest ") + input);
+
+        std::string line;
+        while (std::getline(stream, line))
+            if (!line.empty())
+                lines.push_back(line);
+    }
+
+    std::sort(lines.begin(), lines.end());
+
+    std::set<std::string> merged;
+    for (auto& line : lines)
+        merged.insert(line.substr(0, line.find('\t')));
+
+    size_t missing = 0;
+    std::string first_missing;
+
+    for (auto& file : ptm_read_manifest(manifest))
+    {
+        if (merged.count(file))
+            continue;
+
+        if (!missing++)
+            first_missing = file;
+    }
+
+    if (missing)
+    {
+        std::ostringstream error;
+        error << missing << " files have no result, starting with " << first_missing;
+        throw std::runtime_error(error.str());
+    }
+
+    std::ofstream out(output);
+    size_t failed = 0, duplicates = 0;
+    std::string last;
+
+    for (auto& line : lines)
+    {
+        std::string path = line.substr(0, line.find('\t'));
+
+        if (path == last)
+            ++duplicates;
+
+        if (line.find("\terror\t") != std::string::npos)
+            ++failed;
+
+        out << line << std::endl;
+        last = path;
+    }
+
+    std::clog << "Merged " << lines.size() << " results, " << failed << " failed, " << duplicates << " duplicates" << std::endl;
+}
+
+/**
+ * Quote a string for JSON, escaping quotes, backslashes and control characters.
+ */
+std::string json_string(const std::string& s)
+{
+    std::string out = "\"";
+
+    for (char ch : s)
+    {
+        const unsigned char c = static_cast<unsigned char>(ch);
+
+        if (c == '"' || c == '\\')
+            out += std::string("\\") + ch;
+        else if (c < 0x20)
+        {
+            char escape[8];
+            std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        }
+        else
+            out += ch;
+    }
+
+    return out + "\"";
+}
+
+/**
+ * Print statistics of all coefficient and color planes of a PTM as JSON.
+ *
+ * Uncompressed PTMs are streamed through in chunks, so this works on files larger than memory.
+ */
+void ptm_print_stats(const char* filename)
+{
+    static const char* names[] = { "a0", "a1", "a2", "a3", "a4", "a5", "r", "g", "b" };
+
+    taf::PTMStats stats;
+    taf::PTMHeader12 ptmh = taf::ptm_stats(filename, &stats);
+
+    auto&& out = std::cout;
+
+    out << "{" << std::endl;
+    out << "  \"file\": " << json_string(filename) << "," << std::endl;
+    out << "  \"width\": " << ptmh.width << "," << std::endl;
+    out << "  \"height\": " << ptmh.height << "," << std::endl;
+    out << "  \"planes\": [" << std::endl;
+
+    for (size_t p = 0; p < 9; ++p)
+    {
+        const taf::PTMPlaneStats& plane = stats.planes[p];
+
+        out << "    { \"plane\": \"" << names[p] << "\"";
+        out << ", \"min\": " << static_cast<int>(plane.min);
+        out << ", \"max\": " << static_cast<int>(plane.max);
+        out << ", \"mean\": " << plane.mean;
+        out << ", \"variance\": " << plane.variance;
+        out << ", \"histogram\": [";
+
+        for (size_t i = 0; i < 256; ++i)
+            out << (i ? "," : "") << plane.histogram[i];
+
+        out << "] }" << (p < 8 ? "," : "") << std::endl;
+    }
+
+    out << "  ]" << std::endl;
+    out << "}" << std::endl;
+}
+
+/**
+ * Relight a PTM and write the result as relit.png.
+ *
+ * The PTM is lit by an environment map scaled by exposure if environment is set, by a point
+ * light if point is set, or else from the direction light_dir.
+ */
+void ptm_relight_png(const taf::PTM12& ptm, const float* light_dir, const taf::PTMPointLight* point, const char* environment, float exposure)
+{
+    taf::uchar_vec out(ptm.header.width * ptm.header.height * 3);
+
+    if (environment)
+    {
+        int w, h, comp;
+        float* latlong = stbi_loadf(environment, &w, &h, &comp, 3);
+
+        if (!latlong)
+            throw std::runtime_error("Couldn't read environment map");
+
+        taf::PTMEnvironment env;
+        taf::ptm_environment(latlong, w, h, &env);
+        stbi_image_free(latlong);
+
+        taf::ptm_relight(&ptm, &env, exposure, &out[0]);
+    }
+    else if (point)
+        taf::ptm_relight(&ptm, point, &out[0]);
+    else
+        taf::ptm_relight(&ptm, light_dir[0], light_dir[1], &out[0]);
+
+    if (!stbi_write_png("relit.png", static_cast<int>(ptm.header.width), static_cast<int>(ptm.header.height), 3, &out[0], 0))
+        throw std::runtime_error("Couldn't write PNG file");
+}
+
+/**
+ * Relight a PTM from the direction light_dir and tone map the result to relit.png.
+ *
+ * Scale and bias, relighting and tone mapping run fused in a single pass over the PTM.
+ */
+void ptm_relight_tonemap_png(const char* filename, const float* light_dir, float exposure, float gamma)
+{
+    taf::PTM12 ptm;
+    taf::ptm_load(filename, &ptm);
+
+    if (!taf::is_lrgb(&ptm.header))
+        throw std::runtime_error("Tone mapping needs an LRGB PTM");
+
+    taf::uchar_vec out(ptm.header.width * ptm.header.height * 3);
+
+    taf::ptm_pipeline(&ptm, &out[0],
+                      taf::PTMScaleBias(&ptm.header),
+                      taf::PTMDirectionalLight(light_dir[0], light_dir[1]),
+                      taf::PTMToneMap(exposure, gamma));
+
+    if (!stbi_write_png("relit.png", static_cast<int>(ptm.header.width), static_cast<int>(ptm.header.height), 3, &out[0], 0))
+        throw std::runtime_error("Couldn't write PNG file");
+}
+
+/**
+ * Unsharp mask the coefficients of a PTM and dump them like ptm_dump_png.
+ *
+ * The images are filtered in place after conversion, so the PTM itself is never held. With a
+ * scratch file they live there and the PTM is converted out-of-core like ptm_dump_png.
+ */
+void ptm_unsharp_dump_png(const char* filename, float sigma, float amount, const char* scratch_file, size_t memory_limit, bool sidecar)
+{
+    taf::PTMFileSink sink;
+
+    if (scratch_file)
+    {
+        taf::MappedFile scratch;
+        unsigned char *coeff_h, *coeff_l, *rgb;
+
+        taf::PTMHeader12 ptmh = taf::ptm_load(filename, scratch_file, memory_limit, &scratch, &coeff_h, &coeff_l, &rgb);
+
+        taf::ptm_unsharp_coefficients(ptmh.width, ptmh.height, sigma, amount, coeff_h, coeff_l);
+        taf::ptm_write_png(&ptmh, coeff_h, coeff_l, rgb, &sink, "", sidecar);
+        ptm_print_info(ptmh);
+        return;
+    }
+
+    taf::PTMImage image;
+    taf::ptm_load(filename, &image);
+
+    taf::ptm_unsharp_coefficients(image.width(), image.height(), sigma, amount, image.plane(taf::PTM_PLANE_COEFF_H).data, image.plane(taf::PTM_PLANE_COEFF_L).data);
+    taf::ptm_write_png(&image.header(), image.plane(taf::PTM_PLANE_COEFF_H).data, image.plane(taf::PTM_PLANE_COEFF_L).data, image.plane(taf::PTM_PLANE_RGB).data, &sink, "", sidecar);
+    ptm_print_info(image.header());
+}
+
+/**
+ * Unsharp mask the coefficients or the normals of a PTM and relight it.
+ *
+ * Sharpened coefficients are relit to relit.png. Sharpened normals are written to normals.png,
+ * and with a light direction the PTM is also shaded with them to relit.png.
+ */
+void ptm_unsharp_png(const char* filename, float sigma, float amount, bool normals, const float* light_dir, const taf::PTMPointLight* point, const char* environment, float exposure, bool relight)
+{
+    taf::PTM12 ptm;
+    taf::ptm_load(filename, &ptm);
+
+    const size_t w = ptm.header.width;
+    const size_t h = ptm.header.height;
+
+    if (normals)
+    {
+        std::vector<float> n(w * h * 3);
+        taf::ptm_unsharp_normals(&ptm, sigma, amount, &n[0]);
+
+        taf::uchar_vec out(w * h * 3);
+
+        for (size_t i = 0; i < n.size(); ++i)
+            out[i] = static_cast<unsigned char>((n[i] * 0.5f + 0.5f) * 255.f + 0.5f);
+
+        if (!stbi_write_png("normals.png", static_cast<int>(w), static_cast<int>(h), 3, &out[0], 0))
+            throw std::runtime_error("Couldn't write PNG file");
+
+        if (relight)
+        {
+            if (point || environment)
+                throw std::runtime_error("Sharpened normals can only be relit with --light");
+
+            taf::ptm_shade_normals(&ptm, &n[0], light_dir[0], light_dir[1], &out[0]);
+
+            if (!stbi_write_png("relit.png", static_cast<int>(w), static_cast<int>(h), 3, &out[0], 0))
+                throw std::runtime_error("Couldn't write PNG file");
+        }
+
+        return;
+    }
+
+    taf::PTM12 sharpened;
+    taf::ptm_unsharp_coefficients(&ptm, sigma, amount, &sharpened);
+
+    ptm_relight_png(sharpened, light_dir, point, environment, exposure);
+}
+
+/**
+ * Fit a material to a PTM and write its maps to prefix_albedo.png, prefix_normal.png,
+ * prefix_specular.png and prefix_shininess.png.
+ */
+void ptm_material_png(const char* filename, const std::string& prefix)
+{
+    taf::PTM12 ptm;
+    taf::ptm_load(filename, &ptm);
+
+    taf::PTMMaterial material;
+    taf::ptm_fit_material(&ptm, &material);
+
+    const int w = static_cast<int>(material.width);
+    const int h = static_cast<int>(material.height);
+
+    if (!stbi_write_png((prefix + "_albedo.png").c_str(), w, h, 3, &material.albedo[0], 0) ||
+        !stbi_write_png((prefix + "_normal.png").c_str(), w, h, 3, &material.normal[0], 0) ||
+        !stbi_write_png((prefix + "_specular.png").c_str(), w, h, 1, &material.specular[0], 0) ||
+        !stbi_write_png((prefix + "_shininess.png").c_str(), w, h, 1, &material.shininess[0], 0))
+        throw std::runtime_error("Couldn't write PNG file");
+}
+
+/**
+ * Write the brightest, darkest and mean appearance of a PTM over all light directions to
+ * prefix_max.png, prefix_min.png and prefix_mean.png.
+ */
+void ptm_hemisphere_png(const char* filename, const std::string& prefix)
+{
+    taf::PTM12 ptm;
+    taf::ptm_load(filename, &ptm);
+
+    taf::PTMHemisphere hemisphere;
+    taf::ptm_hemisphere(&ptm, &hemisphere);
+
+    const int w = static_cast<int>(hemisphere.width);
+    const int h = static_cast<int>(hemisphere.height);
+
+    if (!stbi_write_png((prefix + "_max.png").c_str(), w, h, 3, &hemisphere.max[0], 0) ||
+        !stbi_write_png((prefix + "_min.png").c_str(), w, h, 3, &hemisphere.min[0], 0) ||
+        !stbi_write_png((prefix + "_mean.png").c_str(), w, h, 3, &hemisphere.mean[0], 0))
+        throw std::runtime_error("Couldn't write PNG file");
+}
+
+/**
+ * Write contact sheets of PTM previews.
+ *
+ * The files are laid out row by row on sheets of columns x rows cells of cell x cell pixels,
+ * written as prefix_000.png, prefix_001.png and so on. Each preview is read at the smallest
+ * multiple of 1/8 scale that fits its cell, so JPEG PTMs are decoded from DC coefficients only.
+ * Cells of one sheet are filled in parallel and every sheet is written before the next is
+ * started. Files which fail to load are reported and leave their cell black.
+ */
+void ptm_contact_sheet(const std::vector<std::string>& files, const char* prefix, size_t columns, size_t rows, size_t cell)
+{
+    const size_t per_sheet = columns * rows;
+    const size_t sheet_width = columns * cell;
+    const size_t num_sheets = (files.size() + per_sheet - 1) / per_sheet;
+
+    std::vector<unsigned char> sheet(sheet_width * rows * cell * 3);
+    std::mutex log_mutex;
+
+    for (size_t s = 0; s < num_sheets; ++s)
+    {
+        std::fill(sheet.begin(), sheet.end(), 0);
+
+        const size_t first = s * per_sheet;
+        const size_t count = std::min(per_sheet, files.size() - first);
+
+        taf::detail::parallel_for(0, count, 1, [&](size_t begin, size_t end)
+        {
+            taf::uchar_vec preview;
+
+            for (size_t i = begin; i < end; ++i)
+            {
+                const std::string& file = files[first + i];
+
+                try
+                {
+                    taf::PTMHeader12 ptmh = taf::ptm_probe(file.c_str());
+
+                    size_t scale = (std::max(ptmh.width, ptmh.height) + cell - 1) / cell;
+                    scale = std::max<size_t>((scale + 7) / 8 * 8, 8);
+
+                    ptmh = taf::ptm_preview(file.c_str(), scale, &preview);
+
+                    const size_t pw = (ptmh.width + scale - 1) / scale;
+                    const size_t ph = (ptmh.height + scale - 1) / scale;
+
+                    // center the preview in its cell
+                    const size_t x0 = (i % columns) * cell + (cell - pw) / 2;
+                    const size_t y0 = (i / columns) * cell + (cell - ph) / 2;
+
+                    for (size_t y = 0; y < ph; ++y)
+                        std::copy(&preview[y * pw * 3], &preview[y * pw * 3] + pw * 3, &sheet[((y0 + y) * sheet_width + x0) * 3]);
+                }
+                catch (std::exception& e)
+                {
+                    std::lock_guard<std::mutex> lock(log_mutex);
+                    std::clog << file << ": " << e.what() << std::endl;
+                }
+            }
+        });
+
+        char name[32];
+        std::snprintf(name, sizeof(name), "_%03zu.png", s);
+
+        std::string filename = std::string(prefix) + name;
+
+        if (!stbi_write_png(filename.c_str(), static_cast<int>(sheet_width), static_cast<int>(rows * cell), 3, &sheet[0], 0))
+            throw std::runtime_error("Can't write " + filename);
+
+        std::clog << "Wrote " << filename << " with " << count << " previews" << std::endl;
+    }
 }
 
 int main(int argc, char** argv)
 {
     try
     {
-        if (argc < 2)
-            throw std::runtime_error("No input file");
+        const char* scratch = nullptr;
+        size_t memory_limit = 256;
+        bool stats = false;
+        bool sidecar = false;
+
+        const char* manifest = nullptr;
+        std::string out_dir = ".";
+        size_t shard = 0, num_shards = 1, jobs = 0;
+        const char* merge = nullptr;
+        const char* lossless = nullptr;
+        const char* rebuild = nullptr;
+        const char* serve = nullptr;
+        const char* shared = nullptr;
+        const char* metrics = nullptr;
+        const char* archive = nullptr;
+        const char* contact_sheet = nullptr;
+        const char* material = nullptr;
+        const char* hemisphere = nullptr;
+        float unsharp[2] = { 0.f, 0.f };
+        bool unsharp_normals = false;
+        size_t columns = 8, rows = 8, cell = 128;
+        std::vector<const char*> inputs;
+
+        bool relight = false, point = false;
+        const char* environment = nullptr;
+        float exposure = 1.f;
+        float light_dir[2] = { 0.f, 0.f };
+        float tonemap[2] = { 0.f, 1.f };
+        taf::PTMPointLight point_light = { { 0.f, 0.f, 1.f }, 1.f, 0.f, { 0.f, 0.f, 0.f }, 1.f, 1.f };
+
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+
+            if (arg == "--stats-coeff")
+                stats = true;
+            else if (arg == "--sidecar")
+                sidecar = true;
+            else if (arg == "--scratch" && i + 1 < argc)
+                scratch = argv[++i];
+            else if (arg == "--memory-limit" && i + 1 < argc)
+                memory_limit = std::strtoul(argv[++i], nullptr, 10);
+            else if (arg == "--manifest" && i + 1 < argc)
+                manifest = argv[++i];
+            else if (arg == "--jobs" && i + 1 < argc)
+                jobs = std::strtoul(argv[++i], nullptr, 10);
+            else if (arg == "--shard" && i + 1 < argc)
+            {
+                if (std::sscanf(argv[++i], "%zu/%zu", &shard, &num_shards) != 2 || shard >= num_shards)
+                    throw std::runtime_error("Invalid shard, expected i/N with i < N");
+            }
+            else if (arg == "--out-dir" && i + 1 < argc)
+                out_dir = argv[++i];
+            else if (arg == "--merge-manifests" && i + 1 < argc)
+                merge = argv[++i];
+            else if (arg == "--lossless" && i + 1 < argc)
+                lossless = argv[++i];
+            else if (arg == "--rebuild" && i + 1 < argc)
+                rebuild = argv[++i];
+            else if (arg == "--serve" && i + 1 < argc)
+                serve = argv[++i];
+            else if (arg == "--shared" && i + 1 < argc)
+                shared = argv[++i];
+            else if (arg == "--metrics" && i + 1 < argc)
+                metrics = argv[++i];
+            else if (arg == "--archive" && i + 1 < argc)
+                archive = argv[++i];
+            else if ((arg == "--unsharp-coeff" || arg == "--unsharp-normals") && i + 2 < argc)
+            {
+                unsharp_normals = arg == "--unsharp-normals";
+                unsharp[0] = static_cast<float>(std::atof(argv[++i]));
+                unsharp[1] = static_cast<float>(std::atof(argv[++i]));
+
+                if (unsharp[0] <= 0.f)
+                    throw std::runtime_error("Invalid unsharp mask radius");
+            }
+            else if (arg == "--material" && i + 1 < argc)
+                material = argv[++i];
+            else if (arg == "--hemisphere" && i + 1 < argc)
+                hemisphere = argv[++i];
+            else if (arg == "--contact-sheet" && i + 1 < argc)
+                contact_sheet = argv[++i];
+            else if (arg == "--grid" && i + 1 < argc)
+            {
+                if (std::sscanf(argv[++i], "%zux%zu", &columns, &rows) != 2 || columns == 0 || rows == 0)
+                    throw std::runtime_error("Invalid grid, expected CxR");
+            }
+            else if (arg == "--cell" && i + 1 < argc)
+            {
+                cell = std::strtoul(argv[++i], nullptr, 10);
+
+                if (cell < 8)
+                    throw std::runtime_error("Invalid cell size");
+            }
+            else if (arg == "--light" && i + 2 < argc)
+            {
+                relight = true;
+                light_dir[0] = static_cast<float>(std::atof(argv[++i]));
+                light_dir[1] = static_cast<float>(std::atof(argv[++i]));
+            }
+            else if (arg == "--tonemap" && i + 2 < argc)
+            {
+                tonemap[0] = static_cast<float>(std::atof(argv[++i]));
+                tonemap[1] = static_cast<float>(std::atof(argv[++i]));
+
+                if (tonemap[0] <= 0.f || tonemap[1] <= 0.f)
+                    throw std::runtime_error("Invalid tone mapping");
+            }
+            else if (arg == "--point-light" && i + 3 < argc)
+            {
+                relight = point = true;
+                for (size_t k = 0; k < 3; ++k)
+                    point_light.position[k] = static_cast<float>(std::atof(argv[++i]));
+            }
+            else if (arg == "--environment" && i + 1 < argc)
+            {
+                relight = true;
+                environment = argv[++i];
+            }
+            else if (arg == "--exposure" && i + 1 < argc)
+                exposure = static_cast<float>(std::atof(argv[++i]));
+            else if (arg == "--intensity" && i + 1 < argc)
+                point_light.intensity = static_cast<float>(std::atof(argv[++i]));
+            else if (arg == "--falloff" && i + 1 < argc)
+                point_light.falloff = static_cast<float>(std::atof(argv[++i]));
+            else if (arg == "--spot" && i + 5 < argc)
+            {
+                for (size_t k = 0; k < 3; ++k)
+                    point_light.spot_direction[k] = static_cast<float>(std::atof(argv[++i]));
+
+                // inner and outer cone angles in degrees
+                point_light.cos_inner = std::cos(static_cast<float>(std::atof(argv[++i])) * 3.14159265f / 180.f);
+                point_light.cos_outer = std::cos(static_cast<float>(std::atof(argv[++i])) * 3.14159265f / 180.f);
+            }
+            else if (arg.compare(0, 2, "--") == 0)
+                throw std::runtime_error("Unknown option: " + arg);
+            else
+                inputs.push_back(argv[i]);
+        }
+
+        // only directional relighting runs through the fused tone mapping pipeline
+        if (tonemap[0] > 0.f && (!relight || point || environment || unsharp[0] > 0.f))
+            throw std::runtime_error("--tonemap expects --light and can't be combined with --point-light, --environment or --unsharp-*");
+
+        if (contact_sheet)
+        {
+            std::vector<std::string> files = manifest ? ptm_read_manifest(manifest) : std::vector<std::string>(inputs.begin(), inputs.end());
+
+            if (files.empty())
+                throw std::runtime_error("No input file");
+
+            ptm_contact_sheet(files, contact_sheet, columns, rows, cell);
+        }
+        else if (merge)
+        {
+            if (!manifest)
+                throw std::runtime_error("--merge-manifests expects --manifest with the input files");
+
+            ptm_merge_manifests(merge, manifest, inputs);
+        }
+        else if (manifest)
+            ptm_batch(manifest, shard, num_shards, out_dir, archive, sidecar, jobs);
+        else if (serve)
+            ptm_serve(serve, memory_limit << 20);
+        else if (rebuild)
+        {
+            if (inputs.size() != 4)
+                throw std::runtime_error("--rebuild expects coeff_h.png coeff_l.png rgb.png header.txt");
+
+            ptm_rebuild(inputs[0], inputs[1], inputs[2], inputs[3], rebuild);
+        }
+        else
+        {
+            if (inputs.empty())
+                throw std::runtime_error("No input file");
+
+            const char* input = inputs[0];
+
+            if (lossless)
+                ptm_save_lossless(input, lossless);
+            else if (stats)
+                ptm_print_stats(input);
+            else if (material)
+                ptm_material_png(input, material);
+            else if (hemisphere)
+                ptm_hemisphere_png(input, hemisphere);
+            else if (unsharp[0] > 0.f && !unsharp_normals && !relight)
+                ptm_unsharp_dump_png(input, unsharp[0], unsharp[1], scratch, memory_limit << 20, sidecar);
+            else if (unsharp[0] > 0.f)
+                ptm_unsharp_png(input, unsharp[0], unsharp[1], unsharp_normals, light_dir, point ? &point_light : nullptr, environment, exposure, relight);
+            else if (relight && tonemap[0] > 0.f)
+                ptm_relight_tonemap_png(input, light_dir, tonemap[0], tonemap[1]);
+            else if (relight)
+            {
+                taf::PTM12 ptm;
+                taf::ptm_load(input, &ptm);
+
+                ptm_relight_png(ptm, light_dir, point ? &point_light : nullptr, environment, exposure);
+            }
+            else if (shared)
+                ptm_dump_png_shared(shared, input, sidecar);
+            else if (scratch)
+                ptm_dump_png(input, scratch, memory_limit << 20, sidecar);
+            else
+                ptm_dump_png(input, sidecar);
+        }
 
-        ptm_dump_png(argv[1]);
+        if (metrics)
+            ptm_write_metrics(metrics);
     }
     catch (std::exception& e)
     {
@@ -0,0 +1,111 @@
+/*
+ * ptmdiff - Tobias Alexander Franke 2012
+ * For copyright and license see LICENSE
+ * http://www.tobias-franke.eu
+ */
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+
+#define TAF_PTM_IMPLEMENTATION
+#include "taf_ptm.h"
+
+/**
+ * Print the result of a comparison as JSON.
+ */
+void ptm_print_diff(const taf::PTMDiff& diff, const std::vector<std::pair<float, float>>& lights)
+{
+    static const char* names[] = { "a0", "a1", "a2", "a3", "a4", "a5", "r", "g", "b" };
+
+    auto&& out = std::cout;
+
+    out << "{" << std::endl;
+    out << "  \"planes\": [" << std::endl;
+
+    for (size_t p = 0; p < 9; ++p)
+    {
+        out << "    { \"plane\": \"" << names[p] << "\"";
+        out << ", \"mse\": " << diff.mse[p];
+
+        // JSON has no infinity; identical planes report null
+        if (diff.mse[p] > 0)
+            out << ", \"psnr\": " << diff.psnr[p];
+        else
+            out << ", \"psnr\": null";
+
+        out << ", \"max_error\": " << diff.max_error[p];
+        out << " }" << (p < 8 ? "," : "") << std::endl;
+    }
+
+    out << "  ]," << std::endl;
+    out << "  \"relit\": [" << std::endl;
+
+    for (size_t i = 0; i < lights.size(); ++i)
+    {
+        out << "    { \"lu\": " << lights[i].first << ", \"lv\": " << lights[i].second;
+        out << ", \"ssim\": " << diff.ssim[i] << " }" << (i + 1 < lights.size() ? "," : "") << std::endl;
+    }
+
+    out << "  ]" << std::endl;
+    out << "}" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        std::vector<const char*> inputs;
+        std::vector<std::pair<float, float>> lights;
+
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+
+            if (arg == "--light" && i + 2 < argc)
+            {
+                lights.push_back(std::make_pair(static_cast<float>(std::atof(argv[i + 1])), static_cast<float>(std::atof(argv[i + 2]))));
+                i += 2;
+            }
+            else if (arg.compare(0, 2, "--") == 0)
+                throw std::runtime_error("Unknown option: " + arg);
+            else
+                inputs.push_back(argv[i]);
+        }
+
+        if (inputs.size() != 2 && inputs.size() != 4)
+            throw std::runtime_error("Usage: ptmdiff [--light lu lv]... a.ptm (b.ptm | coeff_h.png coeff_l.png rgb.png)");
+
+        // default: head-on light and a ring of 8 raking lights
+        if (lights.empty())
+        {
+            const float d = 0.7f, s = 0.7f * 0.70710678f;
+            const float ring[8][2] = { { d, 0 }, { s, s }, { 0, d }, { -s, s }, { -d, 0 }, { -s, -s }, { 0, -d }, { s, -s } };
+
+            lights.push_back(std::make_pair(0.f, 0.f));
+
+            for (auto& l : ring)
+                lights.push_back(std::make_pair(l[0], l[1]));
+        }
+
+        taf::PTM12 a, b;
+        taf::ptm_load(inputs[0], &a);
+
+        if (inputs.size() == 2)
+            taf::ptm_load(inputs[1], &b);
+        else
+            taf::ptm_from_png(&a.header, inputs[1], inputs[2], inputs[3], &b);
+
+        taf::PTMDiff diff;
+        taf::ptm_diff(&a, &b, lights, &diff);
+
+        ptm_print_diff(diff, lights);
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -14,6 +14,7 @@
 
    You can #define STBI_ASSERT(x) before the #include to avoid using assert.h.
    And #define STBI_MALLOC, STBI_REALLOC, and STBI_FREE to avoid using malloc,realloc,free
+   And #define STBI_YIELD() to run code after every row of JPEG blocks, e.g. to yield to other work
 
 
    QUICK NOTES:
@@ -431,6 +432,11 @@ STBIDEF stbi_uc *stbi_load               (char              const *filename,
 STBIDEF stbi_uc *stbi_load_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *comp, int req_comp);
 STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *comp, int req_comp);
 
+// like stbi_load_from_memory, but baseline grayscale JPEGs are only decoded from their DC
+// coefficients into an image of 1/8 size, rounded up: every pixel is the average of an 8x8 block.
+// AC coefficients are skipped without dequantizing and there is no IDCT. Other images fail.
+STBIDEF stbi_uc *stbi_load_from_memory_dc(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+
 #ifndef STBI_NO_STDIO
 STBIDEF stbi_uc *stbi_load_from_file  (FILE *f,                  int *x, int *y, int *comp, int req_comp);
 // for stbi_load_from_file, file pointer is left pointing immediately after image
@@ -574,6 +580,10 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 #define STBI_ASSERT(x) assert(x)
 #endif
 
+#ifndef STBI_YIELD
+#define STBI_YIELD()
+#endif
+
 
 #ifndef _MSC_VER
    #ifdef __cplusplus
@@ -749,6 +759,8 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original;
+
+   int jpeg_dc_only;
 } stbi__context;
 
 
@@ -761,6 +773,7 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
    s->read_from_callbacks = 0;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = (stbi_uc *) buffer+len;
+   s->jpeg_dc_only = 0;
 }
 
 // initialize a callback-based context
@@ -771,6 +784,7 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->buflen = sizeof(s->buffer_start);
    s->read_from_callbacks = 1;
    s->img_buffer_original = s->buffer_start;
+   s->jpeg_dc_only = 0;
    stbi__refill_buffer(s);
 }
 
@@ -1056,6 +1070,14 @@ STBIDEF stbi_uc *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, i
    return stbi__load_flip(&s,x,y,comp,req_comp);
 }
 
+STBIDEF stbi_uc *stbi_load_from_memory_dc(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   s.jpeg_dc_only = 1;
+   return stbi__load_flip(&s,x,y,comp,req_comp);
+}
+
 STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
 {
    stbi__context s;
@@ -1488,6 +1510,8 @@ typedef struct
    int scan_n, order[4];
    int restart_interval, todo;
 
+   int dc_only;         // decode one pixel per block from the DC coefficient
+
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
@@ -1744,6 +1768,51 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
    return 1;
 }
 
+// decode the DC value of one block and skip its AC values
+static int stbi__jpeg_decode_block_dc_only(stbi__jpeg *j, int *dc, stbi__huffman *hdc, stbi__huffman *hac, stbi__int16 *fac, int b, stbi_uc *dequant)
+{
+   int diff,k;
+   int t;
+
+   if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+   t = stbi__jpeg_huff_decode(j, hdc);
+   if (t < 0) return stbi__err("bad huffman code","Corrupt JPEG");
+
+   diff = t ? stbi__extend_receive(j, t) : 0;
+   j->img_comp[b].dc_pred += diff;
+   *dc = j->img_comp[b].dc_pred * dequant[0];
+
+   // AC values still have to be parsed to find the next block, but their bits are dropped
+   k = 1;
+   do {
+      int c,r,s;
+      if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+      c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+      r = fac[c];
+      if (r) { // fast-AC path
+         k += ((r >> 4) & 15) + 1;
+         s = r & 15;
+         j->code_buffer <<= s;
+         j->code_bits -= s;
+      } else {
+         int rs = stbi__jpeg_huff_decode(j, hac);
+         if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
+         s = rs & 15;
+         r = rs >> 4;
+         if (s == 0) {
+            if (rs != 0xf0) break; // end block
+            k += 16;
+         } else {
+            k += r + 1;
+            if (j->code_bits < s) stbi__grow_buffer_unsafe(j);
+            j->code_buffer <<= s;
+            j->code_bits -= s;
+         }
+      }
+   } while (k < 64);
+   return 1;
+}
+
 static int stbi__jpeg_decode_block_prog_dc(stbi__jpeg *j, short data[64], stbi__huffman *hdc, int b)
 {
    int diff,dc;
@@ -2439,10 +2508,18 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
          for (j=0; j < h; ++j) {
+            STBI_YIELD();
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               if (z->dc_only) {
+                  // the block average is dc/8 around 128, one pixel per block
+                  int dc;
+                  if (!stbi__jpeg_decode_block_dc_only(z, &dc, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  z->img_comp[n].data[(size_t)(z->img_comp[n].w2 >> 3)*j+i] = stbi__clamp(((dc + 4) >> 3) + 128);
+               } else {
+                  if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  z->idct_block_kernel(z->img_comp[n].data+(size_t)z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               }
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
@@ -2458,6 +2535,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          int i,j,k,x,y;
          STBI_SIMD_ALIGN(short, data[64]);
          for (j=0; j < z->img_mcu_y; ++j) {
+            STBI_YIELD();
             for (i=0; i < z->img_mcu_x; ++i) {
                // scan an interleaved mcu... process scan_n components in order
                for (k=0; k < z->scan_n; ++k) {
@@ -2470,7 +2548,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                         int y2 = (j*z->img_comp[n].v + y)*8;
                         int ha = z->img_comp[n].ha;
                         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+                        z->idct_block_kernel(z->img_comp[n].data+(size_t)z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
                      }
                   }
                }
@@ -2496,8 +2574,9 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
          for (j=0; j < h; ++j) {
+            STBI_YIELD();
             for (i=0; i < w; ++i) {
-               short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+               short *data = z->img_comp[n].coeff + 64 * (i + (size_t)j * z->img_comp[n].coeff_w);
                if (z->spec_start == 0) {
                   if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
                      return 0;
@@ -2518,6 +2597,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
       } else { // interleaved
          int i,j,k,x,y;
          for (j=0; j < z->img_mcu_y; ++j) {
+            STBI_YIELD();
             for (i=0; i < z->img_mcu_x; ++i) {
                // scan an interleaved mcu... process scan_n components in order
                for (k=0; k < z->scan_n; ++k) {
@@ -2528,7 +2608,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                      for (x=0; x < z->img_comp[n].h; ++x) {
                         int x2 = (i*z->img_comp[n].h + x);
                         int y2 = (j*z->img_comp[n].v + y);
-                        short *data = z->img_comp[n].coeff + 64 * (x2 + y2 * z->img_comp[n].coeff_w);
+                        short *data = z->img_comp[n].coeff + 64 * (x2 + (size_t)y2 * z->img_comp[n].coeff_w);
                         if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
                            return 0;
                      }
@@ -2565,9 +2645,9 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
          int h = (z->img_comp[n].y+7) >> 3;
          for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
-               short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+               short *data = z->img_comp[n].coeff + 64 * (i + (size_t)j * z->img_comp[n].coeff_w);
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               z->idct_block_kernel(z->img_comp[n].data+(size_t)z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
             }
          }
       }
@@ -2708,7 +2788,11 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
 
    if (scan != STBI__SCAN_load) return 1;
 
-   if ((1 << 30) / s->img_x / s->img_n < s->img_y) return stbi__err("too large", "Image too large to decode");
+   if (z->dc_only && (z->progressive || s->img_n != 1))
+      return stbi__err("not baseline grayscale", "DC-only decode needs a baseline grayscale JPEG");
+
+   // JPEG dimensions are 16 bit, so with a 64 bit size_t every image fits
+   if (sizeof(size_t) < 8 && (1 << 30) / s->img_x / s->img_n < s->img_y) return stbi__err("too large", "Image too large to decode");
 
    for (i=0; i < s->img_n; ++i) {
       if (z->img_comp[i].h > h_max) h_max = z->img_comp[i].h;
@@ -2733,7 +2817,11 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       // discard the extra data until colorspace conversion
       z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
       z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
-      z->img_comp[i].raw_data = stbi__malloc(z->img_comp[i].w2 * z->img_comp[i].h2+15);
+      // DC-only decodes keep one pixel per block
+      if (z->dc_only)
+         z->img_comp[i].raw_data = stbi__malloc((size_t)(z->img_comp[i].w2 >> 3) * (z->img_comp[i].h2 >> 3)+15);
+      else
+         z->img_comp[i].raw_data = stbi__malloc((size_t)z->img_comp[i].w2 * z->img_comp[i].h2+15);
 
       if (z->img_comp[i].raw_data == NULL) {
          for(--i; i >= 0; --i) {
@@ -2748,7 +2836,7 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       if (z->progressive) {
          z->img_comp[i].coeff_w = (z->img_comp[i].w2 + 7) >> 3;
          z->img_comp[i].coeff_h = (z->img_comp[i].h2 + 7) >> 3;
-         z->img_comp[i].raw_coeff = STBI_MALLOC(z->img_comp[i].coeff_w * z->img_comp[i].coeff_h * 64 * sizeof(short) + 15);
+         z->img_comp[i].raw_coeff = STBI_MALLOC((size_t)z->img_comp[i].coeff_w * z->img_comp[i].coeff_h * 64 * sizeof(short) + 15);
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
       } else {
          z->img_comp[i].coeff = 0;
@@ -3232,6 +3320,7 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
+   j->dc_only = 0;
    j->idct_block_kernel = stbi__idct_block;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
@@ -3301,6 +3390,30 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // determine actual number of components to generate
    n = req_comp ? req_comp : z->s->img_n;
 
+   // DC-only images are grayscale, one pixel per block and already final
+   if (z->dc_only) {
+      unsigned int i,j;
+      unsigned int w = (z->s->img_x + 7) >> 3, h = (z->s->img_y + 7) >> 3;
+      int stride = z->img_comp[0].w2 >> 3;
+      stbi_uc *output = (stbi_uc *) stbi__malloc((size_t)n * w * h);
+      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+      for (j=0; j < h; ++j) {
+         stbi_uc *in = z->img_comp[0].data + (size_t)stride * j;
+         stbi_uc *out = output + (size_t)n * w * j;
+         for (i=0; i < w; ++i, out += n) {
+            out[0] = in[i];
+            if (n >= 3) out[1] = out[2] = in[i];
+            if (n == 2) out[1] = 255;
+            if (n == 4) out[3] = 255;
+         }
+      }
+      stbi__cleanup_jpeg(z);
+      *out_x = w;
+      *out_y = h;
+      if (comp) *comp = 1;
+      return output;
+   }
+
    if (z->s->img_n == 3 && n < 3)
       decode_n = 1;
    else
@@ -3338,12 +3451,12 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
       }
 
       // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc(n * z->s->img_x * z->s->img_y + 1);
+      output = (stbi_uc *) stbi__malloc((size_t)n * z->s->img_x * z->s->img_y + 1);
       if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
 
       // now go ahead and resample
       for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
+         stbi_uc *out = output + (size_t)n * z->s->img_x * j;
          for (k=0; k < decode_n; ++k) {
             stbi__resample *r = &res_comp[k];
             int y_bot = r->ystep >= (r->vs >> 1);
@@ -3389,6 +3502,7 @@ static unsigned char *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *com
    stbi__jpeg j;
    j.s = s;
    stbi__setup_jpeg(&j);
+   j.dc_only = s->jpeg_dc_only;
    return load_jpeg_image(&j, x,y,comp,req_comp);
 }
 
@@ -37,6 +37,15 @@ USAGE:
      int stbi_write_tga(char const *filename, int w, int h, int comp, const void *data);
      int stbi_write_hdr(char const *filename, int w, int h, int comp, const void *data);
 
+   PNGs can also be handed to a callback in pieces instead of written to a file:
+
+     int stbi_write_png_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void *data, int stride_in_bytes);
+
+   If the receiver needs the size of the whole file before its first piece,
+   e.g. to write an archive header, size_func is called with it first:
+
+     int stbi_write_png_to_func_sized(stbi_write_func *func, stbi_write_size_func *size_func, void *context, int w, int h, int comp, const void *data, int stride_in_bytes);
+
    Each function returns 0 on failure and non-0 on success.
 
    The functions create an image file defined by the parameters. The image
@@ -89,6 +98,12 @@ extern int stbi_write_bmp(char const *filename, int w, int h, int comp, const vo
 extern int stbi_write_tga(char const *filename, int w, int h, int comp, const void  *data);
 extern int stbi_write_hdr(char const *filename, int w, int h, int comp, const float *data);
 
+typedef void stbi_write_func(void *context, void *data, int size);
+typedef void stbi_write_size_func(void *context, int size);
+
+extern int stbi_write_png_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void *data, int stride_in_bytes);
+extern int stbi_write_png_to_func_sized(stbi_write_func *func, stbi_write_size_func *size_func, void *context, int w, int h, int comp, const void *data, int stride_in_bytes);
+
 #ifdef __cplusplus
 }
 #endif
@@ -127,6 +142,7 @@ extern int stbi_write_hdr(char const *filename, int w, int h, int comp, const fl
 #endif
 
 typedef unsigned int stbiw_uint32;
+typedef unsigned long long stbiw_uint64;
 typedef int stb_image_write_test[sizeof(stbiw_uint32)==4 ? 1 : -1];
 
 static void writefv(FILE *f, const char *fmt, va_list v)
@@ -432,10 +448,34 @@ static int stbiw__zlib_bitrev(int code, int codebits)
    return res;
 }
 
+#define stbiw__ZHASH_BITS 15
+#define stbiw__ZHASH   (1 << stbiw__ZHASH_BITS)
+#define stbiw__ZWINDOW 32768
+// search effort: a match of ZGOOD bytes shortens the chain walk, one of ZNICE bytes ends it, and
+// matches of ZLAZY bytes or more are taken without looking at the next byte
+#define stbiw__ZGOOD   4
+#define stbiw__ZNICE   64
+#define stbiw__ZLAZY   4
+
 static unsigned int stbiw__zlib_countm(unsigned char *a, unsigned char *b, int limit)
 {
-   int i;
-   for (i=0; i < limit && i < 258; ++i)
+   int i=0;
+   if (limit > 258) limit = 258;
+   // compare 8 bytes at a time, then find the first differing byte
+   while (i+8 <= limit) {
+      stbiw_uint64 x, y;
+      memcpy(&x, a+i, 8);
+      memcpy(&y, b+i, 8);
+      if (x != y) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+         return i + (__builtin_ctzll(x ^ y) >> 3);
+#else
+         break;
+#endif
+      }
+      i += 8;
+   }
+   for (; i < limit; ++i)
       if (a[i] != b[i]) break;
    return i;
 }
@@ -443,110 +483,374 @@ static unsigned int stbiw__zlib_countm(unsigned char *a, unsigned char *b, int l
 static unsigned int stbiw__zhash(unsigned char *data)
 {
    stbiw_uint32 hash = data[0] + (data[1] << 8) + (data[2] << 16);
-   hash ^= hash << 3;
-   hash += hash >> 5;
-   hash ^= hash << 4;
-   hash += hash >> 17;
-   hash ^= hash << 25;
-   hash += hash >> 6;
-   return hash;
+   return (hash * 2654435761u) >> (32 - stbiw__ZHASH_BITS);
 }
 
 #define stbiw__zlib_flush() (out = stbiw__zlib_flushf(out, &bitbuf, &bitcount))
 #define stbiw__zlib_add(code,codebits) \
       (bitbuf |= (code) << bitcount, bitcount += (codebits), stbiw__zlib_flush())
-#define stbiw__zlib_huffa(b,c)  stbiw__zlib_add(stbiw__zlib_bitrev(b,c),c)
-// default huffman tables
-#define stbiw__zlib_huff1(n)  stbiw__zlib_huffa(0x30 + (n), 8)
-#define stbiw__zlib_huff2(n)  stbiw__zlib_huffa(0x190 + (n)-144, 9)
-#define stbiw__zlib_huff3(n)  stbiw__zlib_huffa(0 + (n)-256,7)
-#define stbiw__zlib_huff4(n)  stbiw__zlib_huffa(0xc0 + (n)-280,8)
-#define stbiw__zlib_huff(n)  ((n) <= 143 ? stbiw__zlib_huff1(n) : (n) <= 255 ? stbiw__zlib_huff2(n) : (n) <= 279 ? stbiw__zlib_huff3(n) : stbiw__zlib_huff4(n))
-#define stbiw__zlib_huffb(n) ((n) <= 143 ? stbiw__zlib_huff1(n) : stbiw__zlib_huff2(n))
+// code of a literal or length in the default huffman tables
+#define stbiw__zlib_fixed(n)  ((n) <= 143 ? 0x30 + (n) : (n) <= 255 ? 0x190 + (n)-144 : (n) <= 279 ? 0 + (n)-256 : 0xc0 + (n)-280)
+#define stbiw__zlib_fixedlen(n)  ((n) <= 143 ? 8 : (n) <= 255 ? 9 : (n) <= 279 ? 7 : 8)
+
+#define stbiw__ZBLOCK  16384   // symbols per deflate block
+
+static unsigned short stbiw__lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
+static unsigned char  stbiw__lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
+static unsigned short stbiw__distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
+static unsigned char  stbiw__disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+// state of one stbi_zlib_compress call: the symbols of the current block with their counts, and
+// lookup tables for codes
+typedef struct
+{
+   unsigned short *lit;           // literal byte, or 256 + match length
+   unsigned short *dist;          // match distance
+   int n;
+   unsigned int litfreq[286], distfreq[30];
+   unsigned char lencode[259];    // match length -> length code
+   unsigned char distcode[512];   // distance-1 below 256, then (distance-1) >> 7
+   unsigned short fixedcode[288], fixeddist[30];
+   unsigned char fixedlen[288];
+   unsigned char litbits[286], distbits[30]; // code lengths of the previous block, to price matches
+} stbiw__zlib_state;
+
+#define stbiw__zlib_dcode(z,d)  ((d) <= 256 ? (z)->distcode[(d)-1] : (z)->distcode[256 + (((d)-1) >> 7)])
+
+// huffman code lengths of the n symbols with counts freq, limited to maxbits. Lengths deeper than
+// maxbits are folded back into the tree as in zlib and miniz.
+static void stbiw__zlib_lengths(const unsigned int *freq, int n, int maxbits, unsigned char *len)
+{
+   int sym[288], parent[576], depth[576], count[16];
+   unsigned int w[576];
+   int m=0, i, k, leaf, node, next, total;
+
+   for (i=0; i < n; ++i) {
+      len[i] = 0;
+      if (freq[i]) {
+         // insertion sort by count, ascending
+         for (k=m++; k > 0 && freq[sym[k-1]] > freq[i]; --k)
+            sym[k] = sym[k-1];
+         sym[k] = i;
+      }
+   }
+   if (m == 0) return;
+   if (m == 1) { len[sym[0]] = 1; return; }
+
+   // two queues: leaves in ascending order, and internal nodes which are created in ascending order
+   for (i=0; i < m; ++i)
+      w[i] = freq[sym[i]];
+   leaf = 0, node = m;
+   for (next=m; next < 2*m-1; ++next) {
+      int a = (leaf < m && (node >= next || w[leaf] <= w[node])) ? leaf++ : node++;
+      int b = (leaf < m && (node >= next || w[leaf] <= w[node])) ? leaf++ : node++;
+      w[next] = w[a] + w[b];
+      parent[a] = parent[b] = next;
+   }
+   depth[2*m-2] = 0;
+   for (i=2*m-3; i >= 0; --i)
+      depth[i] = depth[parent[i]] + 1;
+
+   for (i=0; i <= maxbits; ++i)
+      count[i] = 0;
+   for (i=0; i < m; ++i)
+      ++count[depth[i] < maxbits ? depth[i] : maxbits];
+   for (total=0, i=1; i <= maxbits; ++i)
+      total += count[i] << (maxbits - i);
+   while (total > (1 << maxbits)) {
+      --count[maxbits];
+      for (i=maxbits-1; i > 0; --i)
+         if (count[i]) { --count[i]; count[i+1] += 2; break; }
+      --total;
+   }
+
+   // the least frequent symbols get the longest codes
+   for (k=0, i=maxbits; i > 0; --i)
+      for (next=count[i]; next > 0; --next)
+         len[sym[k++]] = (unsigned char) i;
+}
+
+// bit reversed canonical huffman codes for the given lengths
+static void stbiw__zlib_codes(const unsigned char *len, int n, unsigned short *code)
+{
+   int count[16], next[16], i, c=0;
+   for (i=0; i < 16; ++i) count[i] = 0;
+   for (i=0; i < n; ++i) ++count[len[i]];
+   count[0] = 0;
+   for (i=1; i < 16; ++i)
+      next[i] = c = (c + count[i-1]) << 1;
+   for (i=0; i < n; ++i)
+      code[i] = len[i] ? (unsigned short) stbiw__zlib_bitrev(next[len[i]]++, len[i]) : 0;
+}
+
+// write the symbols of a block with dynamic codes, fixed codes or stored, whichever is smallest
+static unsigned char *stbiw__zlib_block(unsigned char *out, unsigned int *bb, int *bc, stbiw__zlib_state *z, unsigned char *raw, int raw_len, int final)
+{
+   static unsigned char clorder[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+   unsigned int bitbuf = *bb, clfreq[19];
+   int bitcount = *bc, i, j, hlit, hdist, hclen, ncl=0;
+   unsigned char litlen[286], distlen[30], cllen[19], lens[286+30], cl[286+30], clextra[286+30];
+   unsigned short litcode[286], distcode[30], clcode[19];
+   unsigned short *lcode, *dcode;
+   unsigned char *llen, *dlen;
+   long fixedbits=0, dynbits=0, extrabits=0;
+
+   z->litfreq[256] = 1; // end of block
+   // a block without matches still needs one distance code
+   if (!z->distfreq[0]) z->distfreq[0] = 1;
+
+   stbiw__zlib_lengths(z->litfreq, 286, 15, litlen);
+   stbiw__zlib_lengths(z->distfreq, 30, 15, distlen);
+
+   for (hlit=286; hlit > 257 && !litlen[hlit-1]; --hlit);
+   for (hdist=30; hdist > 1 && !distlen[hdist-1]; --hdist);
+
+   // run length encode the code lengths of both trees
+   for (i=0; i < hlit; ++i) lens[i] = litlen[i];
+   for (i=0; i < hdist; ++i) lens[hlit+i] = distlen[i];
+   for (i=0; i < 19; ++i) clfreq[i] = 0;
+   for (i=0; i < hlit+hdist; i += j) {
+      int v = lens[i], r;
+      for (j=1; i+j < hlit+hdist && lens[i+j] == v; ++j);
+      r = j;
+      if (v == 0) {
+         while (r >= 11) { int k = r < 138 ? r : 138; cl[ncl] = 18, clextra[ncl++] = (unsigned char) (k-11), r -= k; }
+         if (r >= 3) { cl[ncl] = 17, clextra[ncl++] = (unsigned char) (r-3), r = 0; }
+      } else {
+         cl[ncl] = (unsigned char) v, clextra[ncl++] = 0, --r;
+         while (r >= 3) { int k = r < 6 ? r : 6; cl[ncl] = 16, clextra[ncl++] = (unsigned char) (k-3), r -= k; }
+      }
+      while (r-- > 0) cl[ncl] = (unsigned char) v, clextra[ncl++] = 0;
+   }
+   for (i=0; i < ncl; ++i) ++clfreq[cl[i]];
+   stbiw__zlib_lengths(clfreq, 19, 7, cllen);
+   for (hclen=19; hclen > 4 && !cllen[clorder[hclen-1]]; --hclen);
+
+   // compare the sizes, extra bits of lengths and distances are the same for both codes
+   for (i=0; i < 286; ++i) {
+      fixedbits += (long) z->litfreq[i] * z->fixedlen[i];
+      dynbits += (long) z->litfreq[i] * litlen[i];
+      if (i > 256) extrabits += (long) z->litfreq[i] * stbiw__lengtheb[i-257];
+   }
+   for (i=0; i < 30; ++i) {
+      fixedbits += (long) z->distfreq[i] * 5;
+      dynbits += (long) z->distfreq[i] * distlen[i];
+      extrabits += (long) z->distfreq[i] * stbiw__disteb[i];
+   }
+   dynbits += 14 + 3*hclen;
+   for (i=0; i < 19; ++i)
+      dynbits += (long) clfreq[i] * (cllen[i] + (i == 16 ? 2 : i == 17 ? 3 : i == 18 ? 7 : 0));
+
+   stbiw__zlib_add(final,1);
+
+   if (raw_len <= 65535 && (long) raw_len*8 + 32 <= (fixedbits < dynbits ? fixedbits : dynbits) + extrabits) {
+      stbiw__zlib_add(0,2);  // BTYPE = 0 -- stored
+      if (bitcount) stbiw__zlib_add(0, 8 - bitcount);
+      stbiw__sbpush(out, (unsigned char) raw_len);
+      stbiw__sbpush(out, (unsigned char) (raw_len >> 8));
+      stbiw__sbpush(out, (unsigned char) ~raw_len);
+      stbiw__sbpush(out, (unsigned char) (~raw_len >> 8));
+      stbiw__sbmaybegrow(out, raw_len);
+      memcpy(out + stbiw__sbn(out), raw, raw_len);
+      stbiw__sbn(out) += raw_len;
+   } else {
+      if (fixedbits <= dynbits) {
+         stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
+         lcode = z->fixedcode, llen = z->fixedlen, dcode = z->fixeddist, dlen = NULL;
+      } else {
+         stbiw__zlib_add(2,2);  // BTYPE = 2 -- dynamic huffman
+         stbiw__zlib_codes(litlen, 286, litcode);
+         stbiw__zlib_codes(distlen, 30, distcode);
+         stbiw__zlib_codes(cllen, 19, clcode);
+         stbiw__zlib_add(hlit-257,5);
+         stbiw__zlib_add(hdist-1,5);
+         stbiw__zlib_add(hclen-4,4);
+         for (i=0; i < hclen; ++i)
+            stbiw__zlib_add(cllen[clorder[i]],3);
+         for (i=0; i < ncl; ++i) {
+            stbiw__zlib_add(clcode[cl[i]], cllen[cl[i]]);
+            if (cl[i] >= 16) stbiw__zlib_add(clextra[i], cl[i] == 16 ? 2 : cl[i] == 17 ? 3 : 7);
+         }
+         lcode = litcode, llen = litlen, dcode = distcode, dlen = distlen;
+      }
+
+      // symbols go through a 64 bit accumulator into space reserved for the whole block, at most
+      // 15+5 bits for a literal or length and 15+13 bits for a distance
+      stbiw__sbmaybegrow(out, z->n * 6 + 8);
+      {
+         unsigned char *o = out + stbiw__sbn(out);
+         stbiw_uint64 acc = bitbuf;
+         int bits = bitcount;
+         #define stbiw__zlib_put(c,n)  (acc |= (stbiw_uint64) (c) << bits, bits += (n))
+         #define stbiw__zlib_put32()   if (bits >= 32) { o[0] = (unsigned char) acc, o[1] = (unsigned char) (acc >> 8), o[2] = (unsigned char) (acc >> 16), o[3] = (unsigned char) (acc >> 24); o += 4, acc >>= 32, bits -= 32; }
+         for (i=0; i < z->n; ++i) {
+            int v = z->lit[i];
+            if (v < 256) {
+               stbiw__zlib_put(lcode[v], llen[v]);
+            } else {
+               int len = v - 256, d = z->dist[i];
+               j = z->lencode[len];
+               stbiw__zlib_put(lcode[j+257], llen[j+257]);
+               stbiw__zlib_put(len - stbiw__lengthc[j], stbiw__lengtheb[j]);
+               stbiw__zlib_put32();
+               j = stbiw__zlib_dcode(z, d);
+               stbiw__zlib_put(dcode[j], dlen ? dlen[j] : 5);
+               stbiw__zlib_put(d - stbiw__distc[j], stbiw__disteb[j]);
+            }
+            stbiw__zlib_put32();
+         }
+         #undef stbiw__zlib_put
+         #undef stbiw__zlib_put32
+         for (; bits >= 8; bits -= 8, acc >>= 8)
+            *o++ = (unsigned char) acc;
+         stbiw__sbn(out) = (int) (o - out);
+         bitbuf = (unsigned int) acc, bitcount = bits;
+      }
+      stbiw__zlib_add(lcode[256], llen[256]); // end of block
+
+      // symbols missing from this block are assumed to be rare in the next one
+      for (i=0; i < 286; ++i) z->litbits[i] = llen[i] ? llen[i] : 12;
+      for (i=0; i < 30; ++i) z->distbits[i] = dlen ? (dlen[i] ? dlen[i] : 12) : 5;
+   }
 
-#define stbiw__ZHASH   16384
+   *bb = bitbuf, *bc = bitcount;
+   return out;
+}
+
+// longest match for data+i on its hash chain, or 0 if there is none of at least 3 bytes
+static int stbiw__zlib_longest(unsigned char *data, int data_len, int i, int *head, int *prev, int chain, int *bestloc)
+{
+   int cur = head[stbiw__zhash(data+i)], best = 2;
+   *bestloc = -1;
+   while (cur >= 0 && i - cur < stbiw__ZWINDOW && chain-- > 0) {
+      // a longer match has to agree on the byte after the current best
+      if (data[cur+best] == data[i+best]) {
+         int d = stbiw__zlib_countm(data+cur, data+i, data_len-i);
+         if (d > best) {
+            best = d, *bestloc = cur;
+            // long matches are good enough, searching further rarely pays off
+            if (d >= stbiw__ZNICE || d == data_len-i) break;
+            if (d >= stbiw__ZGOOD) chain >>= 2;
+         }
+      }
+      cur = prev[cur & (stbiw__ZWINDOW-1)];
+   }
+   return *bestloc >= 0 ? best : 0;
+}
+
+// insert all positions before end into the hash chains
+static void stbiw__zlib_insert(unsigned char *data, int data_len, int *head, int *prev, int *inserted, int end)
+{
+   if (end > data_len-3) end = data_len-3;
+   for (; *inserted < end; ++*inserted) {
+      int h = stbiw__zhash(data + *inserted);
+      prev[*inserted & (stbiw__ZWINDOW-1)] = head[h];
+      head[h] = *inserted;
+   }
+}
 
 unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
 {
-   static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
-   static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
-   static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
-   static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
    unsigned int bitbuf=0;
    int i,j, bitcount=0;
    unsigned char *out = NULL;
-   unsigned char **hash_table[stbiw__ZHASH]; // 64KB on the stack!
+   // hash chains: head holds the last position of each hash, prev links each position of the
+   // window to the previous one with the same hash; allocated once together with the symbols of
+   // the current block
+   int *head = (int *) STBIW_MALLOC(sizeof(int) * (stbiw__ZHASH + stbiw__ZWINDOW) + sizeof(unsigned short) * 2 * stbiw__ZBLOCK);
+   int *prev = head + stbiw__ZHASH;
+   int chain, inserted = 0, block = 0;
+   stbiw__zlib_state z;
    if (quality < 5) quality = 5;
+   chain = quality;
+   STBIW_ASSERT(head);
 
-   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
-   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
-   stbiw__zlib_add(1,1);  // BFINAL = 1
-   stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
+   z.lit = (unsigned short *) (prev + stbiw__ZWINDOW);
+   z.dist = z.lit + stbiw__ZBLOCK;
+   z.n = 0;
+   memset(z.litfreq, 0, sizeof(z.litfreq));
+   memset(z.distfreq, 0, sizeof(z.distfreq));
 
    for (i=0; i < stbiw__ZHASH; ++i)
-      hash_table[i] = NULL;
+      head[i] = -1;
+   for (i=0; i < 288; ++i) {
+      z.fixedlen[i] = (unsigned char) stbiw__zlib_fixedlen(i);
+      z.fixedcode[i] = (unsigned short) stbiw__zlib_bitrev(stbiw__zlib_fixed(i), z.fixedlen[i]);
+   }
+   for (i=0; i < 30; ++i)
+      z.fixeddist[i] = (unsigned short) stbiw__zlib_bitrev(i, 5);
+   memcpy(z.litbits, z.fixedlen, sizeof(z.litbits));
+   memset(z.distbits, 5, sizeof(z.distbits));
+   for (i=3, j=0; i <= 258; ++i) {
+      while (i > stbiw__lengthc[j+1]-1) ++j;
+      z.lencode[i] = (unsigned char) j;
+   }
+   for (i=1, j=0; i < stbiw__ZWINDOW; ++i) {
+      while (i > stbiw__distc[j+1]-1) ++j;
+      if (i <= 256) z.distcode[i-1] = (unsigned char) j;
+      else if (((i-1) & 127) == 0) z.distcode[256 + ((i-1) >> 7)] = (unsigned char) j;
+   }
+
+   stbiw__sbgrow(out, data_len / 2 + 64);
+   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
+   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
 
    i=0;
-   while (i < data_len-3) {
-      // hash next 3 bytes of data to be compressed
-      int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1), best=3;
-      unsigned char *bestloc = 0;
-      unsigned char **hlist = hash_table[h];
-      int n = stbiw__sbcount(hlist);
-      for (j=0; j < n; ++j) {
-         if (hlist[j]-data > i-32768) { // if entry lies within window
-            int d = stbiw__zlib_countm(hlist[j], data+i, data_len-i);
-            if (d >= best) best=d,bestloc=hlist[j];
-         }
-      }
-      // when hash table entry is too long, delete half the entries
-      if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2*quality) {
-         STBIW_MEMMOVE(hash_table[h], hash_table[h]+quality, sizeof(hash_table[h][0])*quality);
-         stbiw__sbn(hash_table[h]) = quality;
-      }
-      stbiw__sbpush(hash_table[h],data+i);
+   while (i < data_len) {
+      int bestloc, next, best = 0, literals = 1;
+
+      if (i < data_len-3) {
+         best = stbiw__zlib_longest(data, data_len, i, head, prev, chain, &bestloc);
+         stbiw__zlib_insert(data, data_len, head, prev, &inserted, i+1);
 
-      if (bestloc) {
          // "lazy matching" - check match at *next* byte, and if it's better, do cur byte as literal
-         h = stbiw__zhash(data+i+1)&(stbiw__ZHASH-1);
-         hlist = hash_table[h];
-         n = stbiw__sbcount(hlist);
-         for (j=0; j < n; ++j) {
-            if (hlist[j]-data > i-32767) {
-               int e = stbiw__zlib_countm(hlist[j], data+i+1, data_len-i-1);
-               if (e > best) { // if next match is better, bail on current match
-                  bestloc = NULL;
-                  break;
-               }
-            }
+         if (best && best < stbiw__ZLAZY && stbiw__zlib_longest(data, data_len, i+1, head, prev, chain, &next) > best)
+            best = 0;
+
+         // short matches far back can cost more than their bytes as literals
+         if (best && best < 8) {
+            int c = z.lencode[best], dc = stbiw__zlib_dcode(&z, i - bestloc), bits = 0;
+            for (j=0; j < best; ++j) bits += z.litbits[data[i+j]];
+            if (z.litbits[257+c] + stbiw__lengtheb[c] + z.distbits[dc] + stbiw__disteb[dc] >= bits)
+               literals = best < stbiw__ZBLOCK - z.n ? best : stbiw__ZBLOCK - z.n, best = 0;
          }
+
+         // every position covered by a match is inserted as well
+         stbiw__zlib_insert(data, data_len, head, prev, &inserted, i + (best ? best : literals));
       }
 
-      if (bestloc) {
-         int d = (int) (data+i - bestloc); // distance back
+      if (best) {
+         int d = i - bestloc; // distance back
          STBIW_ASSERT(d <= 32767 && best <= 258);
-         for (j=0; best > lengthc[j+1]-1; ++j);
-         stbiw__zlib_huff(j+257);
-         if (lengtheb[j]) stbiw__zlib_add(best - lengthc[j], lengtheb[j]);
-         for (j=0; d > distc[j+1]-1; ++j);
-         stbiw__zlib_add(stbiw__zlib_bitrev(j,5),5);
-         if (disteb[j]) stbiw__zlib_add(d - distc[j], disteb[j]);
+         z.lit[z.n] = (unsigned short) (256 + best);
+         z.dist[z.n++] = (unsigned short) d;
+         ++z.litfreq[257 + z.lencode[best]];
+         ++z.distfreq[stbiw__zlib_dcode(&z, d)];
          i += best;
       } else {
-         stbiw__zlib_huffb(data[i]);
-         ++i;
+         // a rejected match is written as literals without searching inside it
+         for (j=0; j < literals; ++j) {
+            z.lit[z.n++] = data[i];
+            ++z.litfreq[data[i]];
+            ++i;
+         }
+      }
+
+      if (z.n == stbiw__ZBLOCK || i == data_len) {
+         out = stbiw__zlib_block(out, &bitbuf, &bitcount, &z, data + block, i - block, i == data_len);
+         block = i;
+         z.n = 0;
+         memset(z.litfreq, 0, sizeof(z.litfreq));
+         memset(z.distfreq, 0, sizeof(z.distfreq));
       }
    }
-   // write out final bytes
-   for (;i < data_len; ++i)
-      stbiw__zlib_huffb(data[i]);
-   stbiw__zlib_huff(256); // end of block
+   if (data_len == 0)
+      out = stbiw__zlib_block(out, &bitbuf, &bitcount, &z, data, 0, 1);
    // pad with 0 bits to byte boundary
    while (bitcount)
       stbiw__zlib_add(0,1);
 
-   for (i=0; i < stbiw__ZHASH; ++i)
-      (void) stbiw__sbfree(hash_table[i]);
+   STBIW_FREE(head);
 
    {
       // compute adler32 on input
@@ -569,10 +873,10 @@ unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_l
    return (unsigned char *) stbiw__sbraw(out);
 }
 
-unsigned int stbiw__crc32(unsigned char *buffer, int len)
+// continue a crc over more data; start with ~0u and invert the result
+static unsigned int stbiw__crc32_update(unsigned int crc, unsigned char *buffer, int len)
 {
    static unsigned int crc_table[256];
-   unsigned int crc = ~0u;
    int i,j;
    if (crc_table[1] == 0)
       for(i=0; i < 256; i++)
@@ -580,7 +884,12 @@ unsigned int stbiw__crc32(unsigned char *buffer, int len)
             crc_table[i] = (crc_table[i] >> 1) ^ (crc_table[i] & 1 ? 0xedb88320 : 0);
    for (i=0; i < len; ++i)
       crc = (crc >> 8) ^ crc_table[buffer[i] ^ (crc & 0xff)];
-   return ~crc;
+   return crc;
+}
+
+unsigned int stbiw__crc32(unsigned char *buffer, int len)
+{
+   return ~stbiw__crc32_update(~0u, buffer, len);
 }
 
 #define stbiw__wpng4(o,a,b,c,d) ((o)[0]=(unsigned char)(a),(o)[1]=(unsigned char)(b),(o)[2]=(unsigned char)(c),(o)[3]=(unsigned char)(d),(o)+=4)
@@ -601,13 +910,12 @@ static unsigned char stbiw__paeth(int a, int b, int c)
    return (unsigned char) c;
 }
 
-unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+// filter all rows and compress them into the zlib stream of the IDAT chunk
+static unsigned char *stbiw__png_compress(unsigned char *pixels, int stride_bytes, int x, int y, int n, int *zlen)
 {
-   int ctype[5] = { -1, 0, 4, 2, 6 };
-   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
-   unsigned char *out,*o, *filt, *zlib;
+   unsigned char *filt, *zlib;
    signed char *line_buffer;
-   int i,j,k,p,zlen;
+   int i,j,k,p;
 
    if (stride_bytes == 0)
       stride_bytes = x * n;
@@ -655,16 +963,17 @@ unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, in
       STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
    }
    STBIW_FREE(line_buffer);
-   zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, 8); // increase 8 to get smaller but use more memory
+   zlib = stbi_zlib_compress(filt, y*( x*n+1), zlen, 8); // increase 8 to get smaller but use more memory
    STBIW_FREE(filt);
-   if (!zlib) return 0;
+   return zlib;
+}
 
-   // each tag requires 12 bytes of overhead
-   out = (unsigned char *) STBIW_MALLOC(8 + 12+13 + 12+zlen + 12);
-   if (!out) return 0;
-   *out_len = 8 + 12+13 + 12+zlen + 12;
+// signature and IHDR chunk, 33 bytes
+static void stbiw__png_header(unsigned char *o, int x, int y, int n)
+{
+   int ctype[5] = { -1, 0, 4, 2, 6 };
+   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
 
-   o=out;
    STBIW_MEMMOVE(o,sig,8); o+= 8;
    stbiw__wp32(o, 13); // header length
    stbiw__wptag(o, "IHDR");
@@ -676,6 +985,23 @@ unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, in
    *o++ = 0;
    *o++ = 0;
    stbiw__wpcrc(&o,13);
+}
+
+unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+{
+   unsigned char *out,*o, *zlib;
+   int zlen;
+
+   zlib = stbiw__png_compress(pixels, stride_bytes, x, y, n, &zlen);
+   if (!zlib) return 0;
+
+   // each tag requires 12 bytes of overhead
+   out = (unsigned char *) STBIW_MALLOC(8 + 12+13 + 12+zlen + 12);
+   if (!out) { STBIW_FREE(zlib); return 0; }
+   *out_len = 8 + 12+13 + 12+zlen + 12;
+
+   o=out;
+   stbiw__png_header(o, x, y, n); o += 33;
 
    stbiw__wp32(o, zlen);
    stbiw__wptag(o, "IDAT");
@@ -693,6 +1019,46 @@ unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, in
    return out;
 }
 
+// same bytes as stbi_write_png_to_mem, but handed to func piece by piece: the compressed data
+// goes out as is instead of being copied into one buffer with the chunk headers
+int stbi_write_png_to_func_sized(stbi_write_func *func, stbi_write_size_func *size_func, void *context, int x, int y, int comp, const void *data, int stride_bytes)
+{
+   unsigned char head[33], tail[16], *o;
+   unsigned int crc;
+   int zlen;
+   unsigned char *zlib = stbiw__png_compress((unsigned char *) data, stride_bytes, x, y, comp, &zlen);
+   if (!zlib) return 0;
+
+   // signature and IHDR, IDAT header, data and CRC, IEND
+   if (size_func) size_func(context, 33 + 8 + zlen + 16);
+
+   stbiw__png_header(head, x, y, comp);
+   func(context, head, 33);
+
+   o = tail;
+   stbiw__wp32(o, zlen);
+   stbiw__wptag(o, "IDAT");
+   func(context, tail, 8);
+   func(context, zlib, zlen);
+
+   crc = ~stbiw__crc32_update(stbiw__crc32_update(~0u, tail + 4, 4), zlib, zlen);
+   STBIW_FREE(zlib);
+
+   o = tail;
+   stbiw__wp32(o, crc);
+   stbiw__wp32(o,0);
+   stbiw__wptag(o, "IEND");
+   stbiw__wpcrc(&o,0);
+   func(context, tail, 16);
+
+   return 1;
+}
+
+int stbi_write_png_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int stride_bytes)
+{
+   return stbi_write_png_to_func_sized(func, 0, context, x, y, comp, data, stride_bytes);
+}
+
 int stbi_write_png(char const *filename, int x, int y, int comp, const void *data, int stride_bytes)
 {
    FILE *f;
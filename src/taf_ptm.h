@@ -41,6 +41,18 @@
  *
  *     taf::ptm_cleanup(&coeff_h, &coeff_l, &rgb);
  *
+ * Or into one move-only block that holds all three:
+ *
+ *     taf::PTMImage image;
+ *     taf::ptm_load(filename, &image);
+ *
+ *     auto rgb = image.view(taf::PTM_PLANE_RGB);
+ *
+ * Or encoded as PNGs to a sink, e.g. files, memory, a socket or an archive:
+ *
+ *     taf::PTMMemorySink sink;
+ *     taf::ptm_dump_png(filename, &sink);
+ *
  * Each vector/pointer will hold one regular RGB image with coefficients. The
  * returned structure "ptmh" contains scale and bias coefficients as well as
  * the width and height of all three images.
@@ -52,6 +64,13 @@
  *
  * before including the header.
  *
+ * The implementation includes the implementation of stb_image_write. If your
+ * program already compiles it in another file, define
+ *
+ *     #define TAF_PTM_NO_STB_IMAGE_WRITE_IMPLEMENTATION
+ *
+ * before the implementation.
+ *
  * Details on Polynomial Texture Maps can be found in the original paper:
  * http://www.hpl.hp.com/research/ptm/downloads/PtmFormat12.pdf
  *
@@ -65,6 +84,25 @@
 #endif
 
 #include <vector>
+#include <memory>
+#include <list>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <iosfwd>
+#include <thread>
+#include <exception>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <condition_variable>
+#include <chrono>
+#include <future>
 
 namespace taf
 {
@@ -86,6 +124,18 @@ namespace taf
         MOTION_COMPENSATION
     };
 
+    /**
+     * Priority lanes of a PTMScheduler, most urgent first
+     */
+    enum PTMLane
+    {
+        PTM_LANE_INTERACTIVE,
+        PTM_LANE_BULK,
+        PTM_LANE_COUNT
+    };
+
+    class PTMScheduler;
+
     struct CompressionInfo
     {
         unsigned int compressionParameter;
@@ -116,391 +166,7302 @@ namespace taf
 
     using uchar_vec = std::vector<unsigned char>;
 
-    namespace detail
-    {
-        void init_ci(PTMHeader12* ptm);
-        void ptm_allocate(uchar_vec* coeff_h, uchar_vec* coeff_l, uchar_vec* rgb, size_t size);
-        void ptm_allocate(unsigned char** coeff_h, unsigned char** coeff_l, unsigned char** rgb, size_t size);
-    }
-
-    /**
-     * Returns true if the PTM has been compressed with JPEG
-     */
-    bool is_compressed(const PTMHeader12* ptm);
-
     /**
-     * Returns true if the PTM is LRGB, i.e. it has a block of RGB data
+     * The header and still compressed planes of a JPEG PTM, as stored in the file
      */
-    bool is_lrgb(const PTMHeader12* ptm);
+    struct PTMCompressed
+    {
+        PTMHeader12 header;
+        std::vector<unsigned char> data;
+    };
 
     /**
-     * Returns the number of Entries Per Pixel (RGB + coefficients or just coefficients)
+     * A contiguous range of elements owned by someone else
      */
-    size_t get_epp(const PTMHeader12* ptm);
+    template<typename T>
+    struct PTMSpan
+    {
+        T* data;
+        size_t size;
 
-    /**
-     * Helper function to cleanup reserved memory after usage
-     */
-    void ptm_cleanup(unsigned char** coeff_h, unsigned char** coeff_l, unsigned char** rgb);
+        T* begin() const { return data; }
+        T* end() const { return data + size; }
+        T& operator[](size_t i) const { return data[i]; }
+    };
 
     /**
-     * Read a PTM file into a structure
-     *
-     * This is the main function to read a PTM file. The field ptm->coefficients is filled with
-     * whatever data was read from the PTM (after decompression, if necessary). The coefficients
-     * field therefore may contain either three blocks (high order coefficients, low order coefficients
-     * and rgb data) in case of LRGB PTMs, or raw RGB coefficients for each pixel in one big chunk.
+     * A rectangle of an RGB image owned by someone else
      *
-     * Currently, only LRGB PTMs are supported.
+     * Rows are stride bytes apart, so a region of a view is a view into the same pixels. Regions
+     * and pixels must lie inside the view, they aren't checked.
      */
-    void ptm_load(const char* file, PTM12* ptm);
+    template<typename T>
+    struct PTMView
+    {
+        T* data;
+        size_t width;
+        size_t height;
+        size_t stride;
+
+        PTMSpan<T> row(size_t y) const { return PTMSpan<T> { data + y * stride, width * 3 }; }
+        PTMSpan<T> pixel(size_t x, size_t y) const { return PTMSpan<T> { data + y * stride + x * 3, 3 }; }
+        PTMView region(size_t x, size_t y, size_t w, size_t h) const { return PTMView { data + y * stride + x * 3, w, h, stride }; }
+    };
 
     /**
-     * Convert a PTM to regular RGB images
-     *
-     * Converts a PTM to three regular RGB images. The coefficients ptm->coefficients are transformed
-     * and separated into three arrays coeff_h, coeff_l and rgb.
+     * The images of a PTMImage
      */
-    void ptm_load(const PTM12* ptm, unsigned char** coeff_h, unsigned char** coeff_l, unsigned char** rgb);
+    enum PTMPlane
+    {
+        PTM_PLANE_COEFF_H,
+        PTM_PLANE_COEFF_L,
+        PTM_PLANE_RGB,
+        PTM_PLANE_COUNT
+    };
 
     /**
-     * Read and convert a PTM to regular RGB images
+     * A PTM converted to regular RGB images, in one allocation
      *
-     * This function loads a PTM from a given filename and converts it into three RGB arrays. This
-     * template accepts either unsigned char** or taf::uchar_vec* as types for coeff_h,
-     * coeff_l or rgb.
+     * Holds the header and the images coeff_h, coeff_l and rgb of width x height x 3 bytes each,
+     * back to back in one block aligned to 64 bytes. Images are upright like those of ptm_load.
+     * PTMImage can be moved but not copied; reset keeps the block if the new size fits, so one
+     * image can be loaded into over and over without allocating.
      */
-    template<typename Container>
-    PTMHeader12 ptm_load(const char* file, Container coeff_h, Container coeff_l, Container rgb)
+    class PTMImage
     {
-        PTM12 ptm;
+    public:
+        static const size_t alignment = 64;
 
-        ptm_load(file, &ptm);
+        PTMImage();
+        PTMImage(PTMImage&& other);
+        PTMImage& operator=(PTMImage&& other);
+        ~PTMImage();
 
-        const size_t size = ptm.header.width * ptm.header.height * 3;
+        /**
+         * Take over a header and make room for its images, whose contents are undefined
+         */
+        void reset(PTMHeader12&& header);
 
-        detail::ptm_allocate(coeff_h, coeff_l, rgb, size);
+        /**
+         * Free the images
+         */
+        void clear();
 
-        unsigned char* h_ptr   = &((*coeff_h)[0]);
-        unsigned char* l_ptr   = &((*coeff_l)[0]);
-        unsigned char* rgb_ptr = &((*rgb)[0]);
+        const PTMHeader12& header() const { return header_; }
+        size_t width() const { return header_.width; }
+        size_t height() const { return header_.height; }
 
-        ptm_load(&ptm, &h_ptr, &l_ptr, &rgb_ptr);
+        PTMSpan<unsigned char> plane(PTMPlane p) { return PTMSpan<unsigned char> { data_ + p * plane_size(), plane_size() }; }
+        PTMSpan<const unsigned char> plane(PTMPlane p) const { return PTMSpan<const unsigned char> { data_ + p * plane_size(), plane_size() }; }
 
-        return ptm.header;
-    }
-}
+        PTMView<unsigned char> view(PTMPlane p) { return PTMView<unsigned char> { data_ + p * plane_size(), width(), height(), width() * 3 }; }
+        PTMView<const unsigned char> view(PTMPlane p) const { return PTMView<const unsigned char> { data_ + p * plane_size(), width(), height(), width() * 3 }; }
 
-#ifdef TAF_PTM_IMPLEMENTATION
+        PTMView<unsigned char> region(PTMPlane p, size_t x, size_t y, size_t w, size_t h) { return view(p).region(x, y, w, h); }
+        PTMView<const unsigned char> region(PTMPlane p, size_t x, size_t y, size_t w, size_t h) const { return view(p).region(x, y, w, h); }
 
-#include <map>
-#include <string>
-#include <fstream>
-#include <sstream>
-#include <algorithm>
-#include <stdexcept>
-#include <iterator>
+        PTMSpan<unsigned char> pixel(PTMPlane p, size_t x, size_t y) { return view(p).pixel(x, y); }
+        PTMSpan<const unsigned char> pixel(PTMPlane p, size_t x, size_t y) const { return view(p).pixel(x, y); }
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
+    private:
+        PTMImage(const PTMImage&);
+        PTMImage& operator=(const PTMImage&);
 
-namespace taf
-{
-    bool is_compressed(const PTMHeader12* ptm)
-    {
-        return ptm->format == PTM_FORMAT_JPEG_RGB ||
-               ptm->format == PTM_FORMAT_JPEG_LRGB ||
-               ptm->format == PTM_FORMAT_JPEGLS_RGB ||
-               ptm->format == PTM_FORMAT_JPEGLS_LRGB;
-    }
+        size_t plane_size() const { return header_.width * header_.height * 3; }
 
-    bool is_lrgb(const PTMHeader12* ptm)
-    {
-        return ptm->format == PTM_FORMAT_JPEG_LRGB ||
-               ptm->format == PTM_FORMAT_LRGB ||
-               ptm->format == PTM_FORMAT_JPEGLS_LRGB;
-    }
+        PTMHeader12 header_;
+        unsigned char* block_;
+        unsigned char* data_;
+        size_t capacity_;
+    };
 
-    size_t get_epp(const PTMHeader12* ptm)
+    struct PTMPlaneStats
     {
-        if (is_lrgb(ptm))
-            return 9;
-        else
-            return 18;
-    }
+        unsigned char min;
+        unsigned char max;
+        double mean;
+        double variance;
+        size_t histogram[256];
+    };
 
-    namespace detail
+    /**
+     * Statistics of all 9 planes of an LRGB PTM: coefficients 0-5 followed by R, G and B
+     */
+    struct PTMStats
     {
-        void init_ci(PTMHeader12* ptm)
-        {
-            size_t epp = get_epp(ptm);
-            ptm->ci.transforms.resize(epp);
-            ptm->ci.motion_vectors.resize(epp*2);
-            ptm->ci.order.resize(epp);
-            ptm->ci.reference_planes.resize(epp);
-            ptm->ci.compressed_size.resize(epp);
-            ptm->ci.side_information.resize(epp);
-        }
-
-        void ptm_allocate(uchar_vec* coeff_h, uchar_vec* coeff_l, uchar_vec* rgb, size_t size)
-        {
-            coeff_h->resize(size);
-            coeff_l->resize(size);
-            rgb->resize(size);
-        }
-
-        void ptm_allocate(unsigned char** coeff_h, unsigned char** coeff_l, unsigned char** rgb, size_t size)
-        {
-            (*coeff_h) = new unsigned char[size];
-            (*coeff_l) = new unsigned char[size];
-            (*rgb)     = new unsigned char[size];
-        }
-    }
+        size_t num_pixels;
+        PTMPlaneStats planes[9];
+    };
 
-    void ptm_cleanup(unsigned char** coeff_h, unsigned char** coeff_l, unsigned char** rgb)
+    /**
+     * Per-plane differences between two PTMs, plus the structural similarity of both PTMs relit
+     * from a set of light directions
+     */
+    struct PTMDiff
     {
-        delete [] *coeff_h;
-        delete [] *coeff_l;
-        delete [] *rgb;
-
-        *coeff_h = nullptr;
-        *coeff_l = nullptr;
-        *rgb = nullptr;
-    }
+        double mse[9];
+        double psnr[9];
+        int max_error[9];
+        std::vector<double> ssim;
+    };
 
-    void ptm_load(const char* file, PTM12* ptm)
+    /**
+     * A point light or spotlight above the PTM
+     *
+     * The PTM covers x in [-1, 1] from left to right and y in [-h/w, h/w] from bottom to top, z
+     * points away from the surface. Light arriving at a pixel is scaled by
+     * intensity / (1 + falloff * d^2) for a distance d. If spot_direction is not zero, the light
+     * is a spotlight which is fully lit inside the cosine cos_inner of its axis and fades out
+     * towards cos_outer.
+     */
+    struct PTMPointLight
     {
-        std::ifstream stream(file, std::ios::binary);
+        float position[3];
+        float intensity;
+        float falloff;
 
-        TAF_ASSERT(stream.good(), "Can't open file");
-
-        std::string version;
-        stream >> version;
-
-        TAF_ASSERT(version == "PTM_1.2", "Wrong version");
-
-        std::string format;
-        stream >> format;
-
-        TAF_ASSERT(format == "PTM_FORMAT_LRGB" || format == "PTM_FORMAT_JPEG_LRGB", (std::string("Unknown format:") + format).c_str());
+        float spot_direction[3];
+        float cos_inner;
+        float cos_outer;
+    };
 
-        if (format == "PTM_FORMAT_LRGB")
-            ptm->header.format = PTM_FORMAT_LRGB;
-        else if (format == "PTM_FORMAT_JPEG_LRGB")
-            ptm->header.format = PTM_FORMAT_JPEG_LRGB;
+    /**
+     * Lighting of a PTM by an environment
+     *
+     * Since the PTM polynomial is quadratic in (lu, lv), lighting it with a whole environment
+     * only depends on the 6 moments of the environment with respect to the polynomial terms,
+     * per color channel.
+     */
+    struct PTMEnvironment
+    {
+        float moments[3][6];
+    };
 
-        stream >> ptm->header.width;
-        stream >> ptm->header.height;
+    /**
+     * Material maps fitted to a PTM
+     *
+     * All maps are width x height and upright like the images of ptm_load. albedo is the RGB
+     * diffuse color, normal the unit normal with x, y and z mapped from [-1, 1] to [0, 255].
+     * specular is the strength of the specular lobe relative to the pixel color, and shininess
+     * the Blinn-Phong exponent in [4, 512], stored as log2(exponent) / 9 * 255.
+     */
+    struct PTMMaterial
+    {
+        size_t width;
+        size_t height;
+        std::vector<unsigned char> albedo;
+        std::vector<unsigned char> normal;
+        std::vector<unsigned char> specular;
+        std::vector<unsigned char> shininess;
+    };
 
-        for (size_t i = 0; i < 6; ++i)
-            stream >> ptm->header.scale[i];
+    /**
+     * Brightest, darkest and mean appearance of a PTM over all light directions
+     *
+     * Each image is width x height RGB pixels, upright like the images of ptm_load.
+     */
+    struct PTMHemisphere
+    {
+        size_t width;
+        size_t height;
+        std::vector<unsigned char> max;
+        std::vector<unsigned char> min;
+        std::vector<unsigned char> mean;
+    };
 
-        for (size_t i = 0; i < 6; ++i)
-            stream >> ptm->header.bias[i];
+    namespace detail
+    {
+        /**
+         * The scheduler and lane of the job running on a thread, if any. Preemption points do
+         * nothing while non_preemptible is above 0, see NonPreemptible.
+         */
+        struct SchedulerContext
+        {
+            PTMScheduler* scheduler;
+            PTMLane lane;
+            size_t non_preemptible;
+        };
 
-        size_t epp = get_epp(&ptm->header);
+        SchedulerContext& scheduler_context();
 
-        if (is_compressed(&ptm->header))
+        /**
+         * Split the range [begin, end) into chunks of at least grain elements and call
+         * f(chunk_begin, chunk_end) for each chunk on its own thread. The threads inherit the
+         * scheduler context of the caller, so their preemption points still work, or stay off.
+         */
+        template<typename F>
+        void parallel_for(size_t begin, size_t end, size_t grain, F f)
         {
-            detail::init_ci(&ptm->header);
+            if (end <= begin)
+                return;
 
-            stream >> ptm->header.ci.compressionParameter;
+            size_t n = end - begin;
+            size_t num_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+            num_threads = std::max<size_t>(std::min(num_threads, n / std::max<size_t>(grain, 1)), 1);
 
-            // TODO: enum
-            for (size_t i = 0; i < epp; ++i)
+            if (num_threads == 1)
             {
-                int v;
-                stream >> v;
-                switch(v)
-                {
-                    default:
-                    case 0:
-                        ptm->header.ci.transforms[i] = NOTHING;
-                        break;
-                    case 1:
-                        ptm->header.ci.transforms[i] = PLANE_INVERSION;
-                        break;
-                    case 2:
-                        ptm->header.ci.transforms[i] = MOTION_COMPENSATION;
-                        break;
-                }
+                f(begin, end);
+                return;
             }
 
-            for (size_t i = 0; i < epp * 2; ++i)
-                stream >> ptm->header.ci.motion_vectors[i];
+            std::vector<std::thread> threads;
+            std::vector<std::exception_ptr> errors(num_threads);
+            size_t chunk = (n + num_threads - 1) / num_threads;
+            const SchedulerContext context = scheduler_context();
 
-            for (size_t i = 0; i < epp; ++i)
-                stream >> ptm->header.ci.order[i];
+            // exceptions can't leave a thread, so they are collected and the first one is rethrown
+            for (size_t b = begin, t = 0; b < end; b += chunk, ++t)
+            {
+                threads.emplace_back([&f, &errors, context, t, b, end, chunk]()
+                {
+                    scheduler_context() = context;
 
-            for (size_t i = 0; i < epp; ++i)
-                stream >> ptm->header.ci.reference_planes[i];
+                    try { f(b, std::min(b + chunk, end)); }
+                    catch (...) { errors[t] = std::current_exception(); }
+                });
+            }
 
-            for (size_t i = 0; i < epp; ++i)
-                stream >> ptm->header.ci.compressed_size[i];
+            for (auto& t : threads)
+                t.join();
 
-            for (size_t i = 0; i < epp; ++i)
-                stream >> ptm->header.ci.side_information[i];
+            for (auto& e : errors)
+                if (e)
+                    std::rethrow_exception(e);
         }
 
-        // search for newline
-        char temp;
-        do { stream.read(&temp, 1); } while (temp != '\n');
+        /**
+         * Side information of a JPEG plane: pixels that are replaced after prediction, sorted by
+         * (flipped) pixel index. Entries with the same index keep their file order.
+         */
+        struct SideInformation
+        {
+            std::vector<unsigned int> index;
+            std::vector<unsigned char> value;
+        };
+
+        void init_ci(PTMHeader12* ptm);
+        void ptm_read_header(std::istream& stream, PTMHeader12* ptm);
+        void ptm_write_header(std::ostream& stream, const PTMHeader12* ptm);
+        void ptm_read_payload(std::istream& stream, PTMCompressed* ptm);
+        void ptm_decode_coefficients(const PTMCompressed* compressed, uchar_vec* coefficients);
+        void ptm_allocate(uchar_vec* coeff_h, uchar_vec* coeff_l, uchar_vec* rgb, size_t size);
+        void ptm_allocate(unsigned char** coeff_h, unsigned char** coeff_l, unsigned char** rgb, size_t size);
+        void ptm_source_row(const PTMHeader12* ptm, size_t y, size_t* first, bool* reversed);
+        void ptm_relight_uniform(const PTM12* ptm, const float weights[3][7], unsigned char* out);
+        double ssim(const unsigned char* a, const unsigned char* b, size_t width, size_t height);
+        void ptm_plane_errors(const unsigned char* a, const unsigned char* b, size_t n, size_t begin, size_t end, double* sse, int* max_error);
+        void ptm_decode_side_information(const unsigned char* records, size_t size, size_t width, size_t height, SideInformation* si);
+        void ptm_apply_side_information(const SideInformation& si, unsigned char* plane, size_t begin, size_t end);
+        unsigned char* ptm_decode_jpeg_plane(const PTMHeader12* ptm, const unsigned char* jpeg, size_t size, bool dc_only = false);
+        void ptm_box_filter(const unsigned char* const* channels, size_t step, size_t width, size_t height, size_t y_begin, size_t y_end, size_t scale, uint64_t* sums);
+        void ptm_box_filter_dc(const unsigned char* dc, size_t c, size_t width, size_t height, size_t scale, uint64_t* sums);
+        unsigned char* ptm_read_jpeg_plane(std::istream& stream, const PTMHeader12* ptm, size_t p, std::vector<unsigned char>* side_info);
+        void ptm_predict_plane(unsigned char* i_plane, const unsigned char* j_plane, PTMTransform transform, size_t begin, size_t end);
+        void ptm_convert_rows(const PTMHeader12* ptm, const unsigned char* coeff, const unsigned char* color, size_t y_begin, size_t y_end, unsigned char* coeff_h, unsigned char* coeff_l, unsigned char* rgb);
+        void ptm_convert_plane_rows(const PTMHeader12* ptm, unsigned char* const* planes, size_t y_begin, size_t y_end, unsigned char* coeff_h, unsigned char* coeff_l, unsigned char* rgb);
+        bool ptm_is_lossless(std::istream& stream);
+        void ptm_read_lossless_index(std::istream& stream, PTMHeader12* header, size_t* tile_size, std::vector<uint64_t>* offsets);
+        void ptm_encode_tile(const PTM12* ptm, size_t x0, size_t y0, size_t tile_width, size_t tile_height, std::vector<unsigned char>* out);
+        void ptm_decode_tile(const unsigned char* data, size_t size, size_t tile_width, size_t tile_height, unsigned char* coeff, unsigned char* rgb, size_t stride);
+    }
 
-        ptm->coefficients.clear();
+    /**
+     * A file mapped into memory
+     *
+     * Used as backing store for data that doesn't fit into memory. Pages are written back to the
+     * file by the operating system, and the hints will_need and dont_need control which part of
+     * the file is kept resident. Only available on POSIX systems.
+     */
+    class MappedFile
+    {
+    public:
+        MappedFile();
+        ~MappedFile();
 
-        size_t size = ptm->header.width * ptm->header.height * epp;
-        ptm->coefficients.resize(size);
+        /**
+         * Map an existing file read-only
+         */
+        void open(const char* path);
 
-        if (ptm->header.format == PTM_FORMAT_LRGB)
-        {
-            stream.read(reinterpret_cast<char*>(&ptm->coefficients[0]), size);
-        }
-        else if (ptm->header.format == PTM_FORMAT_JPEG_LRGB)
-        {
-            std::vector<unsigned char*> planes(epp);
-            std::vector<std::vector<unsigned char>> side_info(epp);
+        /**
+         * Create a read-write scratch file of the given size. The file is removed from the file
+         * system right away and disappears once it is unmapped.
+         */
+        void create(const char* path, size_t size);
 
-            std::map<size_t, size_t> order;
+        void close();
 
-            // first pass: extract all planes
-            for (size_t p = 0; p < epp; ++p)
-            {
-                int w = ptm->header.width;
-                int h = ptm->header.height;
-                int comp = 1;
+        unsigned char* data() const { return data_; }
+        size_t size() const { return size_; }
 
-                // read jpeg buffer
-                size_t bufs = ptm->header.ci.compressed_size[p];
-                std::vector<char> jpegbuf(bufs);
-                stream.read(&jpegbuf[0], bufs);
+        void will_need(size_t offset, size_t length) const;
+        void dont_need(size_t offset, size_t length) const;
 
-                size_t sides = ptm->header.ci.side_information[p];
-                if (sides > 0)
-                {
-                    side_info[p].resize(sides);
-                    stream.read(reinterpret_cast<char*>(&side_info[p][0]), sides);
-                }
+    private:
+        MappedFile(const MappedFile&);
+        MappedFile& operator=(const MappedFile&);
 
-                // convert to char values
-                planes[p] = stbi_load_from_memory(reinterpret_cast<unsigned char*>(&jpegbuf[0]), bufs, &w, &h, &comp, 1);
+        unsigned char* data_;
+        size_t size_;
+        bool writable_;
+    };
 
-                TAF_ASSERT(!stbi_failure_reason(), stbi_failure_reason());
+    namespace detail
+    {
+        /**
+         * Least recently used map from file names to shared values, limited in bytes
+         */
+        template<typename T>
+        class LRUTier
+        {
+        public:
+            explicit LRUTier(size_t limit) : limit_(limit), bytes_(0) {}
 
-                TAF_ASSERT(comp == 1, "Too many components in LRGB image");
+            std::shared_ptr<const T> find(const std::string& key)
+            {
+                auto it = index_.find(key);
 
-                TAF_ASSERT(w == ptm->header.width && h == ptm->header.height, "Incompatible image size found");
+                if (it == index_.end())
+                    return nullptr;
 
-                order[ptm->header.ci.order[p]] = p;
+                entries_.splice(entries_.begin(), entries_, it->second);
+                return it->second->value;
             }
 
-            // second pass: apply predicition and transformation
-            for (size_t n = 0; n < epp; ++n)
+            void insert(const std::string& key, std::shared_ptr<const T> value, size_t bytes)
             {
-                // query actual plane number according to order map
-                size_t i = order[n];
-                size_t j = ptm->header.ci.reference_planes[i];
+                // values larger than the whole tier are not kept at all
+                if (bytes > limit_ || index_.count(key))
+                    return;
 
-                unsigned char* i_plane = planes[i];
+                entries_.push_front(Entry { key, value, bytes });
+                index_[key] = entries_.begin();
+                bytes_ += bytes;
 
-                size_t num_pixels = ptm->header.width * ptm->header.height;
-
-                // prediction if plane index j is not -1
-                if (j != -1)
+                while (bytes_ > limit_)
                 {
-                    unsigned char* j_plane = planes[j];
-
-                    for (size_t x = 0; x < num_pixels; ++x)
-                    {
-                        unsigned char jpx = j_plane[x];
-
-                        // apply transformation
-                        // TODO: add motion vector transformation!
-                        if (ptm->header.ci.transforms[i] == PLANE_INVERSION)
-                            jpx = 255 - jpx;
-
-                        i_plane[x] = (jpx + i_plane[x] - 128)%255;
-                    }
+                    bytes_ -= entries_.back().bytes;
+                    index_.erase(entries_.back().key);
+                    entries_.pop_back();
                 }
+            }
 
-                // apply correction from sideinformation
-                if (side_info[i].size() > 0)
-                {
-                    size_t x = 0;
-                    while(x < side_info[i].size())
-                    {
-                        unsigned char p3 = side_info[i][x++];
-                        unsigned char p2 = side_info[i][x++];
-                        unsigned char p1 = side_info[i][x++];
-                        unsigned char p0 = side_info[i][x++];
-                        unsigned char v  = side_info[i][x++];
+            void clear()
+            {
+                entries_.clear();
+                index_.clear();
+                bytes_ = 0;
+            }
 
-                        int index = p3 << 24 | p2 << 16 | p1 << 8 | p0;
+            size_t bytes() const { return bytes_; }
 
-                        int w = ptm->header.width;
-                        int h = ptm->header.height;
+        private:
+            struct Entry
+            {
+                std::string key;
+                std::shared_ptr<const T> value;
+                size_t bytes;
+            };
 
-                        int width = index % w;
-                        int height = index / w;
-                        int h2 = h - height - 1;
-                        int index2 = h2 * w + width;
+            size_t limit_;
+            size_t bytes_;
+            std::list<Entry> entries_;
+            std::unordered_map<std::string, typename std::list<Entry>::iterator> index_;
+        };
+    }
 
-                        i_plane[index2] = v;
-                    }
-                }
-            }
+    /**
+     * A two tier cache of PTMs
+     *
+     * The compressed tier keeps only the header and compressed planes of JPEG PTMs, the decoded
+     * tier keeps fully decoded PTMs. A request that misses the decoded tier is decoded from the
+     * compressed tier and only read from disk if that misses too. Uncompressed PTMs bypass the
+     * compressed tier. Each tier has its own limit in bytes and evicts the least recently used
+     * entries. All methods are thread safe, decoding happens outside of the lock. Concurrent
+     * requests for a file that is being decoded wait for that decode instead of starting another;
+     * they are counted as shared decodes, not as hits. Entries are keyed by path, size,
+     * modification time and inode, so a file that is rewritten is read again.
+     */
+    class PTMCache
+    {
+    public:
+        struct Statistics
+        {
+            size_t decoded_hits;
+            size_t compressed_hits;
+            size_t misses;
+            size_t shared_decodes;
+            size_t decoded_bytes;
+            size_t compressed_bytes;
+        };
 
-            size_t num_pixels = ptm->header.width * ptm->header.height;
+        PTMCache(size_t compressed_limit, size_t decoded_limit);
 
-            for (size_t y = 0; y < ptm->header.height; ++y)
-                for (size_t x = 0; x < ptm->header.width; ++x)
-                {
-                    size_t index = (x + y*ptm->header.width);
-                    size_t invin = num_pixels - index - 1;
+        std::shared_ptr<const PTM12> get(const std::string& file);
 
-                    for (size_t p = 0; p < 6; ++p)
-                        ptm->coefficients[index*6 + p] = planes[p][invin];
+        void clear();
 
-                    for (size_t p = 0; p < 3; ++p)
-                        ptm->coefficients[num_pixels*6 + index*3 + p] = planes[6 + p][invin];
-                }
+        Statistics statistics() const;
 
-            for (auto i : planes)
-                stbi_image_free(i);
-        }
+    private:
+        PTMCache(const PTMCache&);
+        PTMCache& operator=(const PTMCache&);
 
-        stream.close();
-    }
+        mutable std::mutex mutex_;
+        detail::LRUTier<PTMCompressed> compressed_;
+        detail::LRUTier<PTM12> decoded_;
+        std::unordered_map<std::string, std::shared_future<std::shared_ptr<const PTM12>>> pending_;
+        Statistics statistics_;
+    };
 
-    void ptm_load(const PTM12* ptm, unsigned char** coeff_h, unsigned char** coeff_l, unsigned char** rgb)
+    /**
+     * Runs jobs on a pool of threads in priority lanes
+     *
+     * Interactive jobs run before bulk jobs, and within a lane cheaper jobs run first, so previews
+     * don't wait behind a gigapixel conversion and small files aren't stuck behind large ones.
+     * Costs are estimates, e.g. from ptm_cost. Waiting jobs age, so expensive jobs aren't starved
+     * by a stream of cheap ones: a job is ordered as if its cost dropped by aging for every
+     * millisecond it has been queued. Running jobs aren't interrupted, but the library passes
+     * preemption points between planes, tiles, chunks of rows and rows of JPEG blocks: if a job of
+     * a more urgent lane is waiting there, the thread runs it before going on. The time each job
+     * waited in the queue is recorded per lane in the metrics.
+     */
+    class PTMScheduler
     {
-        TAF_ASSERT(ptm->header.format == PTM_FORMAT_LRGB || ptm->header.format == PTM_FORMAT_JPEG_LRGB, "Can't read format into RGB buffer");
+    public:
+        /**
+         * Start num_threads workers, or one per core if num_threads is 0. aging is in cost units
+         * per millisecond; the default makes a job with the ptm_cost of a 16 megapixel PTM wait
+         * about a second at most behind cheaper jobs queued after it.
+         */
+        explicit PTMScheduler(size_t num_threads = 0, uint64_t aging = 1 << 16);
 
-        const size_t num_pixels = ptm->header.width * ptm->header.height;
+        /**
+         * Run all queued jobs and stop the workers
+         */
+        ~PTMScheduler();
 
-        for (size_t y = 0; y < ptm->header.height; ++y)
-            for (size_t x = 0; x < ptm->header.width; ++x)
-                for (size_t c = 0; c < 3; ++c)
-                {
-                    size_t p = ((y * ptm->header.width) + x);
-                    size_t index = p*3;
+        /**
+         * Queue a job. Jobs report their own errors, exceptions leaving a job are dropped.
+         */
+        void submit(PTMLane lane, uint64_t cost, std::function<void()> job);
 
-                    // flip image upside down if format LRGB
-                    if (ptm->header.format == PTM_FORMAT_LRGB)
-                        index = (((ptm->header.height - 1 - y) * ptm->header.width) + x) * 3;
+        /**
+         * Wait until all jobs submitted so far have finished
+         */
+        void wait();
 
-                    // flip image horizontally if format JPEG
-                    if (ptm->header.format == PTM_FORMAT_JPEG_LRGB)
-                        index = ((y * ptm->header.width) + (ptm->header.width - 1 - x)) * 3;
+        /**
+         * Run waiting jobs of lanes more urgent than lane on the calling thread, and return how
+         * many were run
+         */
+        size_t preempt(PTMLane lane);
 
-                    // coefficients: first wxhx6 block
-                    (*coeff_h)[index + c] = ptm->coefficients[p*6 + c];
-                    (*coeff_l)[index + c] = ptm->coefficients[p*6 + c + 3];
+    private:
+        PTMScheduler(const PTMScheduler&);
+        PTMScheduler& operator=(const PTMScheduler&);
 
-                    // rgb: second wxhx3 block
-                    (*rgb)[index + c] = ptm->coefficients[num_pixels*6 + p*3 + c];
+        struct Job
+        {
+            // cost plus aging times the milliseconds from the start of the scheduler to queueing
+            uint64_t priority;
+            uint64_t sequence;
+            std::chrono::steady_clock::time_point queued;
+            std::function<void()> run;
+        };
+
+        bool pop(size_t lanes, PTMLane* lane, Job* job);
+        void execute(PTMLane lane, Job* job);
+        void work();
+
+        std::mutex mutex_;
+        std::condition_variable work_;
+        std::condition_variable done_;
+        std::vector<Job> queues_[PTM_LANE_COUNT];
+        std::atomic<size_t> waiting_[PTM_LANE_COUNT];
+        std::chrono::steady_clock::time_point start_;
+        uint64_t aging_;
+        size_t unfinished_;
+        uint64_t sequence_;
+        bool stop_;
+        std::vector<std::thread> threads_;
+    };
+
+    /**
+     * Let the scheduler running the calling thread's job run more urgent jobs first. Does nothing
+     * outside of PTMScheduler jobs, or while the job owns work that other jobs may wait for, like
+     * a PTMCache decode, and is cheap enough to call between planes, tiles or chunks of rows.
+     */
+    void ptm_preemption_point();
+
+    enum PTMArchiveFormat
+    {
+        PTM_ARCHIVE_TAR,
+        PTM_ARCHIVE_ZIP
+    };
+
+    /**
+     * Streams files from many threads into one tar or uncompressed zip archive
+     *
+     * Millions of small files strain the metadata servers of network storage, so converted
+     * images can be collected in a single archive instead. add() hands a finished file to a writer
+     * thread that owns the archive and appends entries in the order they arrive, and blocks while
+     * more than queue_limit bytes wait to be written. Checksums are computed by the threads
+     * calling add(). The index follows the last entry: the central directory of a zip archive,
+     * with zip64 records where needed, or for tar a last member index.tsv listing name, data
+     * offset and size of every entry. Errors of the writer are thrown by the next add() or close().
+     */
+    class PTMArchive
+    {
+    public:
+        PTMArchive(const char* file, PTMArchiveFormat format, size_t queue_limit = 64 << 20);
+
+        /**
+         * Close the archive, dropping errors; call close() to see them
+         */
+        ~PTMArchive();
+
+        void add(const std::string& name, std::vector<unsigned char>&& data);
+
+        /**
+         * Stream an entry of size bytes from the calling thread instead of handing it over whole.
+         * begin_entry() waits until the queued entries are written and holds the archive,
+         * append() writes chunks straight to the file and end_entry() releases the archive. If
+         * the chunks don't add up to size, or writing fails, the archive is broken and the next
+         * call throws.
+         */
+        void begin_entry(const std::string& name, uint64_t size);
+        void append(const unsigned char* data, size_t size);
+        void end_entry();
+
+        /**
+         * Write all queued entries and the index, and stop the writer
+         */
+        void close();
+
+    private:
+        PTMArchive(const PTMArchive&);
+        PTMArchive& operator=(const PTMArchive&);
+
+        struct Entry
+        {
+            std::string name;
+            std::vector<unsigned char> data;
+            uint32_t crc;
+        };
+
+        struct Record
+        {
+            std::string name;
+            uint64_t header_offset;
+            uint64_t data_offset;
+            uint64_t size;
+            uint32_t crc;
+        };
+
+        void work();
+        void write(const void* data, size_t size);
+        void write_header(const std::string& name, uint64_t size, uint32_t crc, Record* record);
+        void write_entry(const Entry& entry);
+        void write_index();
+        void fail();
+
+        PTMArchiveFormat format_;
+        std::unique_ptr<std::ostream> stream_;
+        uint64_t offset_;
+        uint64_t mtime_;
+        uint32_t dos_time_;
+        std::vector<Record> records_;
+
+        std::mutex mutex_;
+        std::condition_variable ready_;
+        std::condition_variable space_;
+        std::deque<Entry> queue_;
+        size_t queued_bytes_;
+        size_t queue_limit_;
+        bool closing_;
+        bool writing_;
+        bool streaming_;
+        Record streamed_;
+        uint64_t remaining_;
+        std::exception_ptr error_;
+        std::thread writer_;
+    };
+
+    /**
+     * Destination of encoded output files
+     *
+     * Encoders call begin() with the name and size in bytes of a file, write() with exactly that
+     * many bytes in consecutive chunks as they produce them, and end() when the file is complete.
+     * Knowing the size up front, archive sinks write their headers first and pass chunks on
+     * without collecting the file. Chunks are only valid during the call, so a sink that keeps
+     * them has to copy them. Files are passed one at a time, even by encoders running on several
+     * threads.
+     */
+    class PTMSink
+    {
+    public:
+        virtual ~PTMSink() {}
+
+        virtual void begin(const std::string& name, uint64_t size) = 0;
+        virtual void write(const unsigned char* data, size_t size) = 0;
+        virtual void end() = 0;
+    };
+
+    /**
+     * Writes every file to prefix + name, e.g. a directory with a trailing separator
+     */
+    class PTMFileSink : public PTMSink
+    {
+    public:
+        explicit PTMFileSink(const std::string& prefix = "");
+
+        void begin(const std::string& name, uint64_t size);
+        void write(const unsigned char* data, size_t size);
+        void end();
+
+    private:
+        std::string prefix_;
+        std::unique_ptr<std::ostream> stream_;
+    };
+
+    /**
+     * Keeps all files in memory, in the order they were written
+     */
+    class PTMMemorySink : public PTMSink
+    {
+    public:
+        std::vector<std::pair<std::string, uchar_vec>> files;
+
+        void begin(const std::string& name, uint64_t size);
+        void write(const unsigned char* data, size_t size);
+        void end();
+    };
+
+    /**
+     * Writes all files as a tar stream to a file descriptor, e.g. a pipe or socket, so the reader
+     * can split them again, e.g. with tar -x. Every chunk is written as it arrives, after the tar
+     * header written by begin(). finish() writes the end of the archive, or the destructor if it
+     * wasn't called. The descriptor isn't closed. Only available on POSIX systems.
+     */
+    class PTMDescriptorSink : public PTMSink
+    {
+    public:
+        explicit PTMDescriptorSink(int fd);
+
+        /**
+         * Finish the archive, dropping errors; call finish() to see them
+         */
+        ~PTMDescriptorSink();
+
+        void begin(const std::string& name, uint64_t size);
+        void write(const unsigned char* data, size_t size);
+        void end();
+
+        /**
+         * Write the end of the archive; no more files can follow
+         */
+        void finish();
+
+    private:
+        PTMDescriptorSink(const PTMDescriptorSink&);
+        PTMDescriptorSink& operator=(const PTMDescriptorSink&);
+
+        void put(const void* data, size_t size);
+
+        int fd_;
+        uint64_t mtime_;
+        bool finished_;
+        uint64_t size_;
+        uint64_t written_;
+    };
+
+    /**
+     * Passes every chunk to a function together with the name of its file, and an empty chunk
+     * with a null pointer when a file is complete
+     */
+    class PTMCallbackSink : public PTMSink
+    {
+    public:
+        typedef std::function<void(const std::string& name, const unsigned char* data, size_t size)> Callback;
+
+        explicit PTMCallbackSink(Callback callback);
+
+        void begin(const std::string& name, uint64_t size);
+        void write(const unsigned char* data, size_t size);
+        void end();
+
+    private:
+        Callback callback_;
+        std::string name_;
+    };
+
+    /**
+     * Streams every file as an entry into a PTMArchive, see PTMArchive::begin_entry
+     */
+    class PTMArchiveSink : public PTMSink
+    {
+    public:
+        explicit PTMArchiveSink(PTMArchive* archive);
+
+        void begin(const std::string& name, uint64_t size);
+        void write(const unsigned char* data, size_t size);
+        void end();
+
+    private:
+        PTMArchive* archive_;
+    };
+
+    /**
+     * Layout of a decoded PTM in shared memory
+     *
+     * The coefficients follow at data_offset in the layout of ptm_load. Only the process that
+     * created the segment writes to it; refcount counts the clients currently holding it.
+     */
+    struct PTMSharedHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t format;
+        uint64_t width;
+        uint64_t height;
+        float scale[6];
+        int32_t bias[6];
+        uint64_t data_offset;
+        uint64_t data_size;
+        std::atomic<uint32_t> refcount;
+    };
+
+    /**
+     * Decodes PTMs into shared memory for other local processes
+     *
+     * Clients connect to a Unix socket and send "acquire <file>" lines, or "acquire-bulk <file>"
+     * for work nobody is waiting for. The first request for a file decodes it into a shared memory
+     * segment, every request gets a read-only descriptor of that segment passed back. Segments are
+     * keyed by path, size and modification time, so a file that changed is decoded again. Decoding runs
+     * on a PTMScheduler in the interactive or bulk lane, costed by the header, while the server
+     * keeps answering other clients; each client's requests are answered in order. A client holds
+     * its segments until it disconnects. Segments nobody holds are kept up to idle_limit bytes,
+     * least recently used ones are dropped first. Only available on POSIX systems.
+     */
+    class PTMShareServer
+    {
+    public:
+        PTMShareServer(const char* socket_path, size_t idle_limit);
+        ~PTMShareServer();
+
+        /**
+         * Serve requests until stop() is called, e.g. from another thread or a signal handler
+         */
+        void run();
+
+        void stop() { stop_ = true; }
+
+    private:
+        PTMShareServer(const PTMShareServer&);
+        PTMShareServer& operator=(const PTMShareServer&);
+
+        struct Segment
+        {
+            int fd;
+            PTMSharedHeader* header;
+            size_t size;
+            size_t last_used;
+        };
+
+        struct Client
+        {
+            uint64_t id;
+            bool waiting;
+            std::string buffer;
+            std::vector<std::string> files;
+        };
+
+        struct Decoded
+        {
+            // the segment key, see detail::share_key
+            std::string file;
+            std::unique_ptr<PTM12> ptm;
+            std::string error;
+        };
+
+        void serve(int fd);
+        void process(int fd);
+        void decode(PTMLane lane, uint64_t cost, const std::string& file, const std::string& path);
+        void complete();
+        bool reply(int fd, const std::string& file);
+        void disconnect(int fd);
+        void share(const std::string& file, const PTM12& ptm);
+        void release(const std::string& file);
+        void trim();
+
+        int listen_;
+        int wake_[2];
+        std::string path_;
+        size_t idle_limit_;
+        size_t tick_;
+        uint64_t next_client_;
+        std::atomic<bool> stop_;
+        std::unordered_map<std::string, Segment> segments_;
+        std::unordered_map<int, Client> clients_;
+
+        // clients (descriptor and id) waiting for each file being decoded
+        std::unordered_map<std::string, std::vector<std::pair<int, uint64_t>>> decoding_;
+
+        std::mutex decoded_mutex_;
+        std::vector<Decoded> decoded_;
+        std::unique_ptr<PTMScheduler> scheduler_;
+    };
+
+    /**
+     * A PTM mapped read-only from a PTMShareServer
+     *
+     * The segment stays valid until release() or destruction, even if the server drops it.
+     */
+    class PTMSharedView
+    {
+    public:
+        PTMSharedView();
+        ~PTMSharedView();
+
+        /**
+         * Map a PTM decoded by the server at socket_path, decoded in the given lane if it
+         * isn't shared yet
+         */
+        void acquire(const char* socket_path, const char* file, PTMLane lane = PTM_LANE_INTERACTIVE);
+        void release();
+
+        PTMHeader12 header() const;
+        const unsigned char* coefficients() const;
+        const PTMSharedHeader* shared() const { return shared_; }
+
+    private:
+        PTMSharedView(const PTMSharedView&);
+        PTMSharedView& operator=(const PTMSharedView&);
+
+        int socket_;
+        const PTMSharedHeader* shared_;
+        size_t size_;
+    };
+
+    /**
+     * Event counters kept by the library
+     */
+    enum PTMCounter
+    {
+        PTM_COUNTER_FILES_LOADED,
+        PTM_COUNTER_BYTES_READ,
+        PTM_COUNTER_PLANES_DECODED,
+        PTM_COUNTER_CACHE_HITS,
+        PTM_COUNTER_CACHE_COMPRESSED_HITS,
+        PTM_COUNTER_CACHE_MISSES,
+        PTM_COUNTER_CACHE_SHARED_DECODES,
+        PTM_COUNTER_ALLOCATIONS,
+        PTM_COUNTER_ALLOCATED_BYTES,
+        PTM_COUNTER_COUNT
+    };
+
+    /**
+     * Timed stages of the library
+     */
+    enum PTMStage
+    {
+        PTM_STAGE_READ,
+        PTM_STAGE_DECODE,
+        PTM_STAGE_CONVERT,
+        PTM_STAGE_RELIGHT,
+        PTM_STAGE_MATERIAL,
+        PTM_STAGE_HEMISPHERE,
+        PTM_STAGE_FILTER,
+        PTM_STAGE_COUNT
+    };
+
+    /**
+     * A snapshot of all counters, stage latencies and scheduler queue latencies since the start of
+     * the process
+     *
+     * Latencies are histograms; buckets[i] counts calls that took at most 10^(i-4) seconds and
+     * more than the previous bound, the last bucket counts everything slower. Queue latencies
+     * count jobs of all PTMSchedulers by the time they waited in their lane.
+     */
+    struct PTMMetrics
+    {
+        static const size_t num_buckets = 7;
+
+        struct Stage
+        {
+            uint64_t count;
+            uint64_t nanoseconds;
+            uint64_t buckets[num_buckets];
+        };
+
+        uint64_t counters[PTM_COUNTER_COUNT];
+        Stage stages[PTM_STAGE_COUNT];
+        Stage lanes[PTM_LANE_COUNT];
+    };
+
+    /**
+     * Take a snapshot of the library's counters
+     *
+     * Every thread counts into its own block, so updates don't contend. The snapshot adds up the
+     * blocks of all live threads and of those that have exited. Defining TAF_PTM_NO_METRICS before
+     * the implementation turns counting off.
+     */
+    void ptm_metrics(PTMMetrics* metrics);
+
+    /**
+     * Format a snapshot in the OpenMetrics text format
+     */
+    std::string ptm_metrics_openmetrics(const PTMMetrics* metrics);
+
+    namespace detail
+    {
+        /**
+         * Adds the time between construction and destruction to a stage
+         */
+        class StageTimer
+        {
+        public:
+            explicit StageTimer(PTMStage stage) : stage_(stage), start_(std::chrono::steady_clock::now()) {}
+            ~StageTimer();
+
+        private:
+            PTMStage stage_;
+            std::chrono::steady_clock::time_point start_;
+        };
+    }
+
+    /**
+     * Returns true if the PTM has been compressed with JPEG
+     */
+    bool is_compressed(const PTMHeader12* ptm);
+
+    /**
+     * Returns true if the PTM is LRGB, i.e. it has a block of RGB data
+     */
+    bool is_lrgb(const PTMHeader12* ptm);
+
+    /**
+     * Returns the number of Entries Per Pixel (RGB + coefficients or just coefficients)
+     */
+    size_t get_epp(const PTMHeader12* ptm);
+
+    /**
+     * Helper function to cleanup reserved memory after usage
+     */
+    void ptm_cleanup(unsigned char** coeff_h, unsigned char** coeff_l, unsigned char** rgb);
+
+    /**
+     * Read a PTM file into a structure
+     *
+     * This is the main function to read a PTM file. The field ptm->coefficients is filled with
+     * whatever data was read from the PTM (after decompression, if necessary). The coefficients
+     * field therefore may contain either three blocks (high order coefficients, low order coefficients
+     * and rgb data) in case of LRGB PTMs, or raw RGB coefficients for each pixel in one big chunk.
+     *
+     * Currently, only LRGB PTMs are supported. Files written by ptm_save_lossless are read as LRGB
+     * PTMs as well.
+     */
+    void ptm_load(const char* file, PTM12* ptm);
+
+    /**
+     * Read and convert a PTM into a PTMImage
+     *
+     * The images are filled in place: uncompressed PTMs are read in chunks of rows that are
+     * converted right away, JPEG PTMs are converted straight from their decoded planes. Only
+     * lossless PTMs pass through a PTM12 first. The header is moved into the image.
+     */
+    void ptm_load(const char* file, PTMImage* image);
+
+    /**
+     * Read only the header of a PTM file
+     */
+    PTMHeader12 ptm_probe(const char* file);
+
+    /**
+     * Estimate the cost of decoding a PTM from its header
+     *
+     * The cost is the number of decoded bytes, with JPEG planes weighted by their decoding effort.
+     */
+    uint64_t ptm_cost(const PTMHeader12* header);
+
+    /**
+     * Read a JPEG PTM without decoding it
+     *
+     * ptm->data holds the compressed planes and side information as stored in the file, which is
+     * typically about a tenth of the decoded size.
+     */
+    void ptm_load(const char* file, PTMCompressed* ptm);
+
+    /**
+     * Decode a compressed JPEG PTM
+     *
+     * All planes are decoded in parallel, then prediction and side information are applied. The
+     * header is copied, since compressed stays valid.
+     */
+    void ptm_decode(const PTMCompressed* compressed, PTM12* ptm);
+
+    /**
+     * Decode a compressed JPEG PTM that isn't needed anymore, moving its header into ptm
+     */
+    void ptm_decode(PTMCompressed&& compressed, PTM12* ptm);
+
+    /**
+     * Write a PTM into a lossless tiled container
+     *
+     * The PTM is cut into tiles of tile_size x tile_size pixels. Each plane of a tile is spatially
+     * predicted with whichever predictor gives the smallest residual entropy, and the residuals
+     * are coded with four interleaved rANS coders. Tiles are independent, so they are coded and
+     * decoded in parallel and can be read back individually with ptm_load_region.
+     *
+     * JPEG PTMs are stored as they decode, so the result is always an LRGB PTM.
+     */
+    void ptm_save_lossless(const char* file, const PTM12* ptm, size_t tile_size = 256);
+
+    /**
+     * Read a rectangle of a lossless PTM
+     *
+     * Only the tiles overlapping the rectangle are read and decoded. region receives an LRGB PTM
+     * of width x height pixels. Rows are counted in file order, i.e. from the bottom up.
+     */
+    void ptm_load_region(const char* file, size_t x, size_t y, size_t width, size_t height, PTM12* region);
+
+    /**
+     * Convert a PTM to regular RGB images
+     *
+     * Converts a PTM to three regular RGB images. The coefficients ptm->coefficients are transformed
+     * and separated into three arrays coeff_h, coeff_l and rgb.
+     */
+    void ptm_load(const PTM12* ptm, unsigned char** coeff_h, unsigned char** coeff_l, unsigned char** rgb);
+
+    /**
+     * Convert PTM coefficients held elsewhere, e.g. in a PTMSharedView, to regular RGB images
+     */
+    void ptm_load(const PTMHeader12* header, const unsigned char* coefficients, unsigned char** coeff_h, unsigned char** coeff_l, unsigned char** rgb);
+
+    /**
+     * Read and convert a PTM to regular RGB images out-of-core
+     *
+     * Like the template version of ptm_load, but all planes and the three output images live in
+     * scratch_file, which should be on fast local disk. The pointers coeff_h, coeff_l and rgb point
+     * into scratch and stay valid as long as it is mapped. The PTM is processed in tiles so that
+     * roughly memory_limit bytes of it are resident at any time; the result is identical to the
+     * in-memory path. JPEG planes are still decoded one at a time in memory.
+     */
+    PTMHeader12 ptm_load(const char* file, const char* scratch_file, size_t memory_limit, MappedFile* scratch, unsigned char** coeff_h, unsigned char** coeff_l, unsigned char** rgb);
+
+    /**
+     * Reset all histograms of a statistics structure
+     */
+    void ptm_stats_reset(PTMStats* stats);
+
+    /**
+     * Add a block of pixels to the histograms of a statistics structure
+     *
+     * Both functions can be called repeatedly with consecutive chunks of a PTM, which allows
+     * statistics to be gathered without holding the whole PTM in memory. coeff holds 6 interleaved
+     * coefficients per pixel, rgb holds 3 interleaved color values per pixel. The histograms are
+     * filled in parallel with one set of bins per thread, which are merged at the end.
+     */
+    void ptm_stats_update_coefficients(PTMStats* stats, const unsigned char* coeff, size_t num_pixels);
+    void ptm_stats_update_rgb(PTMStats* stats, const unsigned char* rgb, size_t num_pixels);
+
+    /**
+     * Derive min, max, mean and variance of each plane from its histogram
+     */
+    void ptm_stats_finish(PTMStats* stats);
+
+    /**
+     * Compute min, max, mean, variance and a 256 bin histogram for each of the 9 planes of a PTM
+     */
+    void ptm_stats(const PTM12* ptm, PTMStats* stats);
+
+    /**
+     * Compute statistics of a PTM file
+     *
+     * Uncompressed LRGB PTMs are streamed through in fixed size chunks, so only a small part of
+     * the file is held in memory. Compressed PTMs are loaded completely.
+     */
+    PTMHeader12 ptm_stats(const char* file, PTMStats* stats);
+
+    /**
+     * Convert three regular RGB images back to a PTM
+     *
+     * This is the inverse of ptm_load(const PTM12*, ...). The images coeff_h, coeff_l and rgb are
+     * interleaved into ptm->coefficients in the orientation given by header->format, and
+     * ptm->header becomes a copy of header.
+     */
+    void ptm_from_rgb(const PTMHeader12* header, const unsigned char* coeff_h, const unsigned char* coeff_l, const unsigned char* rgb, PTM12* ptm);
+
+    /**
+     * Read a PNG triplet as written by ptmconvert back into a PTM
+     *
+     * The three images are decoded in parallel and must all have the size given in the header.
+     * If an image name.png doesn't exist, it is read from the strips name_000.png, name_001.png,
+     * ... that ptm_write_png splits large images into. The coefficients are laid out for the
+     * format of the header, see ptm_from_rgb.
+     */
+    void ptm_from_png(const PTMHeader12* header, const char* coeff_h, const char* coeff_l, const char* rgb, PTM12* ptm);
+
+    /**
+     * Write an LRGB PTM file
+     */
+    void ptm_save(const char* file, const PTM12* ptm);
+
+    /**
+     * Write only the header of an LRGB PTM
+     *
+     * The result is a PTM without payload that ptm_probe can read. It keeps size, scale and bias
+     * next to a PNG triplet, so the PTM can be rebuilt with ptm_from_png.
+     */
+    void ptm_save_header(const char* file, const PTMHeader12* header);
+
+    /**
+     * Write the images of a PTM as PNGs to a sink
+     *
+     * The images coeff_h.png, coeff_l.png and rgb.png are encoded in parallel. If sidecar is set,
+     * they are followed by header.txt in the format of ptm_save_header, which ptm_from_png needs
+     * to rebuild the PTM. All names start with prefix. Images beyond 1 GB are split into
+     * horizontal strips coeff_h_000.png, coeff_h_001.png, ..., since PNG encoding uses int sizes.
+     */
+    void ptm_write_png(const PTMHeader12* header, const unsigned char* coeff_h, const unsigned char* coeff_l, const unsigned char* rgb, PTMSink* sink, const std::string& prefix = "", bool sidecar = false);
+
+    /**
+     * Convert a PTM file and write its images to a sink with ptm_write_png
+     */
+    PTMHeader12 ptm_dump_png(const char* file, PTMSink* sink, const std::string& prefix = "", bool sidecar = false);
+
+    /**
+     * Read a downscaled RGB preview of a PTM
+     *
+     * Only color data is read: the RGB block of LRGB PTMs, or the RGB planes of JPEG PTMs
+     * together with the planes they are predicted from. The image is box filtered by 1/scale to
+     * ceil(width/scale) x ceil(height/scale) pixels and is upright like the images of ptm_load.
+     * If scale is a multiple of 8, JPEG planes are decoded from their DC coefficients only.
+     * Everything runs on the calling thread, so many previews can be made in parallel.
+     */
+    PTMHeader12 ptm_preview(const char* file, size_t scale, uchar_vec* rgb);
+
+    /**
+     * Relight a PTM from a light direction
+     *
+     * Evaluates the PTM polynomial for the projected light direction (lu, lv) and writes an RGB
+     * image of width x height pixels into out, in the same orientation as the images returned by
+     * ptm_load. The image is processed in parallel stripes of rows.
+     */
+    void ptm_relight(const PTM12* ptm, float lu, float lv, unsigned char* out);
+
+    /**
+     * Relight a PTM with a point light or spotlight
+     *
+     * Like ptm_relight with a light direction, but the direction and intensity of the light are
+     * computed for every pixel from the position of the light.
+     */
+    void ptm_relight(const PTM12* ptm, const PTMPointLight* light, unsigned char* out);
+
+    /**
+     * Compute the moments of an environment map
+     *
+     * latlong is a latitude-longitude image of width x height linear RGB float pixels with the
+     * zenith (the normal of the PTM) in the top row. Only the upper hemisphere contributes. The
+     * moments are normalized by 1/pi, so a constant environment of 1 lights a diffuse surface
+     * about as bright as a head-on light of intensity 1.
+     */
+    void ptm_environment(const float* latlong, size_t width, size_t height, PTMEnvironment* env);
+
+    /**
+     * Relight a PTM with an environment, scaled by exposure
+     *
+     * Each pixel only needs a weighted sum of its 6 coefficients per channel, so this costs the
+     * same as relighting with a single light direction.
+     */
+    void ptm_relight(const PTM12* ptm, const PTMEnvironment* env, float exposure, unsigned char* out);
+
+    /**
+     * Fit a Lambert plus Blinn-Phong material to a PTM
+     *
+     * The luminance polynomial of every pixel is sampled at a fixed set of light directions and
+     * kd * max(n.l, 0) + ks * max(n.h, 0)^m is fitted to the samples with iterations steps of
+     * Levenberg-Marquardt, starting from the normal at the maximum of the polynomial. Pixels are
+     * fitted in batches so the inner loops run across pixels, and tiles of the image are fitted in
+     * parallel.
+     */
+    void ptm_fit_material(const PTM12* ptm, PTMMaterial* material, size_t iterations = 8);
+
+    /**
+     * Unsharp mask the coefficients of a PTM
+     *
+     * Each of the 6 coefficient planes becomes c + amount * (c - G(c)), with G a Gaussian blur of
+     * standard deviation sigma pixels. Colors are kept, so the result can be relit or saved like
+     * any other PTM. Stripes of rows are filtered in parallel, each with a sliding window of
+     * rows.
+     */
+    void ptm_unsharp_coefficients(const PTM12* ptm, float sigma, float amount, PTM12* out);
+
+    /**
+     * Unsharp mask the coefficient images of a PTM in place
+     *
+     * Like ptm_unsharp_coefficients, but on the width x height coeff_h and coeff_l images of
+     * ptm_load, e.g. in the scratch file of the out-of-core overload, so the PTM never has to be
+     * in memory. Stripes of rows are filtered in parallel with a sliding window each; the rows a
+     * stripe reads across its borders are copied before any stripe overwrites them.
+     */
+    void ptm_unsharp_coefficients(size_t width, size_t height, float sigma, float amount, unsigned char* coeff_h, unsigned char* coeff_l);
+
+    /**
+     * Compute the normals of a PTM
+     *
+     * The normal of a pixel points to the maximum of its luminance polynomial. normals receives
+     * width x height x 3 floats, upright like the images of ptm_load.
+     */
+    void ptm_normals(const PTM12* ptm, float* normals);
+
+    /**
+     * Compute unsharp masked normals of a PTM
+     *
+     * Like ptm_normals, but every normal becomes normalize(n + amount * (n - G(n))), with G a
+     * Gaussian blur of standard deviation sigma pixels. Normals are computed on the fly from the
+     * rows in the sliding window of the blur.
+     */
+    void ptm_unsharp_normals(const PTM12* ptm, float sigma, float amount, float* normals);
+
+    /**
+     * Shade a PTM with Lambert shading of the given normals
+     *
+     * The luminance of each pixel is the maximum of its polynomial times max(n.l, 0) for the
+     * light direction (lu, lv), so that unsharp masked normals from ptm_unsharp_normals show up
+     * in the image. normals are upright like the output of ptm_normals.
+     */
+    void ptm_shade_normals(const PTM12* ptm, const float* normals, float lu, float lv, unsigned char* out);
+
+    /**
+     * Compute the hemisphere statistics of a PTM
+     *
+     * The maximum and minimum of each luminance polynomial over the unit disk of light
+     * directions are found analytically: from the stationary point inside the disk, or on its
+     * border from the secular equation of the 2x2 quadratic form. The mean is taken over light
+     * directions uniformly distributed on the hemisphere. All three images are written in one
+     * pass over batches of pixels, and stripes of rows run in parallel.
+     */
+    void ptm_hemisphere(const PTM12* ptm, PTMHemisphere* hemisphere);
+
+    /**
+     * Compare two PTMs
+     *
+     * Computes mean squared error, PSNR and maximum absolute error for each of the 9 planes, and
+     * the mean SSIM of both PTMs relit from each direction in lights (pairs of lu, lv). Both PTMs
+     * must have the same size; differing orientations are handled. The PSNR of identical planes
+     * is infinite.
+     */
+    void ptm_diff(const PTM12* a, const PTM12* b, const std::vector<std::pair<float, float>>& lights, PTMDiff* diff);
+
+    /**
+     * A batch of pixels flowing through ptm_pipeline
+     *
+     * Holds pixels x to x + count of output row y in structure of arrays layout: a the 6
+     * coefficients, rgb the color and out the result, all as floats in the range of bytes. Lanes
+     * past count hold leftovers of other pixels, so stages can always run over all lanes.
+     */
+    struct PTMPixels
+    {
+        static const size_t lanes = 64;
+
+        size_t x;
+        size_t y;
+        size_t count;
+
+        float a[6][lanes];
+        float rgb[3][lanes];
+        float out[3][lanes];
+    };
+
+    /**
+     * Pipeline stage applying scale and bias to the coefficients
+     */
+    struct PTMScaleBias
+    {
+        float scale[6];
+        float bias[6];
+
+        explicit PTMScaleBias(const PTMHeader12* header)
+        {
+            for (size_t i = 0; i < 6; ++i)
+            {
+                scale[i] = header->scale[i] / 255.f;
+                bias[i] = static_cast<float>(header->bias[i]);
+            }
+        }
+
+        void operator()(PTMPixels& p) const
+        {
+            for (size_t i = 0; i < 6; ++i)
+                for (size_t k = 0; k < PTMPixels::lanes; ++k)
+                    p.a[i][k] = scale[i] * (p.a[i][k] - bias[i]);
+        }
+    };
+
+    /**
+     * Pipeline stage relighting from the projected light direction (lu, lv), out = rgb * L
+     */
+    struct PTMDirectionalLight
+    {
+        float terms[6];
+
+        PTMDirectionalLight(float lu, float lv)
+        {
+            const float t[6] = { lu*lu, lv*lv, lu*lv, lu, lv, 1.f };
+            std::copy(t, t + 6, terms);
+        }
+
+        void operator()(PTMPixels& p) const
+        {
+            for (size_t k = 0; k < PTMPixels::lanes; ++k)
+            {
+                const float l = terms[0] * p.a[0][k] + terms[1] * p.a[1][k] + terms[2] * p.a[2][k] +
+                                terms[3] * p.a[3][k] + terms[4] * p.a[4][k] + terms[5] * p.a[5][k];
+
+                for (size_t c = 0; c < 3; ++c)
+                    p.out[c][k] = p.rgb[c][k] * l;
+            }
+        }
+    };
+
+    /**
+     * Pipeline stage mapping out to 255 * (1 - exp(-exposure * out / 255))^(1 / gamma), which
+     * rolls off highlights instead of clipping them
+     */
+    struct PTMToneMap
+    {
+        float exposure;
+        float inv_gamma;
+
+        PTMToneMap(float exposure, float gamma) : exposure(exposure / 255.f), inv_gamma(1.f / gamma) {}
+
+        void operator()(PTMPixels& p) const
+        {
+            for (size_t c = 0; c < 3; ++c)
+                for (size_t k = 0; k < PTMPixels::lanes; ++k)
+                {
+                    const float v = 1.f - std::exp(-exposure * std::max(p.out[c][k], 0.f));
+                    p.out[c][k] = 255.f * std::pow(v, inv_gamma);
+                }
+        }
+    };
+
+    namespace detail
+    {
+        inline void ptm_run_stages(PTMPixels&)
+        {
+        }
+
+        template<typename Stage, typename... Stages>
+        void ptm_run_stages(PTMPixels& p, const Stage& stage, const Stages&... stages)
+        {
+            stage(p);
+            ptm_run_stages(p, stages...);
+        }
+    }
+
+    /**
+     * Run a chain of per-pixel stages over a PTM in one pass
+     *
+     * Every stage is a function object taking a PTMPixels batch, like PTMScaleBias,
+     * PTMDirectionalLight and PTMToneMap. Batches of one output row are loaded upright from the
+     * coefficients and colors of an LRGB PTM, passed through all stages in order and stored as
+     * bytes, clamped and rounded, into the width x height x 3 image out. The stages are inlined
+     * into that loop, so a chain of any length reads the PTM and writes the image once, and
+     * stripes of rows run in parallel. The PTM must be LRGB, see is_lrgb.
+     */
+    template<typename... Stages>
+    void ptm_pipeline(const PTM12* ptm, unsigned char* out, const Stages&... stages)
+    {
+        const size_t w = ptm->header.width;
+        const size_t num_pixels = w * ptm->header.height;
+
+        const unsigned char* coeff = &ptm->coefficients[0];
+        const unsigned char* color = &ptm->coefficients[num_pixels*6];
+
+        detail::StageTimer timer(PTM_STAGE_RELIGHT);
+
+        detail::parallel_for(0, ptm->header.height, 16, [&](size_t b, size_t e)
+        {
+            PTMPixels p = PTMPixels();
+
+            for (size_t y = b; y < e; ++y)
+            {
+                size_t first;
+                bool reversed;
+                detail::ptm_source_row(&ptm->header, y, &first, &reversed);
+
+                p.y = y;
+
+                for (size_t x0 = 0; x0 < w; x0 += PTMPixels::lanes)
+                {
+                    p.x = x0;
+                    p.count = std::min(PTMPixels::lanes, w - x0);
+
+                    for (size_t k = 0; k < p.count; ++k)
+                    {
+                        const size_t x = x0 + k;
+                        const size_t src = first + (reversed ? w - 1 - x : x);
+
+                        for (size_t i = 0; i < 6; ++i)
+                            p.a[i][k] = coeff[src*6 + i];
+
+                        for (size_t c = 0; c < 3; ++c)
+                            p.rgb[c][k] = color[src*3 + c];
+                    }
+
+                    detail::ptm_run_stages(p, stages...);
+
+                    unsigned char* dst = out + (y * w + x0) * 3;
+
+                    for (size_t k = 0; k < p.count; ++k)
+                        for (size_t c = 0; c < 3; ++c)
+                        {
+                            float v = p.out[c][k];
+                            v = v < 0.f ? 0.f : (v > 255.f ? 255.f : v);
+
+                            dst[k*3 + c] = static_cast<unsigned char>(v + 0.5f);
+                        }
+                }
+            }
+        });
+    }
+
+    /**
+     * Read and convert a PTM to regular RGB images
+     *
+     * This function loads a PTM from a given filename and converts it into three RGB arrays. This
+     * template accepts either unsigned char** or taf::uchar_vec* as types for coeff_h,
+     * coeff_l or rgb.
+     */
+    template<typename Container>
+    PTMHeader12 ptm_load(const char* file, Container coeff_h, Container coeff_l, Container rgb)
+    {
+        PTM12 ptm;
+
+        ptm_load(file, &ptm);
+
+        const size_t size = ptm.header.width * ptm.header.height * 3;
+
+        detail::ptm_allocate(coeff_h, coeff_l, rgb, size);
+
+        unsigned char* h_ptr   = &((*coeff_h)[0]);
+        unsigned char* l_ptr   = &((*coeff_l)[0]);
+        unsigned char* rgb_ptr = &((*rgb)[0]);
+
+        ptm_load(&ptm, &h_ptr, &l_ptr, &rgb_ptr);
+
+        return std::move(ptm.header);
+    }
+}
+
+#ifdef TAF_PTM_IMPLEMENTATION
+
+#include <map>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <iterator>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <cstdlib>
+#include <cstdio>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <cerrno>
+#endif
+#include <mutex>
+#include <cmath>
+#include <limits>
+#include <chrono>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// long JPEG planes can be interrupted after every row of blocks
+#define STBI_YIELD() taf::ptm_preemption_point()
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#if !defined(TAF_PTM_NO_STB_IMAGE_WRITE_IMPLEMENTATION) && !defined(STB_IMAGE_WRITE_IMPLEMENTATION)
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#endif
+#include "stb_image_write.h"
+
+namespace taf
+{
+    namespace detail
+    {
+        /**
+         * Counters of one thread. Only the owning thread writes, so updates are plain relaxed
+         * loads and stores; snapshots may read concurrently.
+         */
+        struct MetricsBlock
+        {
+            std::atomic<uint64_t> counters[PTM_COUNTER_COUNT];
+            std::atomic<uint64_t> stage_count[PTM_STAGE_COUNT];
+            std::atomic<uint64_t> stage_nanoseconds[PTM_STAGE_COUNT];
+            std::atomic<uint64_t> buckets[PTM_STAGE_COUNT][PTMMetrics::num_buckets];
+            std::atomic<uint64_t> lane_count[PTM_LANE_COUNT];
+            std::atomic<uint64_t> lane_nanoseconds[PTM_LANE_COUNT];
+            std::atomic<uint64_t> lane_buckets[PTM_LANE_COUNT][PTMMetrics::num_buckets];
+
+            MetricsBlock()
+            {
+                for (auto& c : counters) c = 0;
+                for (auto& c : stage_count) c = 0;
+                for (auto& c : stage_nanoseconds) c = 0;
+                for (auto& s : buckets) for (auto& c : s) c = 0;
+                for (auto& c : lane_count) c = 0;
+                for (auto& c : lane_nanoseconds) c = 0;
+                for (auto& s : lane_buckets) for (auto& c : s) c = 0;
+            }
+
+            void add_to(PTMMetrics* m) const
+            {
+                for (size_t i = 0; i < PTM_COUNTER_COUNT; ++i)
+                    m->counters[i] += counters[i].load(std::memory_order_relaxed);
+
+                for (size_t s = 0; s < PTM_STAGE_COUNT; ++s)
+                {
+                    m->stages[s].count += stage_count[s].load(std::memory_order_relaxed);
+                    m->stages[s].nanoseconds += stage_nanoseconds[s].load(std::memory_order_relaxed);
+
+                    for (size_t b = 0; b < PTMMetrics::num_buckets; ++b)
+                        m->stages[s].buckets[b] += buckets[s][b].load(std::memory_order_relaxed);
+                }
+
+                for (size_t l = 0; l < PTM_LANE_COUNT; ++l)
+                {
+                    m->lanes[l].count += lane_count[l].load(std::memory_order_relaxed);
+                    m->lanes[l].nanoseconds += lane_nanoseconds[l].load(std::memory_order_relaxed);
+
+                    for (size_t b = 0; b < PTMMetrics::num_buckets; ++b)
+                        m->lanes[l].buckets[b] += lane_buckets[l][b].load(std::memory_order_relaxed);
+                }
+            }
+        };
+
+        inline void metrics_add(std::atomic<uint64_t>& c, uint64_t v)
+        {
+            c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+        }
+
+        struct MetricsRegistry
+        {
+            std::mutex mutex;
+            std::vector<const MetricsBlock*> blocks;
+            PTMMetrics retired;
+        };
+
+        // never destroyed, threads may still exit after static destructors ran
+        MetricsRegistry& metrics_registry()
+        {
+            static MetricsRegistry* registry = new MetricsRegistry();
+            return *registry;
+        }
+
+        struct ThreadMetrics
+        {
+            MetricsBlock block;
+
+            ThreadMetrics()
+            {
+                MetricsRegistry& r = metrics_registry();
+                std::lock_guard<std::mutex> lock(r.mutex);
+                r.blocks.push_back(&block);
+            }
+
+            ~ThreadMetrics()
+            {
+                MetricsRegistry& r = metrics_registry();
+                std::lock_guard<std::mutex> lock(r.mutex);
+                block.add_to(&r.retired);
+                r.blocks.erase(std::find(r.blocks.begin(), r.blocks.end(), &block));
+            }
+        };
+
+        MetricsBlock& thread_metrics()
+        {
+            thread_local ThreadMetrics metrics;
+            return metrics.block;
+        }
+
+        void metrics_count(PTMCounter counter, uint64_t v = 1)
+        {
+#ifndef TAF_PTM_NO_METRICS
+            metrics_add(thread_metrics().counters[counter], v);
+#else
+            (void)counter; (void)v;
+#endif
+        }
+
+        void metrics_allocation(size_t bytes)
+        {
+            metrics_count(PTM_COUNTER_ALLOCATIONS);
+            metrics_count(PTM_COUNTER_ALLOCATED_BYTES, bytes);
+        }
+
+        // resize a buffer, counting an allocation if it has to grow
+        void metrics_resize(std::vector<unsigned char>* v, size_t size)
+        {
+            if (v->capacity() < size)
+                metrics_allocation(size);
+
+            v->resize(size);
+        }
+
+        // latency histogram bucket of a duration
+        size_t metrics_bucket(uint64_t ns)
+        {
+            size_t bucket = 0;
+            for (uint64_t bound = 100000; bucket + 1 < PTMMetrics::num_buckets && ns > bound; bound *= 10)
+                ++bucket;
+
+            return bucket;
+        }
+
+        void metrics_queue_latency(PTMLane lane, uint64_t ns)
+        {
+#ifndef TAF_PTM_NO_METRICS
+            MetricsBlock& m = thread_metrics();
+            metrics_add(m.lane_count[lane], 1);
+            metrics_add(m.lane_nanoseconds[lane], ns);
+            metrics_add(m.lane_buckets[lane][metrics_bucket(ns)], 1);
+#else
+            (void)lane; (void)ns;
+#endif
+        }
+
+        StageTimer::~StageTimer()
+        {
+#ifndef TAF_PTM_NO_METRICS
+            uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count();
+
+            MetricsBlock& m = thread_metrics();
+            metrics_add(m.stage_count[stage_], 1);
+            metrics_add(m.stage_nanoseconds[stage_], ns);
+            metrics_add(m.buckets[stage_][metrics_bucket(ns)], 1);
+#endif
+        }
+    }
+
+    void ptm_metrics(PTMMetrics* metrics)
+    {
+        detail::MetricsRegistry& r = detail::metrics_registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+
+        *metrics = r.retired;
+
+        for (auto block : r.blocks)
+            block->add_to(metrics);
+    }
+
+    std::string ptm_metrics_openmetrics(const PTMMetrics* metrics)
+    {
+        static const struct { const char* name; const char* unit; const char* help; } counters[PTM_COUNTER_COUNT] =
+        {
+            { "taf_ptm_files_loaded", nullptr, "PTM files loaded" },
+            { "taf_ptm_read_bytes", "bytes", "Bytes read from PTM files" },
+            { "taf_ptm_planes_decoded", nullptr, "Compressed planes decoded" },
+            { "taf_ptm_cache_hits", nullptr, "PTMCache requests served decoded" },
+            { "taf_ptm_cache_compressed_hits", nullptr, "PTMCache requests decoded from the compressed tier" },
+            { "taf_ptm_cache_misses", nullptr, "PTMCache requests read from disk" },
+            { "taf_ptm_cache_shared_decodes", nullptr, "PTMCache requests that waited for a decode in flight" },
+            { "taf_ptm_allocations", nullptr, "Image and coefficient buffers allocated" },
+            { "taf_ptm_allocated_bytes", "bytes", "Bytes of image and coefficient buffers allocated" },
+        };
+
+        static const char* stages[PTM_STAGE_COUNT] = { "read", "decode", "convert", "relight", "material", "hemisphere", "filter" };
+        static const char* bounds[PTMMetrics::num_buckets] = { "0.0001", "0.001", "0.01", "0.1", "1.0", "10.0", "+Inf" };
+
+        std::ostringstream out;
+
+        for (size_t i = 0; i < PTM_COUNTER_COUNT; ++i)
+        {
+            out << "# TYPE " << counters[i].name << " counter\n";
+
+            if (counters[i].unit)
+                out << "# UNIT " << counters[i].name << " " << counters[i].unit << "\n";
+
+            out << "# HELP " << counters[i].name << " " << counters[i].help << ".\n";
+            out << counters[i].name << "_total " << metrics->counters[i] << "\n";
+        }
+
+        out << "# TYPE taf_ptm_stage_seconds histogram\n";
+        out << "# UNIT taf_ptm_stage_seconds seconds\n";
+        out << "# HELP taf_ptm_stage_seconds Time spent per call in each stage.\n";
+
+        for (size_t s = 0; s < PTM_STAGE_COUNT; ++s)
+        {
+            const PTMMetrics::Stage& stage = metrics->stages[s];
+            uint64_t cumulative = 0;
+
+            for (size_t b = 0; b < PTMMetrics::num_buckets; ++b)
+            {
+                cumulative += stage.buckets[b];
+                out << "taf_ptm_stage_seconds_bucket{stage=\"" << stages[s] << "\",le=\"" << bounds[b] << "\"} " << cumulative << "\n";
+            }
+
+            out << "taf_ptm_stage_seconds_sum{stage=\"" << stages[s] << "\"} " << stage.nanoseconds * 1e-9 << "\n";
+            out << "taf_ptm_stage_seconds_count{stage=\"" << stages[s] << "\"} " << stage.count << "\n";
+        }
+
+        static const char* lanes[PTM_LANE_COUNT] = { "interactive", "bulk" };
+
+        out << "# TYPE taf_ptm_queue_seconds histogram\n";
+        out << "# UNIT taf_ptm_queue_seconds seconds\n";
+        out << "# HELP taf_ptm_queue_seconds Time jobs waited for a thread in each scheduler lane.\n";
+
+        for (size_t l = 0; l < PTM_LANE_COUNT; ++l)
+        {
+            const PTMMetrics::Stage& lane = metrics->lanes[l];
+            uint64_t cumulative = 0;
+
+            for (size_t b = 0; b < PTMMetrics::num_buckets; ++b)
+            {
+                cumulative += lane.buckets[b];
+                out << "taf_ptm_queue_seconds_bucket{lane=\"" << lanes[l] << "\",le=\"" << bounds[b] << "\"} " << cumulative << "\n";
+            }
+
+            out << "taf_ptm_queue_seconds_sum{lane=\"" << lanes[l] << "\"} " << lane.nanoseconds * 1e-9 << "\n";
+            out << "taf_ptm_queue_seconds_count{lane=\"" << lanes[l] << "\"} " << lane.count << "\n";
+        }
+
+        out << "# EOF\n";
+
+        return out.str();
+    }
+
+    bool is_compressed(const PTMHeader12* ptm)
+    {
+        return ptm->format == PTM_FORMAT_JPEG_RGB ||
+               ptm->format == PTM_FORMAT_JPEG_LRGB ||
+               ptm->format == PTM_FORMAT_JPEGLS_RGB ||
+               ptm->format == PTM_FORMAT_JPEGLS_LRGB;
+    }
+
+    bool is_lrgb(const PTMHeader12* ptm)
+    {
+        return ptm->format == PTM_FORMAT_JPEG_LRGB ||
+               ptm->format == PTM_FORMAT_LRGB ||
+               ptm->format == PTM_FORMAT_JPEGLS_LRGB;
+    }
+
+    size_t get_epp(const PTMHeader12* ptm)
+    {
+        if (is_lrgb(ptm))
+            return 9;
+        else
+            return 18;
+    }
+
+    namespace detail
+    {
+        void init_ci(PTMHeader12* ptm)
+        {
+            size_t epp = get_epp(ptm);
+            ptm->ci.transforms.resize(epp);
+            ptm->ci.motion_vectors.resize(epp*2);
+            ptm->ci.order.resize(epp);
+            ptm->ci.reference_planes.resize(epp);
+            ptm->ci.compressed_size.resize(epp);
+            ptm->ci.side_information.resize(epp);
+        }
+
+        void ptm_allocate(uchar_vec* coeff_h, uchar_vec* coeff_l, uchar_vec* rgb, size_t size)
+        {
+            metrics_resize(coeff_h, size);
+            metrics_resize(coeff_l, size);
+            metrics_resize(rgb, size);
+        }
+
+        void ptm_allocate(unsigned char** coeff_h, unsigned char** coeff_l, unsigned char** rgb, size_t size)
+        {
+            for (size_t i = 0; i < 3; ++i)
+                metrics_allocation(size);
+
+            (*coeff_h) = new unsigned char[size];
+            (*coeff_l) = new unsigned char[size];
+            (*rgb)     = new unsigned char[size];
+        }
+    }
+
+    void ptm_cleanup(unsigned char** coeff_h, unsigned char** coeff_l, unsigned char** rgb)
+    {
+        delete [] *coeff_h;
+        delete [] *coeff_l;
+        delete [] *rgb;
+
+        *coeff_h = nullptr;
+        *coeff_l = nullptr;
+        *rgb = nullptr;
+    }
+
+    namespace detail
+    {
+        void ptm_read_header(std::istream& stream, PTMHeader12* ptm)
+        {
+            std::string version;
+            stream >> version;
+
+            TAF_ASSERT(version == "PTM_1.2", "Wrong version");
+
+            std::string format;
+            stream >> format;
+
+            TAF_ASSERT(format == "PTM_FORMAT_LRGB" || format == "PTM_FORMAT_JPEG_LRGB", (std::string("Unknown format:") + format).c_str());
+
+            if (format == "PTM_FORMAT_LRGB")
+                ptm->format = PTM_FORMAT_LRGB;
+            else if (format == "PTM_FORMAT_JPEG_LRGB")
+                ptm->format = PTM_FORMAT_JPEG_LRGB;
+
+            stream >> ptm->width;
+            stream >> ptm->height;
+
+            TAF_ASSERT(stream.good() && ptm->width > 0 && ptm->height > 0, "Invalid PTM size");
+
+            for (size_t i = 0; i < 6; ++i)
+                stream >> ptm->scale[i];
+
+            for (size_t i = 0; i < 6; ++i)
+                stream >> ptm->bias[i];
+
+            size_t epp = get_epp(ptm);
+
+            if (is_compressed(ptm))
+            {
+                detail::init_ci(ptm);
+
+                stream >> ptm->ci.compressionParameter;
+
+                // TODO: enum
+                for (size_t i = 0; i < epp; ++i)
+                {
+                    int v;
+                    stream >> v;
+                    switch(v)
+                    {
+                        default:
+                        case 0:
+                            ptm->ci.transforms[i] = NOTHING;
+                            break;
+                        case 1:
+                            ptm->ci.transforms[i] = PLANE_INVERSION;
+                            break;
+                        case 2:
+                            ptm->ci.transforms[i] = MOTION_COMPENSATION;
+                            break;
+                    }
+                }
+
+                for (size_t i = 0; i < epp * 2; ++i)
+                    stream >> ptm->ci.motion_vectors[i];
+
+                for (size_t i = 0; i < epp; ++i)
+                    stream >> ptm->ci.order[i];
+
+                for (size_t i = 0; i < epp; ++i)
+                    stream >> ptm->ci.reference_planes[i];
+
+                for (size_t i = 0; i < epp; ++i)
+                    stream >> ptm->ci.compressed_size[i];
+
+                for (size_t i = 0; i < epp; ++i)
+                    stream >> ptm->ci.side_information[i];
+            }
+
+            // search for newline
+            char temp;
+            do { stream.read(&temp, 1); } while (stream.good() && temp != '\n');
+
+            TAF_ASSERT(stream.good(), "Unexpected end of file");
+        }
+    }
+
+    PTMHeader12 ptm_probe(const char* file)
+    {
+        std::ifstream stream(file, std::ios::binary);
+
+        TAF_ASSERT(stream.good(), "Can't open file");
+
+        PTMHeader12 header;
+
+        if (detail::ptm_is_lossless(stream))
+        {
+            size_t tile_size;
+            std::vector<uint64_t> offsets;
+            detail::ptm_read_lossless_index(stream, &header, &tile_size, &offsets);
+        }
+        else
+            detail::ptm_read_header(stream, &header);
+
+        return header;
+    }
+
+    uint64_t ptm_cost(const PTMHeader12* header)
+    {
+        const uint64_t bytes = static_cast<uint64_t>(header->width) * header->height * get_epp(header);
+
+        return is_compressed(header) ? bytes * 4 : bytes;
+    }
+
+    namespace detail
+    {
+        /**
+         * ptm_load of a PTM12 that also keeps the compressed planes of a JPEG PTM in compressed,
+         * if it isn't null, so the file is opened and parsed only once
+         */
+        void ptm_load(const char* file, PTM12* ptm, PTMCompressed* compressed)
+        {
+            std::ifstream stream(file, std::ios::binary);
+
+            TAF_ASSERT(stream.good(), "Can't open file");
+
+            if (detail::ptm_is_lossless(stream))
+            {
+                stream.close();
+
+                PTMHeader12 header = ptm_probe(file);
+                ptm_load_region(file, 0, 0, header.width, header.height, ptm);
+
+                return;
+            }
+
+            detail::ptm_read_header(stream, &ptm->header);
+
+            size_t epp = get_epp(&ptm->header);
+
+            detail::metrics_count(PTM_COUNTER_FILES_LOADED);
+
+            ptm->coefficients.clear();
+
+            size_t size = ptm->header.width * ptm->header.height * epp;
+            detail::metrics_resize(&ptm->coefficients, size);
+
+            if (ptm->header.format == PTM_FORMAT_LRGB)
+            {
+                detail::StageTimer timer(PTM_STAGE_READ);
+
+                // large files are read in chunks with preemption points in between
+                const size_t chunk = 16 << 20;
+
+                for (size_t offset = 0; offset < size && stream.good(); offset += chunk)
+                {
+                    ptm_preemption_point();
+
+                    stream.read(reinterpret_cast<char*>(&ptm->coefficients[offset]), std::min(chunk, size - offset));
+                    detail::metrics_count(PTM_COUNTER_BYTES_READ, static_cast<size_t>(stream.gcount()));
+                }
+            }
+            else if (ptm->header.format == PTM_FORMAT_JPEG_LRGB)
+            {
+                PTMCompressed planes;
+                PTMCompressed* target = compressed ? compressed : &planes;
+                target->header = std::move(ptm->header);
+
+                detail::ptm_read_payload(stream, target);
+                detail::ptm_decode_coefficients(target, &ptm->coefficients);
+
+                // a kept PTMCompressed needs its own header
+                if (compressed)
+                    ptm->header = compressed->header;
+                else
+                    ptm->header = std::move(planes.header);
+            }
+
+            stream.close();
+        }
+    }
+
+    void ptm_load(const char* file, PTM12* ptm)
+    {
+        detail::ptm_load(file, ptm, nullptr);
+    }
+
+    void ptm_load(const char* file, PTMCompressed* ptm)
+    {
+        std::ifstream stream(file, std::ios::binary);
+
+        TAF_ASSERT(stream.good(), "Can't open file");
+
+        detail::ptm_read_header(stream, &ptm->header);
+
+        TAF_ASSERT(is_compressed(&ptm->header), "PTM is not compressed");
+
+        detail::metrics_count(PTM_COUNTER_FILES_LOADED);
+        detail::ptm_read_payload(stream, ptm);
+    }
+
+    namespace detail
+    {
+        typedef std::unique_ptr<unsigned char, void(*)(void*)> DecodedPlane;
+
+        /**
+         * Decode all planes of a JPEG PTM and apply prediction and side information. The planes
+         * are upside down, like in the file.
+         */
+        void ptm_decode_planes(const PTMCompressed* compressed, std::vector<DecodedPlane>* decoded)
+        {
+            const PTMHeader12& header = compressed->header;
+
+            TAF_ASSERT(header.format == PTM_FORMAT_JPEG_LRGB, "Can't decode format");
+            TAF_ASSERT(header.width <= 65535 && header.height <= 65535, "JPEG planes can't be larger than 65535x65535");
+
+            const size_t epp = get_epp(&header);
+            const size_t num_pixels = header.width * header.height;
+
+            std::vector<size_t> offsets(epp + 1, 0);
+            std::map<size_t, size_t> order;
+
+            for (size_t p = 0; p < epp; ++p)
+            {
+                offsets[p + 1] = offsets[p] + header.ci.compressed_size[p] + header.ci.side_information[p];
+                order[header.ci.order[p]] = p;
+            }
+
+            TAF_ASSERT(offsets[epp] <= compressed->data.size(), "Unexpected end of file");
+
+            // first pass: decode all planes and their side information in parallel
+            std::vector<DecodedPlane>& planes = *decoded;
+            std::vector<SideInformation> side_info(epp);
+
+            planes.clear();
+
+            for (size_t p = 0; p < epp; ++p)
+                planes.emplace_back(nullptr, stbi_image_free);
+
+            parallel_for(0, epp, 1, [&](size_t b, size_t e)
+            {
+                for (size_t p = b; p < e; ++p)
+                {
+                    ptm_preemption_point();
+
+                    const unsigned char* data = &compressed->data[offsets[p]];
+                    const size_t bufs = header.ci.compressed_size[p];
+                    const size_t sides = header.ci.side_information[p];
+
+                    planes[p].reset(ptm_decode_jpeg_plane(&header, data, bufs));
+
+                    if (sides > 0)
+                        ptm_decode_side_information(data + bufs, sides, header.width, header.height, &side_info[p]);
+                }
+            });
+
+            // second pass: apply predicition and transformation
+            for (size_t n = 0; n < epp; ++n)
+            {
+                ptm_preemption_point();
+
+                // query actual plane number according to order map
+                size_t i = order[n];
+                int j = header.ci.reference_planes[i];
+
+                unsigned char* i_plane = planes[i].get();
+
+                // prediction if plane index j is not -1
+                if (j >= 0)
+                {
+                    TAF_ASSERT(static_cast<size_t>(j) < epp, "Invalid reference plane");
+
+                    ptm_predict_plane(i_plane, planes[j].get(), header.ci.transforms[i], 0, num_pixels);
+                }
+
+                // apply correction from sideinformation
+                ptm_apply_side_information(side_info[i], i_plane, 0, num_pixels);
+            }
+        }
+
+        /**
+         * Decode a JPEG PTM into the coefficients of a PTM12, without touching its header
+         */
+        void ptm_decode_coefficients(const PTMCompressed* compressed, uchar_vec* coefficients)
+        {
+            const PTMHeader12& header = compressed->header;
+            const size_t num_pixels = header.width * header.height;
+
+            StageTimer timer(PTM_STAGE_DECODE);
+
+            std::vector<DecodedPlane> planes;
+            ptm_decode_planes(compressed, &planes);
+
+            metrics_resize(coefficients, num_pixels * get_epp(&header));
+
+            for (size_t y = 0; y < header.height; ++y)
+                for (size_t x = 0; x < header.width; ++x)
+                {
+                    size_t index = (x + y*header.width);
+                    size_t invin = num_pixels - index - 1;
+
+                    for (size_t p = 0; p < 6; ++p)
+                        (*coefficients)[index*6 + p] = planes[p].get()[invin];
+
+                    for (size_t p = 0; p < 3; ++p)
+                        (*coefficients)[num_pixels*6 + index*3 + p] = planes[6 + p].get()[invin];
+                }
+        }
+    }
+
+    void ptm_decode(const PTMCompressed* compressed, PTM12* ptm)
+    {
+        detail::ptm_decode_coefficients(compressed, &ptm->coefficients);
+        ptm->header = compressed->header;
+    }
+
+    void ptm_decode(PTMCompressed&& compressed, PTM12* ptm)
+    {
+        detail::ptm_decode_coefficients(&compressed, &ptm->coefficients);
+        ptm->header = std::move(compressed.header);
+    }
+
+    void ptm_load(const PTM12* ptm, unsigned char** coeff_h, unsigned char** coeff_l, unsigned char** rgb)
+    {
+        ptm_load(&ptm->header, &ptm->coefficients[0], coeff_h, coeff_l, rgb);
+    }
+
+    void ptm_load(const PTMHeader12* header, const unsigned char* coefficients, unsigned char** coeff_h, unsigned char** coeff_l, unsigned char** rgb)
+    {
+        TAF_ASSERT(header->format == PTM_FORMAT_LRGB || header->format == PTM_FORMAT_JPEG_LRGB, "Can't read format into RGB buffer");
+
+        const size_t num_pixels = header->width * header->height;
+
+        detail::StageTimer timer(PTM_STAGE_CONVERT);
+        detail::ptm_convert_rows(header, coefficients, coefficients + num_pixels*6, 0, header->height, *coeff_h, *coeff_l, *rgb);
+    }
+
+    PTMImage::PTMImage() : header_(), block_(nullptr), data_(nullptr), capacity_(0)
+    {
+    }
+
+    PTMImage::PTMImage(PTMImage&& other)
+        : header_(std::move(other.header_)), block_(other.block_), data_(other.data_), capacity_(other.capacity_)
+    {
+        other.header_.width = other.header_.height = 0;
+        other.block_ = other.data_ = nullptr;
+        other.capacity_ = 0;
+    }
+
+    PTMImage& PTMImage::operator=(PTMImage&& other)
+    {
+        if (this != &other)
+        {
+            ::operator delete(block_);
+
+            header_ = std::move(other.header_);
+            block_ = other.block_;
+            data_ = other.data_;
+            capacity_ = other.capacity_;
+
+            other.header_.width = other.header_.height = 0;
+            other.block_ = other.data_ = nullptr;
+            other.capacity_ = 0;
+        }
+
+        return *this;
+    }
+
+    PTMImage::~PTMImage()
+    {
+        ::operator delete(block_);
+    }
+
+    void PTMImage::reset(PTMHeader12&& header)
+    {
+        const size_t size = header.width * header.height * 3 * PTM_PLANE_COUNT;
+
+        if (size > capacity_)
+        {
+            ::operator delete(block_);
+            block_ = data_ = nullptr;
+            capacity_ = 0;
+
+            block_ = static_cast<unsigned char*>(::operator new(size + alignment - 1));
+            data_ = reinterpret_cast<unsigned char*>((reinterpret_cast<uintptr_t>(block_) + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1));
+            capacity_ = size;
+
+            detail::metrics_allocation(size);
+        }
+
+        header_ = std::move(header);
+    }
+
+    void PTMImage::clear()
+    {
+        ::operator delete(block_);
+
+        header_ = PTMHeader12();
+        block_ = data_ = nullptr;
+        capacity_ = 0;
+    }
+
+    void ptm_load(const char* file, PTMImage* image)
+    {
+        std::ifstream stream(file, std::ios::binary);
+
+        TAF_ASSERT(stream.good(), "Can't open file");
+
+        unsigned char* h_ptr;
+        unsigned char* l_ptr;
+        unsigned char* rgb_ptr;
+
+        auto reset = [&](PTMHeader12&& header)
+        {
+            image->reset(std::move(header));
+
+            h_ptr   = image->plane(PTM_PLANE_COEFF_H).data;
+            l_ptr   = image->plane(PTM_PLANE_COEFF_L).data;
+            rgb_ptr = image->plane(PTM_PLANE_RGB).data;
+        };
+
+        if (detail::ptm_is_lossless(stream))
+        {
+            stream.close();
+
+            PTM12 ptm;
+            ptm_load(file, &ptm);
+
+            reset(std::move(ptm.header));
+
+            const size_t num_pixels = image->width() * image->height();
+
+            detail::StageTimer timer(PTM_STAGE_CONVERT);
+            detail::ptm_convert_rows(&image->header(), &ptm.coefficients[0], &ptm.coefficients[num_pixels*6], 0, image->height(), h_ptr, l_ptr, rgb_ptr);
+
+            return;
+        }
+
+        PTMHeader12 header;
+        detail::ptm_read_header(stream, &header);
+
+        TAF_ASSERT(header.format == PTM_FORMAT_LRGB || header.format == PTM_FORMAT_JPEG_LRGB, "Can't read format into RGB buffer");
+
+        detail::metrics_count(PTM_COUNTER_FILES_LOADED);
+
+        if (header.format == PTM_FORMAT_JPEG_LRGB)
+        {
+            PTMCompressed compressed;
+            compressed.header = std::move(header);
+
+            detail::ptm_read_payload(stream, &compressed);
+
+            std::vector<detail::DecodedPlane> planes;
+
+            {
+                detail::StageTimer timer(PTM_STAGE_DECODE);
+                detail::ptm_decode_planes(&compressed, &planes);
+            }
+
+            compressed.data.clear();
+            reset(std::move(compressed.header));
+
+            unsigned char* p[9];
+            for (size_t i = 0; i < 9; ++i)
+                p[i] = planes[i].get();
+
+            detail::StageTimer timer(PTM_STAGE_CONVERT);
+            detail::ptm_convert_plane_rows(&image->header(), p, 0, image->height(), h_ptr, l_ptr, rgb_ptr);
+
+            return;
+        }
+
+        reset(std::move(header));
+
+        const size_t w = image->width();
+        const size_t h = image->height();
+        const size_t num_pixels = w * h;
+        const std::streamoff offset = stream.tellg();
+
+        // output rows [y0, y1) are the rows [h - y1, h - y0) of the file, read in chunks of a few MB
+        const size_t rows = std::max<size_t>((4 << 20) / (w * 9), 1);
+        std::vector<unsigned char> coeff(std::min(rows, h) * w * 6), color(std::min(rows, h) * w * 3);
+
+        detail::StageTimer timer(PTM_STAGE_READ);
+
+        for (size_t y0 = 0; y0 < h; y0 += rows)
+        {
+            ptm_preemption_point();
+
+            const size_t y1 = std::min(y0 + rows, h);
+            const size_t first = (h - y1) * w, n = (y1 - y0) * w;
+
+            stream.seekg(offset + static_cast<std::streamoff>(first * 6));
+            stream.read(reinterpret_cast<char*>(&coeff[0]), n * 6);
+            stream.seekg(offset + static_cast<std::streamoff>(num_pixels * 6 + first * 3));
+            stream.read(reinterpret_cast<char*>(&color[0]), n * 3);
+
+            TAF_ASSERT(stream.good(), "Unexpected end of file");
+
+            detail::metrics_count(PTM_COUNTER_BYTES_READ, n * 9);
+
+            detail::parallel_for(y0, y1, 64, [&](size_t b, size_t e)
+            {
+                for (size_t y = b; y < e; ++y)
+                {
+                    const unsigned char* c = &coeff[(y1 - 1 - y) * w * 6];
+                    const unsigned char* rgb = &color[(y1 - 1 - y) * w * 3];
+                    const size_t row = y * w * 3;
+
+                    for (size_t x = 0; x < w; ++x)
+                        for (size_t k = 0; k < 3; ++k)
+                        {
+                            h_ptr[row + x*3 + k]   = c[x*6 + k];
+                            l_ptr[row + x*3 + k]   = c[x*6 + k + 3];
+                            rgb_ptr[row + x*3 + k] = rgb[x*3 + k];
+                        }
+                }
+            });
+        }
+    }
+
+    namespace detail
+    {
+        /**
+         * Histogram interleaved data with a fixed number of channels into planes [first, first + N)
+         */
+        template<size_t N>
+        void ptm_stats_histogram(PTMStats* stats, size_t first, const unsigned char* data, size_t num_pixels)
+        {
+            std::mutex merge;
+
+            detail::parallel_for(0, num_pixels, 1 << 16, [&](size_t b, size_t e)
+            {
+                std::vector<size_t> bins(N * 256, 0);
+
+                for (size_t p = b; p < e; ++p)
+                {
+                    const unsigned char* px = data + p*N;
+
+                    for (size_t c = 0; c < N; ++c)
+                        bins[c*256 + px[c]]++;
+                }
+
+                std::lock_guard<std::mutex> lock(merge);
+
+                for (size_t c = 0; c < N; ++c)
+                    for (size_t i = 0; i < 256; ++i)
+                        stats->planes[first + c].histogram[i] += bins[c*256 + i];
+            });
+        }
+    }
+
+    void ptm_stats_reset(PTMStats* stats)
+    {
+        stats->num_pixels = 0;
+
+        for (auto& plane : stats->planes)
+        {
+            plane.min = 0;
+            plane.max = 0;
+            plane.mean = 0;
+            plane.variance = 0;
+            std::fill(plane.histogram, plane.histogram + 256, 0);
+        }
+    }
+
+    void ptm_stats_update_coefficients(PTMStats* stats, const unsigned char* coeff, size_t num_pixels)
+    {
+        detail::ptm_stats_histogram<6>(stats, 0, coeff, num_pixels);
+    }
+
+    void ptm_stats_update_rgb(PTMStats* stats, const unsigned char* rgb, size_t num_pixels)
+    {
+        detail::ptm_stats_histogram<3>(stats, 6, rgb, num_pixels);
+    }
+
+    void ptm_stats_finish(PTMStats* stats)
+    {
+        // all moments of 8 bit data follow exactly from the histogram
+        for (auto& plane : stats->planes)
+        {
+            size_t count = 0;
+            double sum = 0, sum2 = 0;
+
+            plane.min = 255;
+            plane.max = 0;
+
+            for (size_t i = 0; i < 256; ++i)
+            {
+                size_t n = plane.histogram[i];
+
+                if (n == 0)
+                    continue;
+
+                plane.min = std::min(plane.min, static_cast<unsigned char>(i));
+                plane.max = std::max(plane.max, static_cast<unsigned char>(i));
+
+                count += n;
+                sum  += static_cast<double>(n) * i;
+                sum2 += static_cast<double>(n) * i * i;
+            }
+
+            if (count == 0)
+            {
+                plane.min = plane.max = 0;
+                plane.mean = plane.variance = 0;
+                continue;
+            }
+
+            plane.mean = sum / count;
+            plane.variance = std::max(sum2 / count - plane.mean * plane.mean, 0.0);
+            stats->num_pixels = count;
+        }
+    }
+
+    void ptm_stats(const PTM12* ptm, PTMStats* stats)
+    {
+        TAF_ASSERT(is_lrgb(&ptm->header), "Statistics are only supported for LRGB PTMs");
+
+        const size_t num_pixels = ptm->header.width * ptm->header.height;
+
+        ptm_stats_reset(stats);
+        ptm_stats_update_coefficients(stats, &ptm->coefficients[0], num_pixels);
+        ptm_stats_update_rgb(stats, &ptm->coefficients[num_pixels*6], num_pixels);
+        ptm_stats_finish(stats);
+    }
+
+    PTMHeader12 ptm_stats(const char* file, PTMStats* stats)
+    {
+        std::ifstream stream(file, std::ios::binary);
+
+        TAF_ASSERT(stream.good(), "Can't open file");
+
+        PTMHeader12 header;
+        bool lossless = detail::ptm_is_lossless(stream);
+
+        if (!lossless)
+            detail::ptm_read_header(stream, &header);
+
+        if (lossless || header.format != PTM_FORMAT_LRGB)
+        {
+            stream.close();
+
+            PTM12 ptm;
+            ptm_load(file, &ptm);
+            ptm_stats(&ptm, stats);
+
+            return std::move(ptm.header);
+        }
+
+        const size_t num_pixels = header.width * header.height;
+        const size_t chunk = 1 << 20;
+
+        std::vector<unsigned char> buffer(chunk * 6);
+
+        detail::metrics_count(PTM_COUNTER_FILES_LOADED);
+        detail::metrics_count(PTM_COUNTER_BYTES_READ, num_pixels * 9);
+
+        ptm_stats_reset(stats);
+
+        // coefficient block first, then the rgb block
+        for (size_t p = 0; p < num_pixels; p += chunk)
+        {
+            size_t n = std::min(chunk, num_pixels - p);
+            stream.read(reinterpret_cast<char*>(&buffer[0]), n * 6);
+            TAF_ASSERT(stream.good(), "Unexpected end of file");
+            ptm_stats_update_coefficients(stats, &buffer[0], n);
+        }
+
+        for (size_t p = 0; p < num_pixels; p += chunk)
+        {
+            size_t n = std::min(chunk, num_pixels - p);
+            stream.read(reinterpret_cast<char*>(&buffer[0]), n * 3);
+            TAF_ASSERT(stream.gcount() == static_cast<std::streamsize>(n * 3), "Unexpected end of file");
+            ptm_stats_update_rgb(stats, &buffer[0], n);
+        }
+
+        ptm_stats_finish(stats);
+
+        return header;
+    }
+
+    namespace detail
+    {
+        /**
+         * Interleave one row of the three images into PTM pixels, with the flip decided at compile
+         * time so the loop stays simple enough to vectorize
+         */
+        template<bool Reversed>
+        void ptm_interleave_row(const unsigned char* coeff_h, const unsigned char* coeff_l, const unsigned char* rgb, size_t w, unsigned char* coeff, unsigned char* color)
+        {
+            for (size_t x = 0; x < w; ++x)
+            {
+                const size_t p = Reversed ? w - 1 - x : x;
+
+                coeff[p*6 + 0] = coeff_h[x*3 + 0];
+                coeff[p*6 + 1] = coeff_h[x*3 + 1];
+                coeff[p*6 + 2] = coeff_h[x*3 + 2];
+                coeff[p*6 + 3] = coeff_l[x*3 + 0];
+                coeff[p*6 + 4] = coeff_l[x*3 + 1];
+                coeff[p*6 + 5] = coeff_l[x*3 + 2];
+
+                color[p*3 + 0] = rgb[x*3 + 0];
+                color[p*3 + 1] = rgb[x*3 + 1];
+                color[p*3 + 2] = rgb[x*3 + 2];
+            }
+        }
+
+        void ptm_source_row(const PTMHeader12* ptm, size_t y, size_t* first, bool* reversed)
+        {
+            // LRGB PTMs are stored bottom up, JPEG PTMs are mirrored horizontally
+            if (ptm->format == PTM_FORMAT_JPEG_LRGB)
+            {
+                *first = y * ptm->width;
+                *reversed = true;
+            }
+            else
+            {
+                *first = (ptm->height - 1 - y) * ptm->width;
+                *reversed = false;
+            }
+        }
+
+        void ptm_relight_uniform(const PTM12* ptm, const float weights[3][7], unsigned char* out)
+        {
+            TAF_ASSERT(is_lrgb(&ptm->header), "Relighting is only supported for LRGB PTMs");
+
+            StageTimer timer(PTM_STAGE_RELIGHT);
+
+            const size_t w = ptm->header.width;
+            const size_t num_pixels = w * ptm->header.height;
+
+            const unsigned char* coeff = &ptm->coefficients[0];
+            const unsigned char* color = &ptm->coefficients[num_pixels*6];
+
+            detail::parallel_for(0, ptm->header.height, 16, [&](size_t b, size_t e)
+            {
+                std::vector<unsigned char> row(w * 3);
+
+                for (size_t y = b; y < e; ++y)
+                {
+                    size_t first;
+                    bool reversed;
+                    ptm_source_row(&ptm->header, y, &first, &reversed);
+
+                    const unsigned char* c = coeff + first*6;
+                    const unsigned char* rgb = color + first*3;
+
+                    for (size_t x = 0; x < w; ++x)
+                    {
+                        for (size_t k = 0; k < 3; ++k)
+                        {
+                            const float* wk = weights[k];
+
+                            float l = wk[6] +
+                                      wk[0] * c[x*6 + 0] + wk[1] * c[x*6 + 1] + wk[2] * c[x*6 + 2] +
+                                      wk[3] * c[x*6 + 3] + wk[4] * c[x*6 + 4] + wk[5] * c[x*6 + 5];
+
+                            float v = rgb[x*3 + k] * l;
+                            v = v < 0.f ? 0.f : (v > 255.f ? 255.f : v);
+
+                            row[x*3 + k] = static_cast<unsigned char>(v + 0.5f);
+                        }
+                    }
+
+                    unsigned char* dst = out + y * w * 3;
+
+                    if (reversed)
+                    {
+                        for (size_t x = 0; x < w; ++x)
+                            for (size_t k = 0; k < 3; ++k)
+                                dst[x*3 + k] = row[(w - 1 - x)*3 + k];
+                    }
+                    else
+                        std::copy(row.begin(), row.end(), dst);
+                }
+            });
+        }
+
+        /**
+         * Evaluate the PTM polynomial with light terms that vary per pixel
+         *
+         * row_terms(y, terms) is called once per output row and fills terms[i*width + x] with
+         * the 6 polynomial terms of each pixel, premultiplied by the light intensity. The loop
+         * over pixels then has no calls and can be vectorized.
+         */
+        template<typename RowTerms>
+        void ptm_relight_varying(const PTM12* ptm, RowTerms row_terms, unsigned char* out)
+        {
+            TAF_ASSERT(is_lrgb(&ptm->header), "Relighting is only supported for LRGB PTMs");
+
+            StageTimer timer(PTM_STAGE_RELIGHT);
+
+            const size_t w = ptm->header.width;
+            const size_t num_pixels = w * ptm->header.height;
+
+            const unsigned char* coeff = &ptm->coefficients[0];
+            const unsigned char* color = &ptm->coefficients[num_pixels*6];
+
+            float scale[6], bias[6];
+
+            for (size_t i = 0; i < 6; ++i)
+            {
+                scale[i] = ptm->header.scale[i] / 255.f;
+                bias[i] = static_cast<float>(ptm->header.bias[i]);
+            }
+
+            detail::parallel_for(0, ptm->header.height, 16, [&](size_t b, size_t e)
+            {
+                std::vector<float> terms(w * 6);
+                std::vector<float> lum(w);
+
+                for (size_t y = b; y < e; ++y)
+                {
+                    size_t first;
+                    bool reversed;
+                    ptm_source_row(&ptm->header, y, &first, &reversed);
+
+                    row_terms(y, &terms[0]);
+
+                    // gather the row in output order so both orientations share one loop
+                    const unsigned char* c = coeff + first*6;
+                    const ptrdiff_t step = reversed ? -1 : 1;
+                    const ptrdiff_t start = reversed ? static_cast<ptrdiff_t>(w) - 1 : 0;
+
+                    for (size_t x = 0; x < w; ++x)
+                    {
+                        const unsigned char* px = c + (start + step * static_cast<ptrdiff_t>(x)) * 6;
+
+                        float l = 0.f;
+                        for (size_t i = 0; i < 6; ++i)
+                            l += scale[i] * (px[i] - bias[i]) * terms[i*w + x];
+
+                        lum[x] = l;
+                    }
+
+                    const unsigned char* rgb = color + first*3;
+                    unsigned char* dst = out + y * w * 3;
+
+                    for (size_t x = 0; x < w; ++x)
+                    {
+                        const unsigned char* px = rgb + (start + step * static_cast<ptrdiff_t>(x)) * 3;
+
+                        for (size_t k = 0; k < 3; ++k)
+                        {
+                            float v = px[k] * lum[x];
+                            v = v < 0.f ? 0.f : (v > 255.f ? 255.f : v);
+                            dst[x*3 + k] = static_cast<unsigned char>(v + 0.5f);
+                        }
+                    }
+                }
+            });
+        }
+
+        /**
+         * Accumulate the squared errors and the largest absolute error of pixels [begin, end) of
+         * two arrays with n interleaved channels into sse[0..n) and max_error[0..n)
+         */
+        void ptm_plane_errors(const unsigned char* a, const unsigned char* b, size_t n, size_t begin, size_t end, double* sse, int* max_error)
+        {
+            size_t p = begin;
+
+#if defined(__SSE2__)
+            // 48 bytes hold 8 pixels of 6 channels or 16 pixels of 3, so each byte lane of the three
+            // vectors always sees the same channel; per lane sums of squares are 32 bit and are
+            // flushed before they can overflow
+            if (48 % n == 0)
+            {
+                const size_t period = 48 / n;
+                const __m128i zero = _mm_setzero_si128();
+
+                __m128i lane_max[3], lane_sum[3][4];
+                uint64_t sums[48] = { 0 };
+
+                for (size_t v = 0; v < 3; ++v)
+                {
+                    lane_max[v] = zero;
+
+                    for (size_t q = 0; q < 4; ++q)
+                        lane_sum[v][q] = zero;
+                }
+
+                auto flush = [&]()
+                {
+                    for (size_t v = 0; v < 3; ++v)
+                        for (size_t q = 0; q < 4; ++q)
+                        {
+                            uint32_t s[4];
+                            _mm_storeu_si128(reinterpret_cast<__m128i*>(s), lane_sum[v][q]);
+
+                            for (size_t i = 0; i < 4; ++i)
+                                sums[v*16 + q*4 + i] += s[i];
+
+                            lane_sum[v][q] = zero;
+                        }
+                };
+
+                for (size_t iterations = 0; p + period <= end; p += period)
+                {
+                    for (size_t v = 0; v < 3; ++v)
+                    {
+                        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + p*n + v*16));
+                        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + p*n + v*16));
+
+                        const __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+                        lane_max[v] = _mm_max_epu8(lane_max[v], d);
+
+                        __m128i lo = _mm_unpacklo_epi8(d, zero);
+                        __m128i hi = _mm_unpackhi_epi8(d, zero);
+                        lo = _mm_mullo_epi16(lo, lo);
+                        hi = _mm_mullo_epi16(hi, hi);
+
+                        lane_sum[v][0] = _mm_add_epi32(lane_sum[v][0], _mm_unpacklo_epi16(lo, zero));
+                        lane_sum[v][1] = _mm_add_epi32(lane_sum[v][1], _mm_unpackhi_epi16(lo, zero));
+                        lane_sum[v][2] = _mm_add_epi32(lane_sum[v][2], _mm_unpacklo_epi16(hi, zero));
+                        lane_sum[v][3] = _mm_add_epi32(lane_sum[v][3], _mm_unpackhi_epi16(hi, zero));
+                    }
+
+                    // 65536 squares of at most 255^2 fit 32 bits
+                    if (++iterations == 65536)
+                    {
+                        flush();
+                        iterations = 0;
+                    }
+                }
+
+                flush();
+
+                for (size_t v = 0; v < 3; ++v)
+                {
+                    unsigned char m[16];
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(m), lane_max[v]);
+
+                    for (size_t i = 0; i < 16; ++i)
+                    {
+                        const size_t c = (v*16 + i) % n;
+
+                        sse[c] += static_cast<double>(sums[v*16 + i]);
+                        max_error[c] = std::max(max_error[c], static_cast<int>(m[i]));
+                    }
+                }
+            }
+#endif
+
+            for (; p < end; ++p)
+                for (size_t c = 0; c < n; ++c)
+                {
+                    int d = a[p*n + c] - b[p*n + c];
+                    sse[c] += d * d;
+                    max_error[c] = std::max(max_error[c], d < 0 ? -d : d);
+                }
+        }
+
+        double ssim(const unsigned char* a, const unsigned char* b, size_t width, size_t height)
+        {
+            // 8x8 windows with a stride of 4 pixels on luma
+            const size_t win = 8, stride = 4;
+            const double c1 = (0.01 * 255) * (0.01 * 255);
+            const double c2 = (0.03 * 255) * (0.03 * 255);
+
+            if (width < win || height < win)
+                return 1.0;
+
+            const size_t wx = (width - win) / stride + 1;
+            const size_t wy = (height - win) / stride + 1;
+
+            std::vector<double> rows(wy, 0.0);
+
+            auto luma = [](const unsigned char* px)
+            {
+                return 0.299 * px[0] + 0.587 * px[1] + 0.114 * px[2];
+            };
+
+            detail::parallel_for(0, wy, 4, [&](size_t begin, size_t end)
+            {
+                for (size_t j = begin; j < end; ++j)
+                {
+                    double sum = 0;
+
+                    for (size_t i = 0; i < wx; ++i)
+                    {
+                        double sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+
+                        for (size_t y = j*stride; y < j*stride + win; ++y)
+                            for (size_t x = i*stride; x < i*stride + win; ++x)
+                            {
+                                double va = luma(a + (y*width + x)*3);
+                                double vb = luma(b + (y*width + x)*3);
+
+                                sa += va; sb += vb;
+                                saa += va*va; sbb += vb*vb; sab += va*vb;
+                            }
+
+                        const double n = win * win;
+                        double ma = sa / n, mb = sb / n;
+                        double va = saa / n - ma*ma, vb = sbb / n - mb*mb, cov = sab / n - ma*mb;
+
+                        sum += ((2*ma*mb + c1) * (2*cov + c2)) / ((ma*ma + mb*mb + c1) * (va + vb + c2));
+                    }
+
+                    rows[j] = sum;
+                }
+            });
+
+            double total = 0;
+            for (auto r : rows)
+                total += r;
+
+            return total / (wx * wy);
+        }
+    }
+
+    void ptm_from_rgb(const PTMHeader12* header, const unsigned char* coeff_h, const unsigned char* coeff_l, const unsigned char* rgb, PTM12* ptm)
+    {
+        TAF_ASSERT(header->format == PTM_FORMAT_LRGB || header->format == PTM_FORMAT_JPEG_LRGB, "Can't convert RGB buffers into format");
+
+        ptm->header = *header;
+
+        const size_t w = header->width;
+        const size_t num_pixels = w * header->height;
+
+        detail::StageTimer timer(PTM_STAGE_CONVERT);
+        detail::metrics_resize(&ptm->coefficients, num_pixels * 9);
+
+        unsigned char* coeff = &ptm->coefficients[0];
+        unsigned char* color = &ptm->coefficients[num_pixels*6];
+
+        detail::parallel_for(0, header->height, 16, [&](size_t b, size_t e)
+        {
+            for (size_t y = b; y < e; ++y)
+            {
+                size_t first;
+                bool reversed;
+                detail::ptm_source_row(header, y, &first, &reversed);
+
+                const size_t index = y * w * 3;
+
+                if (reversed)
+                    detail::ptm_interleave_row<true>(coeff_h + index, coeff_l + index, rgb + index, w, coeff + first * 6, color + first * 3);
+                else
+                    detail::ptm_interleave_row<false>(coeff_h + index, coeff_l + index, rgb + index, w, coeff + first * 6, color + first * 3);
+            }
+        });
+    }
+
+    void ptm_from_png(const PTMHeader12* header, const char* coeff_h, const char* coeff_l, const char* rgb, PTM12* ptm)
+    {
+        const char* files[] = { coeff_h, coeff_l, rgb };
+
+        std::unique_ptr<unsigned char, void(*)(void*)> images[3] =
+        {
+            { nullptr, stbi_image_free }, { nullptr, stbi_image_free }, { nullptr, stbi_image_free }
+        };
+
+        uchar_vec strips[3];
+        bool valid[3] = { false, false, false };
+
+        detail::parallel_for(0, 3, 1, [&](size_t b, size_t e)
+        {
+            for (size_t i = b; i < e; ++i)
+            {
+                int w, h, comp;
+                images[i].reset(stbi_load(files[i], &w, &h, &comp, 3));
+
+                if (images[i])
+                {
+                    valid[i] = static_cast<size_t>(w) == header->width && static_cast<size_t>(h) == header->height;
+                    continue;
+                }
+
+                const std::string file = files[i];
+
+                if (file.size() < 4 || file.compare(file.size() - 4, 4, ".png") != 0)
+                    continue;
+
+                // stack the strips name_000.png, name_001.png, ... until the image is complete
+                const size_t row_bytes = header->width * 3;
+                strips[i].resize(row_bytes * header->height);
+
+                size_t y = 0;
+
+                for (unsigned int strip = 0; y < header->height; ++strip)
+                {
+                    char suffix[16];
+                    std::snprintf(suffix, sizeof(suffix), "_%03u.png", strip);
+
+                    std::unique_ptr<unsigned char, void(*)(void*)> rows(stbi_load((file.substr(0, file.size() - 4) + suffix).c_str(), &w, &h, &comp, 3), stbi_image_free);
+
+                    if (!rows || static_cast<size_t>(w) != header->width || static_cast<size_t>(h) > header->height - y)
+                        break;
+
+                    std::copy(rows.get(), rows.get() + h * row_bytes, &strips[i][y * row_bytes]);
+                    y += static_cast<size_t>(h);
+                }
+
+                valid[i] = y == header->height;
+            }
+        });
+
+        for (size_t i = 0; i < 3; ++i)
+            TAF_ASSERT(valid[i], (std::string("Can't read PNG or size mismatch: ") + files[i]).c_str());
+
+        const unsigned char* data[3];
+        for (size_t i = 0; i < 3; ++i)
+            data[i] = images[i] ? images[i].get() : &strips[i][0];
+
+        ptm_from_rgb(header, data[0], data[1], data[2], ptm);
+    }
+
+    namespace detail
+    {
+        void ptm_write_header(std::ostream& stream, const PTMHeader12* ptm)
+        {
+            TAF_ASSERT(ptm->format == PTM_FORMAT_LRGB, "Only LRGB PTMs can be written");
+
+            stream << "PTM_1.2\n" << "PTM_FORMAT_LRGB\n";
+            stream << ptm->width << " " << ptm->height << "\n";
+
+            // scale factors are written short if they survive the round trip, and with all digits otherwise
+            for (size_t i = 0; i < 6; ++i)
+            {
+                std::ostringstream scale;
+                scale << ptm->scale[i];
+
+                if (std::strtof(scale.str().c_str(), nullptr) != ptm->scale[i])
+                {
+                    scale.str("");
+                    scale.precision(std::numeric_limits<float>::max_digits10);
+                    scale << ptm->scale[i];
+                }
+
+                stream << scale.str() << (i < 5 ? " " : "\n");
+            }
+
+            for (size_t i = 0; i < 6; ++i)
+                stream << ptm->bias[i] << (i < 5 ? " " : "\n");
+        }
+    }
+
+    void ptm_save(const char* file, const PTM12* ptm)
+    {
+        std::ofstream stream(file, std::ios::binary);
+
+        TAF_ASSERT(stream.good(), "Can't open file");
+
+        detail::ptm_write_header(stream, &ptm->header);
+
+        TAF_ASSERT(ptm->coefficients.size() == ptm->header.width * ptm->header.height * 9, "Invalid PTM size");
+
+        stream.write(reinterpret_cast<const char*>(&ptm->coefficients[0]), ptm->coefficients.size());
+
+        TAF_ASSERT(stream.good(), "Couldn't write file");
+    }
+
+    void ptm_save_header(const char* file, const PTMHeader12* header)
+    {
+        std::ofstream stream(file, std::ios::binary);
+
+        TAF_ASSERT(stream.good(), "Can't open file");
+
+        detail::ptm_write_header(stream, header);
+
+        TAF_ASSERT(stream.good(), "Couldn't write file");
+    }
+
+    namespace detail
+    {
+        void ptm_box_filter(const unsigned char* const* channels, size_t step, size_t width, size_t height, size_t y_begin, size_t y_end, size_t scale, uint64_t* sums)
+        {
+            const size_t ow = (width + scale - 1) / scale;
+            const size_t oh = (height + scale - 1) / scale;
+
+            // rows are stored bottom up and cells are aligned to the stored rows, so they
+            // coincide with JPEG blocks; channels point at row y_begin, null ones are skipped
+            for (size_t y = y_begin; y < y_end; ++y)
+            {
+                uint64_t* row = sums + (oh - 1 - y / scale) * ow * 3;
+                const size_t offset = (y - y_begin) * width * step;
+
+                for (size_t c = 0; c < 3; ++c)
+                {
+                    if (!channels[c])
+                        continue;
+
+                    for (size_t x = 0; x < width; ++x)
+                        row[(x / scale) * 3 + c] += channels[c][offset + x * step];
+                }
+            }
+        }
+
+        /**
+         * Add channel c from a plane of block averages, as decoded with dc_only, to the cells of
+         * ptm_box_filter. The scale must be a multiple of 8, and every block counts for the pixels
+         * it covers.
+         */
+        void ptm_box_filter_dc(const unsigned char* dc, size_t c, size_t width, size_t height, size_t scale, uint64_t* sums)
+        {
+            const size_t ow = (width + scale - 1) / scale;
+            const size_t oh = (height + scale - 1) / scale;
+            const size_t bw = (width + 7) / 8, bh = (height + 7) / 8;
+            const size_t blocks = scale / 8;
+
+            for (size_t by = 0; by < bh; ++by)
+            {
+                uint64_t* row = sums + (oh - 1 - by / blocks) * ow * 3;
+                const size_t rows = std::min<size_t>(8, height - by * 8);
+
+                for (size_t bx = 0; bx < bw; ++bx)
+                    row[(bx / blocks) * 3 + c] += dc[by * bw + bx] * rows * std::min<size_t>(8, width - bx * 8);
+            }
+        }
+    }
+
+    PTMHeader12 ptm_preview(const char* file, size_t scale, uchar_vec* rgb)
+    {
+        TAF_ASSERT(scale > 0, "Invalid preview scale");
+
+        std::ifstream stream(file, std::ios::binary);
+
+        TAF_ASSERT(stream.good(), "Can't open file");
+
+        PTMHeader12 header;
+        std::vector<uint64_t> sums;
+
+        auto allocate = [&]()
+        {
+            sums.assign(((header.width + scale - 1) / scale) * ((header.height + scale - 1) / scale) * 3, 0);
+        };
+
+        if (detail::ptm_is_lossless(stream))
+        {
+            // lossless tiles interleave all planes, so these are decoded completely
+            stream.close();
+
+            PTM12 ptm;
+            ptm_load(file, &ptm);
+
+            header = std::move(ptm.header);
+            allocate();
+
+            const unsigned char* color = &ptm.coefficients[header.width * header.height * 6];
+            const unsigned char* channels[] = { color, color + 1, color + 2 };
+
+            detail::ptm_box_filter(channels, 3, header.width, header.height, 0, header.height, scale, &sums[0]);
+        }
+        else
+        {
+            detail::ptm_read_header(stream, &header);
+
+            TAF_ASSERT(header.format == PTM_FORMAT_LRGB || header.format == PTM_FORMAT_JPEG_LRGB, "Can't read format into RGB buffer");
+
+            detail::metrics_count(PTM_COUNTER_FILES_LOADED);
+            allocate();
+
+            const size_t w = header.width;
+            const size_t h = header.height;
+
+            if (header.format == PTM_FORMAT_LRGB)
+            {
+                // skip the coefficient block and stream the rgb block in bands of rows
+                stream.seekg(static_cast<std::streamoff>(w * h * 6), std::ios::cur);
+
+                const size_t rows = std::max<size_t>((1 << 22) / (w * 3), 1);
+                std::vector<unsigned char> band(std::min(rows, h) * w * 3);
+
+                detail::StageTimer timer(PTM_STAGE_READ);
+
+                for (size_t y = 0; y < h; y += rows)
+                {
+                    size_t n = std::min(rows, h - y);
+
+                    stream.read(reinterpret_cast<char*>(&band[0]), n * w * 3);
+                    TAF_ASSERT(static_cast<size_t>(stream.gcount()) == n * w * 3, "Unexpected end of file");
+
+                    detail::metrics_count(PTM_COUNTER_BYTES_READ, n * w * 3);
+
+                    const unsigned char* channels[] = { &band[0], &band[1], &band[2] };
+                    detail::ptm_box_filter(channels, 3, w, h, y, y + n, scale, &sums[0]);
+                }
+            }
+            else
+            {
+                const size_t epp = get_epp(&header);
+                const size_t num_pixels = w * h;
+
+                TAF_ASSERT(w <= 65535 && h <= 65535, "JPEG planes can't be larger than 65535x65535");
+
+                // the rgb planes and, transitively, the planes they are predicted from
+                std::vector<bool> needed(epp, false);
+                needed[6] = needed[7] = needed[8] = true;
+
+                for (bool changed = true; changed;)
+                {
+                    changed = false;
+
+                    for (size_t p = 0; p < epp; ++p)
+                    {
+                        int j = header.ci.reference_planes[p];
+
+                        TAF_ASSERT(j < static_cast<int>(epp), "Invalid reference plane");
+
+                        if (needed[p] && j >= 0 && !needed[j])
+                            needed[j] = changed = true;
+                    }
+                }
+
+                // prediction and side information work on full pixels, so only planes without
+                // either that no other needed plane is predicted from can be decoded as DC only
+                std::vector<bool> dc_only(epp, scale % 8 == 0);
+
+                for (size_t p = 0; p < epp; ++p)
+                {
+                    int j = header.ci.reference_planes[p];
+
+                    if (j >= 0 || header.ci.side_information[p] > 0)
+                        dc_only[p] = false;
+
+                    if (needed[p] && j >= 0)
+                        dc_only[j] = false;
+                }
+
+                std::vector<size_t> offsets(epp + 1, 0);
+                std::map<size_t, size_t> order;
+
+                for (size_t p = 0; p < epp; ++p)
+                {
+                    offsets[p + 1] = offsets[p] + header.ci.compressed_size[p] + header.ci.side_information[p];
+                    order[header.ci.order[p]] = p;
+                }
+
+                const std::streamoff payload = stream.tellg();
+
+                std::vector<std::unique_ptr<unsigned char, void(*)(void*)>> planes;
+                std::vector<detail::SideInformation> side_info(epp);
+                std::vector<unsigned char> buffer;
+
+                for (size_t p = 0; p < epp; ++p)
+                    planes.emplace_back(nullptr, stbi_image_free);
+
+                detail::StageTimer timer(PTM_STAGE_DECODE);
+
+                for (size_t p = 0; p < epp; ++p)
+                {
+                    if (!needed[p])
+                        continue;
+
+                    const size_t bufs = header.ci.compressed_size[p];
+                    const size_t sides = header.ci.side_information[p];
+
+                    buffer.resize(bufs + sides);
+                    stream.seekg(payload + static_cast<std::streamoff>(offsets[p]));
+                    stream.read(reinterpret_cast<char*>(&buffer[0]), buffer.size());
+
+                    TAF_ASSERT(static_cast<size_t>(stream.gcount()) == buffer.size(), "Unexpected end of file");
+
+                    detail::metrics_count(PTM_COUNTER_BYTES_READ, buffer.size());
+
+                    planes[p].reset(detail::ptm_decode_jpeg_plane(&header, &buffer[0], bufs, dc_only[p]));
+
+                    if (sides > 0)
+                        detail::ptm_decode_side_information(&buffer[bufs], sides, w, h, &side_info[p]);
+                }
+
+                for (size_t n = 0; n < epp; ++n)
+                {
+                    size_t i = order[n];
+                    int j = header.ci.reference_planes[i];
+
+                    if (!needed[i])
+                        continue;
+
+                    if (j >= 0)
+                        detail::ptm_predict_plane(planes[i].get(), planes[j].get(), header.ci.transforms[i], 0, num_pixels);
+
+                    detail::ptm_apply_side_information(side_info[i], planes[i].get(), 0, num_pixels);
+                }
+
+                const unsigned char* channels[3];
+
+                for (size_t c = 0; c < 3; ++c)
+                {
+                    channels[c] = dc_only[6 + c] ? nullptr : planes[6 + c].get();
+
+                    if (dc_only[6 + c])
+                        detail::ptm_box_filter_dc(planes[6 + c].get(), c, w, h, scale, &sums[0]);
+                }
+
+                detail::ptm_box_filter(channels, 1, w, h, 0, h, scale, &sums[0]);
+            }
+        }
+
+        const size_t ow = (header.width + scale - 1) / scale;
+        const size_t oh = (header.height + scale - 1) / scale;
+
+        rgb->resize(ow * oh * 3);
+
+        // cells at the right and top border may cover fewer pixels
+        for (size_t y = 0; y < oh; ++y)
+            for (size_t x = 0; x < ow; ++x)
+            {
+                uint64_t n = std::min(scale, header.width - x * scale) * std::min(scale, header.height - (oh - 1 - y) * scale);
+
+                for (size_t c = 0; c < 3; ++c)
+                {
+                    size_t i = (y * ow + x) * 3 + c;
+                    (*rgb)[i] = static_cast<unsigned char>((sums[i] + n / 2) / n);
+                }
+            }
+
+        return header;
+    }
+
+    void ptm_relight(const PTM12* ptm, float lu, float lv, unsigned char* out)
+    {
+        const float terms[6] = { lu*lu, lv*lv, lu*lv, lu, lv, 1.f };
+
+        // fold scale and bias into the weights: L = sum((c - bias) * scale * term)
+        float weights[3][7];
+
+        for (size_t k = 0; k < 3; ++k)
+        {
+            weights[k][6] = 0.f;
+
+            for (size_t i = 0; i < 6; ++i)
+            {
+                weights[k][i] = ptm->header.scale[i] * terms[i] / 255.f;
+                weights[k][6] -= weights[k][i] * ptm->header.bias[i];
+            }
+        }
+
+        detail::ptm_relight_uniform(ptm, weights, out);
+    }
+
+    void ptm_relight(const PTM12* ptm, const PTMPointLight* light, unsigned char* out)
+    {
+        const size_t w = ptm->header.width;
+        const size_t h = ptm->header.height;
+
+        const float aspect = static_cast<float>(h) / w;
+        const float* lp = light->position;
+        const float* sd = light->spot_direction;
+
+        float sd_len = std::sqrt(sd[0]*sd[0] + sd[1]*sd[1] + sd[2]*sd[2]);
+        float axis[3] = { 0.f, 0.f, 0.f };
+
+        if (sd_len > 0.f)
+            for (size_t i = 0; i < 3; ++i)
+                axis[i] = sd[i] / sd_len;
+
+        const float cone = std::max(light->cos_inner - light->cos_outer, 1e-6f);
+
+        auto row_terms = [&](size_t y, float* terms)
+        {
+            const float py = aspect * (1.f - 2.f * (y + 0.5f) / h);
+
+            for (size_t x = 0; x < w; ++x)
+            {
+                const float px = 2.f * (x + 0.5f) / w - 1.f;
+
+                float lx = lp[0] - px, ly = lp[1] - py, lz = lp[2];
+                float d2 = lx*lx + ly*ly + lz*lz;
+                float inv_d = 1.f / std::sqrt(std::max(d2, 1e-12f));
+
+                float lu = lx * inv_d, lv = ly * inv_d;
+                float gain = light->intensity / (1.f + light->falloff * d2);
+
+                // smooth fade between the inner and outer cone of a spotlight
+                if (sd_len > 0.f)
+                {
+                    float c = -(lx*axis[0] + ly*axis[1] + lz*axis[2]) * inv_d;
+                    float t = std::min(std::max((c - light->cos_outer) / cone, 0.f), 1.f);
+                    gain *= t * t * (3.f - 2.f * t);
+                }
+
+                terms[0*w + x] = gain * lu * lu;
+                terms[1*w + x] = gain * lv * lv;
+                terms[2*w + x] = gain * lu * lv;
+                terms[3*w + x] = gain * lu;
+                terms[4*w + x] = gain * lv;
+                terms[5*w + x] = gain;
+            }
+        };
+
+        detail::ptm_relight_varying(ptm, row_terms, out);
+    }
+
+    void ptm_environment(const float* latlong, size_t width, size_t height, PTMEnvironment* env)
+    {
+        const double pi = 3.14159265358979323846;
+
+        double moments[3][6] = { { 0 } };
+        std::mutex merge;
+
+        // only rows above the horizon contribute
+        detail::parallel_for(0, (height + 1) / 2, 8, [&](size_t b, size_t e)
+        {
+            double local[3][6] = { { 0 } };
+            std::vector<double> cos_phi(width), sin_phi(width);
+
+            for (size_t x = 0; x < width; ++x)
+            {
+                double phi = 2.0 * pi * (x + 0.5) / width;
+                cos_phi[x] = std::cos(phi);
+                sin_phi[x] = std::sin(phi);
+            }
+
+            for (size_t y = b; y < e; ++y)
+            {
+                double theta = pi * (y + 0.5) / height;
+                double z = std::cos(theta);
+
+                if (z <= 0.0)
+                    continue;
+
+                // solid angle of one pixel in this row
+                double sin_theta = std::sin(theta);
+                double d_omega = sin_theta * (2.0 * pi / width) * (pi / height);
+
+                for (size_t x = 0; x < width; ++x)
+                {
+                    double lu = sin_theta * cos_phi[x];
+                    double lv = sin_theta * sin_phi[x];
+                    double terms[6] = { lu*lu, lv*lv, lu*lv, lu, lv, 1.0 };
+
+                    const float* px = latlong + (y*width + x)*3;
+
+                    for (size_t k = 0; k < 3; ++k)
+                        for (size_t i = 0; i < 6; ++i)
+                            local[k][i] += px[k] * terms[i] * d_omega;
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(merge);
+
+            for (size_t k = 0; k < 3; ++k)
+                for (size_t i = 0; i < 6; ++i)
+                    moments[k][i] += local[k][i];
+        });
+
+        for (size_t k = 0; k < 3; ++k)
+            for (size_t i = 0; i < 6; ++i)
+                env->moments[k][i] = static_cast<float>(moments[k][i] / pi);
+    }
+
+    void ptm_relight(const PTM12* ptm, const PTMEnvironment* env, float exposure, unsigned char* out)
+    {
+        float weights[3][7];
+
+        for (size_t k = 0; k < 3; ++k)
+        {
+            weights[k][6] = 0.f;
+
+            for (size_t i = 0; i < 6; ++i)
+            {
+                weights[k][i] = ptm->header.scale[i] * exposure * env->moments[k][i] / 255.f;
+                weights[k][6] -= weights[k][i] * ptm->header.bias[i];
+            }
+        }
+
+        detail::ptm_relight_uniform(ptm, weights, out);
+    }
+
+    namespace detail
+    {
+        /**
+         * Light directions for material fitting: rings of constant elevation up to 72 degrees,
+         * beyond which PTMs are rarely constrained by their captures. Stored as x, y, z triples.
+         */
+        std::vector<float> material_directions()
+        {
+            static const size_t rings[] = { 1, 6, 10, 12, 14 };
+
+            std::vector<float> dirs;
+
+            for (size_t r = 0; r < 5; ++r)
+            {
+                const float theta = r * 18.f * 3.14159265f / 180.f;
+
+                for (size_t i = 0; i < rings[r]; ++i)
+                {
+                    // stagger the rings against each other
+                    const float phi = (i + 0.5f * (r & 1)) * 2.f * 3.14159265f / rings[r];
+
+                    dirs.push_back(std::sin(theta) * std::cos(phi));
+                    dirs.push_back(std::sin(theta) * std::sin(phi));
+                    dirs.push_back(std::cos(theta));
+                }
+            }
+
+            return dirs;
+        }
+
+        static const size_t material_lanes = 16;
+
+        /**
+         * Fit materials to a batch of material_lanes pixels
+         *
+         * a holds the 6 polynomial coefficients per pixel with scale and bias applied, p receives
+         * the parameters kd, ks, log(m), and the normal as gradients nx/nz and ny/nz. All arrays
+         * are indexed [parameter][lane] so that every loop runs across pixels.
+         */
+        void ptm_fit_material_lanes(const float a[6][material_lanes], const std::vector<float>& dirs, size_t iterations, float p[5][material_lanes])
+        {
+            const size_t L = material_lanes;
+            const size_t K = dirs.size() / 3;
+            // a lobe broader than m = 4 can't be told apart from the diffuse term
+            const float min_log_m = std::log(4.f), max_log_m = std::log(512.f);
+
+            std::vector<float> target(K * L);
+
+            for (size_t k = 0; k < K; ++k)
+            {
+                const float lu = dirs[k*3], lv = dirs[k*3 + 1];
+                const float terms[6] = { lu*lu, lv*lv, lu*lv, lu, lv, 1.f };
+
+                for (size_t i = 0; i < L; ++i)
+                {
+                    float t = 0.f;
+
+                    for (size_t j = 0; j < 6; ++j)
+                        t += a[j][i] * terms[j];
+
+                    target[k*L + i] = t;
+                }
+            }
+
+            // start at the maximum of the polynomial, which is where the normal points for a
+            // diffuse surface
+            for (size_t i = 0; i < L; ++i)
+            {
+                float det = 4.f * a[0][i] * a[1][i] - a[2][i] * a[2][i];
+                float lu = 0.f, lv = 0.f;
+
+                if (det > 1e-6f && a[0][i] < 0.f)
+                {
+                    lu = (a[2][i] * a[4][i] - 2.f * a[1][i] * a[3][i]) / det;
+                    lv = (a[2][i] * a[3][i] - 2.f * a[0][i] * a[4][i]) / det;
+
+                    float r = std::sqrt(lu*lu + lv*lv);
+
+                    if (r > 0.9f)
+                    {
+                        lu *= 0.9f / r;
+                        lv *= 0.9f / r;
+                    }
+                }
+
+                float nz = std::sqrt(1.f - lu*lu - lv*lv);
+                float peak = a[0][i]*lu*lu + a[1][i]*lv*lv + a[2][i]*lu*lv + a[3][i]*lu + a[4][i]*lv + a[5][i];
+
+                p[0][i] = std::max(peak, 1e-3f);
+                p[1][i] = 0.f;
+                p[2][i] = std::log(16.f);
+                p[3][i] = lu / nz;
+                p[4][i] = lv / nz;
+            }
+
+            // the first half of the steps fits the diffuse term only, so that the lobe can't
+            // take over what the normal and albedo explain
+            bool lobe = iterations < 2;
+
+            float cost[L], trial_cost[L], lambda[L];
+            float trial[5][L], jtj[15][L], jtr[5][L];
+
+            // residuals, and the normal equations if jtj is set
+            auto evaluate = [&](const float (*q)[L], float* c, float (*jtj)[L], float (*jtr)[L])
+            {
+                std::fill(c, c + L, 0.f);
+
+                if (jtj)
+                {
+                    std::fill(&jtj[0][0], &jtj[0][0] + 15 * L, 0.f);
+                    std::fill(&jtr[0][0], &jtr[0][0] + 5 * L, 0.f);
+                }
+
+                for (size_t k = 0; k < K; ++k)
+                {
+                    const float lx = dirs[k*3], ly = dirs[k*3 + 1], lz = dirs[k*3 + 2];
+
+                    // half vector with the viewer straight above
+                    const float hl = 1.f / std::sqrt(lx*lx + ly*ly + (lz + 1.f)*(lz + 1.f));
+                    const float hx = lx * hl, hy = ly * hl, hz = (lz + 1.f) * hl;
+
+                    for (size_t i = 0; i < L; ++i)
+                    {
+                        const float kd = q[0][i], ks = q[1][i], m = std::exp(q[2][i]);
+                        const float nx = q[3][i], ny = q[4][i];
+
+                        const float inv = 1.f / std::sqrt(1.f + nx*nx + ny*ny);
+                        const float d = (nx*lx + ny*ly + lz) * inv;
+                        const float e = (nx*hx + ny*hy + hz) * inv;
+
+                        const float D = d > 0.f ? d : 0.f;
+                        const float ee = e > 1e-4f ? e : 1e-4f;
+                        const float le = std::log(ee);
+                        const float S = e > 0.f ? std::exp(m * le) : 0.f;
+
+                        const float r = kd * D + ks * S - target[k*L + i];
+                        c[i] += r * r;
+
+                        if (!jtj)
+                            continue;
+
+                        const float dS = ks * m * S / ee;
+                        const float J[5] =
+                        {
+                            D,
+                            lobe ? S : 0.f,
+                            lobe ? ks * S * le * m : 0.f,
+                            (d > 0.f ? kd * (lx - d * nx * inv) * inv : 0.f) + dS * (hx - e * nx * inv) * inv,
+                            (d > 0.f ? kd * (ly - d * ny * inv) * inv : 0.f) + dS * (hy - e * ny * inv) * inv
+                        };
+
+                        for (size_t u = 0, t = 0; u < 5; ++u)
+                        {
+                            jtr[u][i] += J[u] * r;
+
+                            for (size_t v = u; v < 5; ++v, ++t)
+                                jtj[t][i] += J[u] * J[v];
+                        }
+                    }
+                }
+            };
+
+            std::fill(lambda, lambda + L, 1e-2f);
+            evaluate(p, cost, jtj, jtr);
+
+            for (size_t it = 0; it < iterations; ++it)
+            {
+                if (!lobe && it == iterations / 2)
+                {
+                    lobe = true;
+                    std::fill(lambda, lambda + L, 1e-2f);
+                    evaluate(p, cost, jtj, jtr);
+                }
+
+                // solve (JtJ + lambda diag(JtJ)) delta = -Jtr with a Cholesky decomposition
+                float m[5][5][L], delta[5][L];
+
+                for (size_t u = 0, t = 0; u < 5; ++u)
+                    for (size_t v = u; v < 5; ++v, ++t)
+                        for (size_t i = 0; i < L; ++i)
+                        {
+                            float x = jtj[t][i];
+
+                            if (u == v)
+                                x += lambda[i] * x + 1e-6f;
+
+                            m[u][v][i] = m[v][u][i] = x;
+                        }
+
+                for (size_t u = 0; u < 5; ++u)
+                {
+                    for (size_t v = 0; v < u; ++v)
+                        for (size_t w = u; w < 5; ++w)
+                            for (size_t i = 0; i < L; ++i)
+                                m[w][u][i] -= m[w][v][i] * m[u][v][i];
+
+                    for (size_t i = 0; i < L; ++i)
+                        m[u][u][i] = std::sqrt(std::max(m[u][u][i], 1e-12f));
+
+                    for (size_t w = u + 1; w < 5; ++w)
+                        for (size_t i = 0; i < L; ++i)
+                            m[w][u][i] /= m[u][u][i];
+                }
+
+                for (size_t u = 0; u < 5; ++u)
+                    for (size_t i = 0; i < L; ++i)
+                    {
+                        float x = -jtr[u][i];
+
+                        for (size_t v = 0; v < u; ++v)
+                            x -= m[u][v][i] * delta[v][i];
+
+                        delta[u][i] = x / m[u][u][i];
+                    }
+
+                for (size_t u = 5; u-- > 0;)
+                    for (size_t i = 0; i < L; ++i)
+                    {
+                        float x = delta[u][i];
+
+                        for (size_t v = u + 1; v < 5; ++v)
+                            x -= m[v][u][i] * delta[v][i];
+
+                        delta[u][i] = x / m[u][u][i];
+                    }
+
+                for (size_t i = 0; i < L; ++i)
+                {
+                    trial[0][i] = std::max(p[0][i] + delta[0][i], 0.f);
+                    trial[1][i] = std::max(p[1][i] + delta[1][i], 0.f);
+                    trial[2][i] = std::min(std::max(p[2][i] + delta[2][i], min_log_m), max_log_m);
+                    trial[3][i] = std::min(std::max(p[3][i] + delta[3][i], -10.f), 10.f);
+                    trial[4][i] = std::min(std::max(p[4][i] + delta[4][i], -10.f), 10.f);
+                }
+
+                evaluate(trial, trial_cost, nullptr, nullptr);
+
+                bool improved = false;
+
+                for (size_t i = 0; i < L; ++i)
+                {
+                    if (trial_cost[i] < cost[i])
+                    {
+                        for (size_t u = 0; u < 5; ++u)
+                            p[u][i] = trial[u][i];
+
+                        lambda[i] *= 0.3f;
+                        improved = true;
+                    }
+                    else
+                        lambda[i] *= 5.f;
+                }
+
+                if (improved && it + 1 < iterations)
+                    evaluate(p, cost, jtj, jtr);
+            }
+        }
+    }
+
+    void ptm_fit_material(const PTM12* ptm, PTMMaterial* material, size_t iterations)
+    {
+        TAF_ASSERT(is_lrgb(&ptm->header), "Material fitting is only supported for LRGB PTMs");
+
+        const size_t w = ptm->header.width;
+        const size_t h = ptm->header.height;
+        const size_t num_pixels = w * h;
+        const size_t tile = 64;
+        const size_t tiles_x = (w + tile - 1) / tile;
+        const size_t L = detail::material_lanes;
+
+        material->width = w;
+        material->height = h;
+
+        detail::metrics_resize(&material->albedo, num_pixels * 3);
+        detail::metrics_resize(&material->normal, num_pixels * 3);
+        detail::metrics_resize(&material->specular, num_pixels);
+        detail::metrics_resize(&material->shininess, num_pixels);
+
+        const std::vector<float> dirs = detail::material_directions();
+
+        const unsigned char* coeff = &ptm->coefficients[0];
+        const unsigned char* color = &ptm->coefficients[num_pixels*6];
+
+        detail::StageTimer timer(PTM_STAGE_MATERIAL);
+
+        detail::parallel_for(0, tiles_x * ((h + tile - 1) / tile), 1, [&](size_t b, size_t e)
+        {
+            float a[6][L], p[5][L];
+            size_t src[L], dst[L];
+
+            for (size_t t = b; t < e; ++t)
+            {
+                const size_t x0 = (t % tiles_x) * tile, x1 = std::min(x0 + tile, w);
+                const size_t y0 = (t / tiles_x) * tile, y1 = std::min(y0 + tile, h);
+
+                size_t n = 0;
+
+                auto flush = [&]()
+                {
+                    // pad the batch with copies of its first pixel
+                    for (size_t i = n; i < L; ++i)
+                        for (size_t j = 0; j < 6; ++j)
+                            a[j][i] = a[j][0];
+
+                    detail::ptm_fit_material_lanes(a, dirs, iterations, p);
+
+                    for (size_t i = 0; i < n; ++i)
+                    {
+                        const unsigned char* rgb = color + src[i]*3;
+                        const float inv = 1.f / std::sqrt(1.f + p[3][i]*p[3][i] + p[4][i]*p[4][i]);
+                        const float normal[3] = { p[3][i] * inv, p[4][i] * inv, inv };
+
+                        for (size_t k = 0; k < 3; ++k)
+                        {
+                            material->albedo[dst[i]*3 + k] = static_cast<unsigned char>(std::min(rgb[k] * p[0][i], 255.f) + 0.5f);
+                            material->normal[dst[i]*3 + k] = static_cast<unsigned char>((normal[k] * 0.5f + 0.5f) * 255.f + 0.5f);
+                        }
+
+                        const float mean = (rgb[0] + rgb[1] + rgb[2]) / 3.f;
+
+                        material->specular[dst[i]] = static_cast<unsigned char>(std::min(mean * p[1][i], 255.f) + 0.5f);
+                        material->shininess[dst[i]] = static_cast<unsigned char>(p[2][i] / std::log(2.f) / 9.f * 255.f + 0.5f);
+                    }
+
+                    n = 0;
+                };
+
+                for (size_t y = y0; y < y1; ++y)
+                {
+                    size_t first;
+                    bool reversed;
+                    detail::ptm_source_row(&ptm->header, y, &first, &reversed);
+
+                    for (size_t x = x0; x < x1; ++x)
+                    {
+                        src[n] = first + (reversed ? w - 1 - x : x);
+                        dst[n] = y * w + x;
+
+                        const unsigned char* c = coeff + src[n]*6;
+
+                        for (size_t j = 0; j < 6; ++j)
+                            a[j][n] = ptm->header.scale[j] * (c[j] - ptm->header.bias[j]) / 255.f;
+
+                        if (++n == L)
+                            flush();
+                    }
+                }
+
+                if (n > 0)
+                    flush();
+            }
+        });
+    }
+
+    namespace detail
+    {
+        /**
+         * Separable Gaussian blur over a sliding window of rows
+         *
+         * Blurs rows y_begin to y_end of a width x height image with channels interleaved float
+         * channels. source(y, row) fills row y with width * channels floats and is called for
+         * every row of the window, including up to 3 * sigma rows outside of the range.
+         * sink(y, blurred) receives the blurred rows in order. Only the 2 * radius + 1 horizontally
+         * blurred rows of the window are kept, and the image is clamped at its borders.
+         */
+        template<typename Source, typename Sink>
+        void ptm_gaussian_rows(size_t width, size_t height, size_t channels, float sigma, size_t y_begin, size_t y_end, Source source, Sink sink)
+        {
+            const ptrdiff_t r = static_cast<ptrdiff_t>(std::ceil(3.f * sigma));
+            const size_t taps = 2 * r + 1;
+            const size_t n = width * channels;
+
+            std::vector<float> weights(taps);
+            float sum = 0.f;
+
+            for (size_t k = 0; k < taps; ++k)
+            {
+                const float d = static_cast<float>(static_cast<ptrdiff_t>(k) - r);
+                sum += weights[k] = std::exp(-d * d / (2.f * sigma * sigma));
+            }
+
+            for (auto& w : weights)
+                w /= sum;
+
+            std::vector<float> padded((width + 2 * r) * channels);
+            std::vector<float> window(taps * n);
+            std::vector<float> blurred(n);
+
+            // window slot of row p, which may lie outside of the image
+            auto slot = [&](ptrdiff_t p) { return &window[((p + r) % taps) * n]; };
+
+            auto load = [&](ptrdiff_t p)
+            {
+                const ptrdiff_t y = std::min(std::max(p, ptrdiff_t(0)), static_cast<ptrdiff_t>(height) - 1);
+
+                source(static_cast<size_t>(y), &padded[r * channels]);
+
+                for (ptrdiff_t i = 0; i < r; ++i)
+                    for (size_t c = 0; c < channels; ++c)
+                    {
+                        padded[i * channels + c] = padded[r * channels + c];
+                        padded[(r + width + i) * channels + c] = padded[(r + width - 1) * channels + c];
+                    }
+
+                float* dst = slot(p);
+                std::fill(dst, dst + n, 0.f);
+
+                for (size_t k = 0; k < taps; ++k)
+                {
+                    const float wk = weights[k];
+                    const float* src = &padded[k * channels];
+
+                    for (size_t i = 0; i < n; ++i)
+                        dst[i] += wk * src[i];
+                }
+            };
+
+            const ptrdiff_t begin = static_cast<ptrdiff_t>(y_begin);
+
+            for (ptrdiff_t p = begin - r; p < begin + r; ++p)
+                load(p);
+
+            for (ptrdiff_t y = begin; y < static_cast<ptrdiff_t>(y_end); ++y)
+            {
+                load(y + r);
+
+                std::fill(blurred.begin(), blurred.end(), 0.f);
+
+                for (size_t k = 0; k < taps; ++k)
+                {
+                    const float wk = weights[k];
+                    const float* src = slot(y - r + static_cast<ptrdiff_t>(k));
+
+                    for (size_t i = 0; i < n; ++i)
+                        blurred[i] += wk * src[i];
+                }
+
+                sink(static_cast<size_t>(y), &blurred[0]);
+            }
+        }
+
+        /**
+         * Normal at the maximum of a luminance polynomial with coefficients a, which have scale and
+         * bias applied. Returns the luminance at the maximum.
+         */
+        float ptm_normal(const float* a, float* n)
+        {
+            const float det = 4.f * a[0] * a[1] - a[2] * a[2];
+            float lu = 0.f, lv = 0.f;
+
+            // polynomials without a maximum face the viewer
+            if (det > 1e-6f && a[0] < 0.f)
+            {
+                lu = (a[2] * a[4] - 2.f * a[1] * a[3]) / det;
+                lv = (a[2] * a[3] - 2.f * a[0] * a[4]) / det;
+
+                const float r2 = lu*lu + lv*lv;
+
+                if (r2 > 1.f)
+                {
+                    lu /= std::sqrt(r2);
+                    lv /= std::sqrt(r2);
+                }
+            }
+
+            n[0] = lu;
+            n[1] = lv;
+            n[2] = std::sqrt(std::max(1.f - lu*lu - lv*lv, 0.f));
+
+            return a[0]*lu*lu + a[1]*lv*lv + a[2]*lu*lv + a[3]*lu + a[4]*lv + a[5];
+        }
+
+        /**
+         * Normals of output row y of a PTM, or the luminance at their maxima if peaks is set
+         */
+        void ptm_normal_row(const PTM12* ptm, size_t y, float* normals, float* peaks = nullptr)
+        {
+            const size_t w = ptm->header.width;
+
+            size_t first;
+            bool reversed;
+            ptm_source_row(&ptm->header, y, &first, &reversed);
+
+            for (size_t x = 0; x < w; ++x)
+            {
+                const unsigned char* c = &ptm->coefficients[(first + (reversed ? w - 1 - x : x)) * 6];
+
+                float a[6], n[3];
+
+                for (size_t i = 0; i < 6; ++i)
+                    a[i] = ptm->header.scale[i] * (c[i] - ptm->header.bias[i]) / 255.f;
+
+                const float peak = ptm_normal(a, n);
+
+                if (normals)
+                    std::copy(n, n + 3, normals + x * 3);
+
+                if (peaks)
+                    peaks[x] = peak;
+            }
+        }
+    }
+
+    void ptm_unsharp_coefficients(const PTM12* ptm, float sigma, float amount, PTM12* out)
+    {
+        TAF_ASSERT(is_lrgb(&ptm->header), "Filtering is only supported for LRGB PTMs");
+        TAF_ASSERT(sigma > 0.f, "Invalid blur radius");
+
+        const size_t w = ptm->header.width;
+        const size_t h = ptm->header.height;
+        const size_t num_pixels = w * h;
+
+        out->header = ptm->header;
+        detail::metrics_resize(&out->coefficients, num_pixels * 9);
+
+        const unsigned char* coeff = &ptm->coefficients[0];
+        unsigned char* dst = &out->coefficients[0];
+
+        std::copy(coeff + num_pixels * 6, coeff + num_pixels * 9, dst + num_pixels * 6);
+
+        detail::StageTimer timer(PTM_STAGE_FILTER);
+
+        // rows are filtered in storage order, the blur doesn't depend on orientation
+        detail::parallel_for(0, h, 64, [&](size_t b, size_t e)
+        {
+            detail::ptm_gaussian_rows(w, h, 6, sigma, b, e,
+                [&](size_t y, float* row)
+                {
+                    const unsigned char* c = coeff + y * w * 6;
+
+                    for (size_t i = 0; i < w * 6; ++i)
+                        row[i] = c[i];
+                },
+                [&](size_t y, const float* blurred)
+                {
+                    const unsigned char* c = coeff + y * w * 6;
+                    unsigned char* d = dst + y * w * 6;
+
+                    for (size_t i = 0; i < w * 6; ++i)
+                    {
+                        float v = c[i] + amount * (c[i] - blurred[i]);
+                        v = v < 0.f ? 0.f : (v > 255.f ? 255.f : v);
+
+                        d[i] = static_cast<unsigned char>(v + 0.5f);
+                    }
+                });
+        });
+    }
+
+    void ptm_unsharp_coefficients(size_t width, size_t height, float sigma, float amount, unsigned char* coeff_h, unsigned char* coeff_l)
+    {
+        TAF_ASSERT(sigma > 0.f, "Invalid blur radius");
+
+        const size_t w = width;
+        const size_t h = height;
+        const size_t r = static_cast<size_t>(std::ceil(3.f * sigma));
+
+        // the copied rows stay below 1/8 of the images
+        const size_t stripe = std::max<size_t>(64, 16 * r);
+        const size_t num_stripes = (h + stripe - 1) / stripe;
+
+        // rows [b - r, b) and [e, e + r) around each stripe, clamped, with the coeff_h row
+        // followed by the coeff_l row
+        std::vector<uchar_vec> above(num_stripes), below(num_stripes);
+
+        auto save = [&](size_t y0, size_t y1, uchar_vec* rows)
+        {
+            rows->resize((y1 - y0) * w * 6);
+
+            for (size_t y = y0; y < y1; ++y)
+            {
+                unsigned char* dst = &(*rows)[(y - y0) * w * 6];
+
+                std::copy(coeff_h + y * w * 3, coeff_h + (y + 1) * w * 3, dst);
+                std::copy(coeff_l + y * w * 3, coeff_l + (y + 1) * w * 3, dst + w * 3);
+            }
+        };
+
+        for (size_t s = 0; s < num_stripes; ++s)
+        {
+            const size_t b = s * stripe, e = std::min(b + stripe, h);
+
+            save(b - std::min(b, r), b, &above[s]);
+            save(e, std::min(e + r, h), &below[s]);
+        }
+
+        detail::StageTimer timer(PTM_STAGE_FILTER);
+
+        detail::parallel_for(0, num_stripes, 1, [&](size_t sb, size_t se)
+        {
+            for (size_t s = sb; s < se; ++s)
+            {
+                const size_t b = s * stripe, e = std::min(b + stripe, h);
+
+                detail::ptm_gaussian_rows(w, h, 6, sigma, b, e,
+                    [&](size_t y, float* row)
+                    {
+                        const unsigned char *hr, *lr;
+
+                        if (y < b)
+                            hr = &above[s][(y - (b - std::min(b, r))) * w * 6];
+                        else if (y >= e)
+                            hr = &below[s][(y - e) * w * 6];
+                        else
+                            hr = nullptr;
+
+                        lr = hr ? hr + w * 3 : coeff_l + y * w * 3;
+                        hr = hr ? hr : coeff_h + y * w * 3;
+
+                        for (size_t x = 0; x < w; ++x)
+                            for (size_t k = 0; k < 3; ++k)
+                            {
+                                row[x * 6 + k] = hr[x * 3 + k];
+                                row[x * 6 + 3 + k] = lr[x * 3 + k];
+                            }
+                    },
+                    [&](size_t y, const float* blurred)
+                    {
+                        unsigned char* rows[] = { coeff_h + y * w * 3, coeff_l + y * w * 3 };
+
+                        for (size_t x = 0; x < w; ++x)
+                            for (size_t k = 0; k < 6; ++k)
+                            {
+                                unsigned char& c = rows[k / 3][x * 3 + k % 3];
+
+                                float v = c + amount * (c - blurred[x * 6 + k]);
+                                v = v < 0.f ? 0.f : (v > 255.f ? 255.f : v);
+
+                                c = static_cast<unsigned char>(v + 0.5f);
+                            }
+                    });
+            }
+        });
+    }
+
+    void ptm_normals(const PTM12* ptm, float* normals)
+    {
+        TAF_ASSERT(is_lrgb(&ptm->header), "Normals are only supported for LRGB PTMs");
+
+        const size_t w = ptm->header.width;
+
+        detail::parallel_for(0, ptm->header.height, 16, [&](size_t b, size_t e)
+        {
+            for (size_t y = b; y < e; ++y)
+                detail::ptm_normal_row(ptm, y, normals + y * w * 3);
+        });
+    }
+
+    void ptm_unsharp_normals(const PTM12* ptm, float sigma, float amount, float* normals)
+    {
+        TAF_ASSERT(is_lrgb(&ptm->header), "Normals are only supported for LRGB PTMs");
+        TAF_ASSERT(sigma > 0.f, "Invalid blur radius");
+
+        const size_t w = ptm->header.width;
+        const size_t h = ptm->header.height;
+
+        detail::StageTimer timer(PTM_STAGE_FILTER);
+
+        detail::parallel_for(0, h, 64, [&](size_t b, size_t e)
+        {
+            detail::ptm_gaussian_rows(w, h, 3, sigma, b, e,
+                [&](size_t y, float* row)
+                {
+                    detail::ptm_normal_row(ptm, y, row);
+                },
+                [&](size_t y, const float* blurred)
+                {
+                    float* n = normals + y * w * 3;
+
+                    detail::ptm_normal_row(ptm, y, n);
+
+                    for (size_t x = 0; x < w; ++x)
+                    {
+                        float* v = n + x * 3;
+
+                        for (size_t k = 0; k < 3; ++k)
+                            v[k] += amount * (v[k] - blurred[x * 3 + k]);
+
+                        const float len = std::sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+
+                        for (size_t k = 0; k < 3; ++k)
+                            v[k] = len > 0.f ? v[k] / len : (k == 2 ? 1.f : 0.f);
+                    }
+                });
+        });
+    }
+
+    void ptm_shade_normals(const PTM12* ptm, const float* normals, float lu, float lv, unsigned char* out)
+    {
+        TAF_ASSERT(is_lrgb(&ptm->header), "Relighting is only supported for LRGB PTMs");
+
+        detail::StageTimer timer(PTM_STAGE_RELIGHT);
+
+        const size_t w = ptm->header.width;
+        const float l[3] = { lu, lv, std::sqrt(std::max(1.f - lu*lu - lv*lv, 0.f)) };
+
+        const unsigned char* color = &ptm->coefficients[w * ptm->header.height * 6];
+
+        detail::parallel_for(0, ptm->header.height, 16, [&](size_t b, size_t e)
+        {
+            std::vector<float> peaks(w);
+
+            for (size_t y = b; y < e; ++y)
+            {
+                detail::ptm_normal_row(ptm, y, nullptr, &peaks[0]);
+
+                size_t first;
+                bool reversed;
+                detail::ptm_source_row(&ptm->header, y, &first, &reversed);
+
+                const float* n = normals + y * w * 3;
+                unsigned char* dst = out + y * w * 3;
+
+                for (size_t x = 0; x < w; ++x)
+                {
+                    const unsigned char* rgb = color + (first + (reversed ? w - 1 - x : x)) * 3;
+                    const float d = n[x*3]*l[0] + n[x*3 + 1]*l[1] + n[x*3 + 2]*l[2];
+                    const float lum = peaks[x] * (d > 0.f ? d : 0.f);
+
+                    for (size_t k = 0; k < 3; ++k)
+                    {
+                        float v = rgb[k] * lum;
+                        v = v < 0.f ? 0.f : (v > 255.f ? 255.f : v);
+
+                        dst[x*3 + k] = static_cast<unsigned char>(v + 0.5f);
+                    }
+                }
+            }
+        });
+    }
+
+    namespace detail
+    {
+        const size_t hemisphere_lanes = 16;
+
+        /**
+         * Maximum of sign * L(lu, lv) over the unit disk for hemisphere_lanes luminance polynomials
+         * with coefficients a, which have scale and bias applied
+         *
+         * Writing L as q^T H q / 2 + g^T q + c, the maximum lies either at the stationary point if H
+         * is negative definite and the point is inside the disk, or on the border where
+         * (mu I - H) q = g for the root mu > h1 of the secular equation |q(mu)| = 1, with h1 the
+         * largest eigenvalue of H. The root is found with a few Newton steps on 1/|q| - 1, which
+         * is concave in mu and converges from below. If g has no component along the eigenvector
+         * of h1 the root can be h1 itself, which is covered by a separate candidate. Every
+         * candidate is a point of the disk, so the largest of them is the maximum.
+         */
+        void ptm_hemisphere_max_lanes(const float a[6][hemisphere_lanes], float sign, float* out)
+        {
+            for (size_t i = 0; i < hemisphere_lanes; ++i)
+            {
+                const float h00 = sign * 2.f * a[0][i], h11 = sign * 2.f * a[1][i], h01 = sign * a[2][i];
+                const float g0 = sign * a[3][i], g1 = sign * a[4][i], c = sign * a[5][i];
+
+                // eigenvalues h1 >= h2 of H and its eigenvectors e1 = (cs, sn), e2 = (-sn, cs)
+                const float m = 0.5f * (h00 + h11);
+                const float d = std::sqrt(0.25f * (h00 - h11) * (h00 - h11) + h01 * h01);
+                const float h1 = m + d, h2 = m - d;
+                const float theta = 0.5f * std::atan2(2.f * h01, h00 - h11);
+                const float cs = std::cos(theta), sn = std::sin(theta);
+
+                // g in the eigenbasis, where L = (h1 q1^2 + h2 q2^2) / 2 + p1 q1 + p2 q2 + c
+                const float p1 = cs * g0 + sn * g1;
+                const float p2 = cs * g1 - sn * g0;
+
+                auto value = [&](float q1, float q2) { return 0.5f * (h1 * q1 * q1 + h2 * q2 * q2) + p1 * q1 + p2 * q2 + c; };
+
+                // stationary point
+                float best = -std::numeric_limits<float>::max();
+
+                if (h1 < -1e-6f)
+                {
+                    const float q1 = -p1 / h1, q2 = -p2 / h2;
+
+                    if (q1 * q1 + q2 * q2 <= 1.f)
+                        best = value(q1, q2);
+                }
+
+                // border, solving sum(p^2 / (mu - h)^2) = 1 from mu = h1 + |p1|
+                float mu = h1 + std::max(std::abs(p1), 1e-6f);
+
+                for (size_t it = 0; it < 6; ++it)
+                {
+                    const float r1 = 1.f / (mu - h1), r2 = 1.f / (mu - h2);
+                    const float n2 = p1 * p1 * r1 * r1 + p2 * p2 * r2 * r2;
+                    const float n3 = p1 * p1 * r1 * r1 * r1 + p2 * p2 * r2 * r2 * r2;
+
+                    if (n3 <= 0.f)
+                        break;
+
+                    const float inv = 1.f / std::sqrt(n2);
+                    mu = std::max(mu - (inv - 1.f) / (n3 * inv * inv * inv), h1 + 1e-6f);
+                }
+
+                {
+                    float q1 = p1 / (mu - h1), q2 = p2 / (mu - h2);
+                    const float len = std::sqrt(q1 * q1 + q2 * q2);
+
+                    if (len > 0.f)
+                        best = std::max(best, value(q1 / len, q2 / len));
+                }
+
+                // the eigenvector of h1, moved towards g along e2 if h1 and h2 differ
+                {
+                    const float q2 = h1 - h2 > 1e-6f ? p2 / (h1 - h2) : 0.f;
+
+                    if (q2 * q2 <= 1.f)
+                    {
+                        const float q1 = std::sqrt(1.f - q2 * q2);
+                        best = std::max(best, std::max(value(q1, q2), value(-q1, q2)));
+                    }
+                }
+
+                out[i] = sign * best;
+            }
+        }
+    }
+
+    void ptm_hemisphere(const PTM12* ptm, PTMHemisphere* hemisphere)
+    {
+        TAF_ASSERT(is_lrgb(&ptm->header), "Hemisphere statistics are only supported for LRGB PTMs");
+
+        const size_t w = ptm->header.width;
+        const size_t h = ptm->header.height;
+        const size_t num_pixels = w * h;
+        const size_t L = detail::hemisphere_lanes;
+
+        hemisphere->width = w;
+        hemisphere->height = h;
+
+        detail::metrics_resize(&hemisphere->max, num_pixels * 3);
+        detail::metrics_resize(&hemisphere->min, num_pixels * 3);
+        detail::metrics_resize(&hemisphere->mean, num_pixels * 3);
+
+        const unsigned char* coeff = &ptm->coefficients[0];
+        const unsigned char* color = &ptm->coefficients[num_pixels*6];
+
+        detail::StageTimer timer(PTM_STAGE_HEMISPHERE);
+
+        detail::parallel_for(0, h, 16, [&](size_t b, size_t e)
+        {
+            float a[6][L], hi[L], lo[L];
+
+            for (size_t y = b; y < e; ++y)
+            {
+                size_t first;
+                bool reversed;
+                detail::ptm_source_row(&ptm->header, y, &first, &reversed);
+
+                for (size_t x0 = 0; x0 < w; x0 += L)
+                {
+                    const size_t n = std::min(L, w - x0);
+
+                    // pad the batch with copies of its first pixel
+                    for (size_t i = 0; i < L; ++i)
+                    {
+                        const size_t x = x0 + (i < n ? i : 0);
+                        const unsigned char* c = coeff + (first + (reversed ? w - 1 - x : x)) * 6;
+
+                        for (size_t j = 0; j < 6; ++j)
+                            a[j][i] = ptm->header.scale[j] * (c[j] - ptm->header.bias[j]) / 255.f;
+                    }
+
+                    detail::ptm_hemisphere_max_lanes(a, 1.f, hi);
+                    detail::ptm_hemisphere_max_lanes(a, -1.f, lo);
+
+                    for (size_t i = 0; i < n; ++i)
+                    {
+                        const size_t x = x0 + i;
+                        const unsigned char* rgb = color + (first + (reversed ? w - 1 - x : x)) * 3;
+
+                        // lu^2 and lv^2 both average to 1/3 over the hemisphere, the odd terms vanish
+                        const float mean = (a[0][i] + a[1][i]) / 3.f + a[5][i];
+                        const float lum[3] = { hi[i], lo[i], mean };
+                        unsigned char* dst[3] = { &hemisphere->max[0], &hemisphere->min[0], &hemisphere->mean[0] };
+
+                        for (size_t s = 0; s < 3; ++s)
+                            for (size_t k = 0; k < 3; ++k)
+                            {
+                                float v = rgb[k] * lum[s];
+                                v = v < 0.f ? 0.f : (v > 255.f ? 255.f : v);
+
+                                dst[s][(y * w + x) * 3 + k] = static_cast<unsigned char>(v + 0.5f);
+                            }
+                    }
+                }
+            }
+        });
+    }
+
+    void ptm_diff(const PTM12* a, const PTM12* b, const std::vector<std::pair<float, float>>& lights, PTMDiff* diff)
+    {
+        TAF_ASSERT(is_lrgb(&a->header) && is_lrgb(&b->header), "Comparison is only supported for LRGB PTMs");
+        TAF_ASSERT(a->header.width == b->header.width && a->header.height == b->header.height, "Incompatible PTM sizes");
+
+        const size_t w = a->header.width;
+        const size_t h = a->header.height;
+        const size_t num_pixels = w * h;
+
+        // bring b into the orientation of a
+        PTM12 reoriented;
+
+        if (a->header.format != b->header.format)
+        {
+            uchar_vec coeff_h(num_pixels * 3), coeff_l(num_pixels * 3), rgb(num_pixels * 3);
+
+            unsigned char* h_ptr   = &coeff_h[0];
+            unsigned char* l_ptr   = &coeff_l[0];
+            unsigned char* rgb_ptr = &rgb[0];
+
+            ptm_load(b, &h_ptr, &l_ptr, &rgb_ptr);
+
+            PTMHeader12 header = b->header;
+            header.format = a->header.format;
+
+            ptm_from_rgb(&header, h_ptr, l_ptr, rgb_ptr, &reoriented);
+            b = &reoriented;
+        }
+
+        double sse[9] = { 0 };
+        int max_error[9] = { 0 };
+        std::mutex merge;
+
+        detail::parallel_for(0, num_pixels, 1 << 16, [&](size_t begin, size_t end)
+        {
+            double local_sse[9] = { 0 };
+            int local_max[9] = { 0 };
+
+            detail::ptm_plane_errors(&a->coefficients[0], &b->coefficients[0], 6, begin, end, local_sse, local_max);
+            detail::ptm_plane_errors(&a->coefficients[num_pixels*6], &b->coefficients[num_pixels*6], 3, begin, end, local_sse + 6, local_max + 6);
+
+            std::lock_guard<std::mutex> lock(merge);
+
+            for (size_t i = 0; i < 9; ++i)
+            {
+                sse[i] += local_sse[i];
+                max_error[i] = std::max(max_error[i], local_max[i]);
+            }
+        });
+
+        for (size_t i = 0; i < 9; ++i)
+        {
+            diff->mse[i] = num_pixels ? sse[i] / num_pixels : 0.0;
+            diff->psnr[i] = diff->mse[i] > 0 ? 10.0 * std::log10(255.0 * 255.0 / diff->mse[i]) : std::numeric_limits<double>::infinity();
+            diff->max_error[i] = max_error[i];
+        }
+
+        diff->ssim.clear();
+
+        uchar_vec relit_a(num_pixels * 3), relit_b(num_pixels * 3);
+
+        for (auto& l : lights)
+        {
+            ptm_relight(a, l.first, l.second, &relit_a[0]);
+            ptm_relight(b, l.first, l.second, &relit_b[0]);
+
+            diff->ssim.push_back(detail::ssim(&relit_a[0], &relit_b[0], w, h));
+        }
+    }
+
+    namespace detail
+    {
+        void ptm_decode_side_information(const unsigned char* records, size_t size, size_t width, size_t height, SideInformation* si)
+        {
+            TAF_ASSERT(size % 5 == 0, "Corrupt side information");
+            TAF_ASSERT(width > 0 && height > 0, "Invalid PTM size");
+            TAF_ASSERT(width * height <= 0xffffffffull, "Plane too large for side information");
+
+            const size_t n = size / 5;
+            const size_t num_pixels = width * height;
+            const double inv_width = 1.0 / width;
+
+            // keys hold the flipped index in the upper and the record number in the lower 32 bits,
+            // so sorting them keeps the file order of duplicates
+            std::vector<unsigned long long> keys(n);
+            bool out_of_bounds = false;
+
+            detail::parallel_for(0, n, 1 << 16, [&](size_t b, size_t e)
+            {
+                bool bad = false;
+
+                for (size_t k = b; k < e; ++k)
+                {
+                    const unsigned char* r = records + k*5;
+
+                    size_t index = static_cast<size_t>(r[0]) << 24 | static_cast<size_t>(r[1]) << 16 |
+                                   static_cast<size_t>(r[2]) << 8  | static_cast<size_t>(r[3]);
+
+                    // divide via the reciprocal and correct the rounding error
+                    size_t row = static_cast<size_t>(index * inv_width);
+                    row -= (row * width > index) ? 1 : 0;
+                    row += ((row + 1) * width <= index) ? 1 : 0;
+
+                    size_t index2 = (height - 1 - row) * width + (index - row * width);
+
+                    bad |= index >= num_pixels;
+                    keys[k] = static_cast<unsigned long long>(index2) << 32 | k;
+                }
+
+                if (bad)
+                    out_of_bounds = true;
+            });
+
+            TAF_ASSERT(!out_of_bounds, "Side information index out of bounds");
+
+            // sort large lists by first bucketing them into bands of the plane and sorting the
+            // bands in parallel
+            const size_t num_bands = n > (1 << 18) ? 64 : 1;
+            const size_t band_size = (num_pixels + num_bands - 1) / num_bands;
+
+            if (num_bands > 1)
+            {
+                std::vector<size_t> offsets(num_bands + 1, 0);
+
+                for (auto k : keys)
+                    offsets[(k >> 32) / band_size + 1]++;
+
+                for (size_t b = 0; b < num_bands; ++b)
+                    offsets[b + 1] += offsets[b];
+
+                std::vector<unsigned long long> bucketed(n);
+                std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+
+                for (auto k : keys)
+                    bucketed[fill[(k >> 32) / band_size]++] = k;
+
+                keys.swap(bucketed);
+
+                detail::parallel_for(0, num_bands, 1, [&](size_t b, size_t e)
+                {
+                    for (size_t band = b; band < e; ++band)
+                        std::sort(keys.begin() + offsets[band], keys.begin() + offsets[band + 1]);
+                });
+            }
+            else if (!std::is_sorted(keys.begin(), keys.end()))
+                std::sort(keys.begin(), keys.end());
+
+            si->index.resize(n);
+            si->value.resize(n);
+
+            detail::parallel_for(0, n, 1 << 16, [&](size_t b, size_t e)
+            {
+                for (size_t k = b; k < e; ++k)
+                {
+                    si->index[k] = static_cast<unsigned int>(keys[k] >> 32);
+                    si->value[k] = records[(keys[k] & 0xffffffffull)*5 + 4];
+                }
+            });
+        }
+
+        void ptm_apply_side_information(const SideInformation& si, unsigned char* plane, size_t begin, size_t end)
+        {
+            if (si.index.empty())
+                return;
+
+            // split at pixel boundaries so duplicates of one index are always handled by one thread
+            detail::parallel_for(begin, end, 1 << 20, [&](size_t b, size_t e)
+            {
+                auto first = std::lower_bound(si.index.begin(), si.index.end(), b);
+                auto last  = std::lower_bound(first, si.index.end(), e);
+
+                for (auto it = first; it != last; ++it)
+                    plane[*it] = si.value[it - si.index.begin()];
+            });
+        }
+    }
+
+    namespace detail
+    {
+        void ptm_read_payload(std::istream& stream, PTMCompressed* ptm)
+        {
+            size_t size = 0;
+
+            for (size_t p = 0; p < get_epp(&ptm->header); ++p)
+                size += static_cast<size_t>(ptm->header.ci.compressed_size[p]) + ptm->header.ci.side_information[p];
+
+            StageTimer timer(PTM_STAGE_READ);
+
+            ptm->data.resize(size);
+
+            if (size > 0)
+                stream.read(reinterpret_cast<char*>(&ptm->data[0]), size);
+
+            TAF_ASSERT(static_cast<size_t>(stream.gcount()) == size, "Unexpected end of file");
+
+            metrics_count(PTM_COUNTER_BYTES_READ, size);
+        }
+
+        /**
+         * Decode a JPEG plane, or with dc_only just the averages of its 8x8 blocks into a plane
+         * of 1/8 size, rounded up. Planes stb can't decode that way are decoded completely and
+         * averaged.
+         */
+        unsigned char* ptm_decode_jpeg_plane(const PTMHeader12* ptm, const unsigned char* jpeg, size_t size, bool dc_only)
+        {
+            int w = 0;
+            int h = 0;
+            int comp = 1;
+
+            TAF_ASSERT(size > 0 && size <= INT_MAX, "Invalid compressed plane size");
+
+            // convert to char values
+            unsigned char* plane = dc_only ? stbi_load_from_memory_dc(jpeg, static_cast<int>(size), &w, &h, &comp, 1) : nullptr;
+            bool averaged = plane != nullptr;
+
+            if (!plane)
+                plane = stbi_load_from_memory(jpeg, static_cast<int>(size), &w, &h, &comp, 1);
+
+            // stb never clears its failure reason, so only the result tells if this load failed
+            TAF_ASSERT(plane, stbi_failure_reason());
+
+            metrics_count(PTM_COUNTER_PLANES_DECODED);
+            metrics_allocation(static_cast<size_t>(w) * h);
+
+            const size_t width = averaged ? (ptm->width + 7) / 8 : ptm->width;
+            const size_t height = averaged ? (ptm->height + 7) / 8 : ptm->height;
+
+            if (comp != 1 || static_cast<size_t>(w) != width || static_cast<size_t>(h) != height)
+            {
+                stbi_image_free(plane);
+
+                TAF_ASSERT(comp == 1, "Too many components in LRGB image");
+                TAF_ASSERT(false, "Incompatible image size found");
+            }
+
+            if (!dc_only || averaged)
+                return plane;
+
+            // average the blocks of the full plane in place, edge blocks over the pixels they cover
+            const size_t bw = (ptm->width + 7) / 8, bh = (ptm->height + 7) / 8;
+
+            for (size_t by = 0; by < bh; ++by)
+                for (size_t bx = 0; bx < bw; ++bx)
+                {
+                    const size_t x1 = std::min(bx * 8 + 8, ptm->width), y1 = std::min(by * 8 + 8, ptm->height);
+                    size_t sum = 0;
+
+                    for (size_t y = by * 8; y < y1; ++y)
+                        for (size_t x = bx * 8; x < x1; ++x)
+                            sum += plane[y * ptm->width + x];
+
+                    const size_t n = (x1 - bx * 8) * (y1 - by * 8);
+                    plane[by * bw + bx] = static_cast<unsigned char>((sum + n / 2) / n);
+                }
+
+            return plane;
+        }
+
+        unsigned char* ptm_read_jpeg_plane(std::istream& stream, const PTMHeader12* ptm, size_t p, std::vector<unsigned char>* side_info)
+        {
+            // read jpeg buffer
+            size_t bufs = ptm->ci.compressed_size[p];
+
+            TAF_ASSERT(bufs > 0 && bufs <= INT_MAX, "Invalid compressed plane size");
+
+            std::vector<unsigned char> jpegbuf(bufs);
+            stream.read(reinterpret_cast<char*>(&jpegbuf[0]), bufs);
+
+            size_t sides = ptm->ci.side_information[p];
+            if (sides > 0)
+            {
+                side_info->resize(sides);
+                stream.read(reinterpret_cast<char*>(&(*side_info)[0]), sides);
+            }
+
+            TAF_ASSERT(stream.good(), "Unexpected end of file");
+
+            metrics_count(PTM_COUNTER_BYTES_READ, bufs + sides);
+
+            return ptm_decode_jpeg_plane(ptm, &jpegbuf[0], bufs);
+        }
+
+        void ptm_predict_plane(unsigned char* i_plane, const unsigned char* j_plane, PTMTransform transform, size_t begin, size_t end)
+        {
+            // TODO: add motion vector transformation!
+            const int invert = transform == PLANE_INVERSION ? 255 : 0;
+            const int sign = transform == PLANE_INVERSION ? -1 : 1;
+
+            for (size_t x = begin; x < end; ++x)
+            {
+                unsigned char jpx = static_cast<unsigned char>(invert + sign * j_plane[x]);
+                i_plane[x] = (jpx + i_plane[x] - 128)%255;
+            }
+        }
+
+        void ptm_convert_rows(const PTMHeader12* ptm, const unsigned char* coeff, const unsigned char* color, size_t y_begin, size_t y_end, unsigned char* coeff_h, unsigned char* coeff_l, unsigned char* rgb)
+        {
+            const size_t w = ptm->width;
+
+            detail::parallel_for(y_begin, y_end, 64, [&](size_t b, size_t e)
+            {
+                for (size_t y = b; y < e; ++y)
+                {
+                    if ((y - b) % 64 == 0)
+                        ptm_preemption_point();
+
+                    size_t first;
+                    bool reversed;
+                    ptm_source_row(ptm, y, &first, &reversed);
+
+                    for (size_t x = 0; x < w; ++x)
+                    {
+                        size_t p = first + (reversed ? w - 1 - x : x);
+                        size_t index = (y*w + x) * 3;
+
+                        for (size_t c = 0; c < 3; ++c)
+                        {
+                            // coefficients: first wxhx6 block, rgb: second wxhx3 block
+                            coeff_h[index + c] = coeff[p*6 + c];
+                            coeff_l[index + c] = coeff[p*6 + c + 3];
+                            rgb[index + c]     = color[p*3 + c];
+                        }
+                    }
+                }
+            });
+        }
+
+        void ptm_convert_plane_rows(const PTMHeader12* ptm, unsigned char* const* planes, size_t y_begin, size_t y_end, unsigned char* coeff_h, unsigned char* coeff_l, unsigned char* rgb)
+        {
+            const size_t w = ptm->width;
+
+            // JPEG planes are rotated by 180 degrees and the RGB images mirrored horizontally, so
+            // each output row is a row of the planes upside down
+            detail::parallel_for(y_begin, y_end, 64, [&](size_t b, size_t e)
+            {
+                for (size_t y = b; y < e; ++y)
+                {
+                    if ((y - b) % 64 == 0)
+                        ptm_preemption_point();
+
+                    size_t row = (ptm->height - 1 - y) * w;
+
+                    for (size_t x = 0; x < w; ++x)
+                    {
+                        size_t index = (y*w + x) * 3;
+
+                        for (size_t c = 0; c < 3; ++c)
+                        {
+                            coeff_h[index + c] = planes[c][row + x];
+                            coeff_l[index + c] = planes[c + 3][row + x];
+                            rgb[index + c]     = planes[c + 6][row + x];
+                        }
+                    }
+                }
+            });
+        }
+    }
+
+#if defined(__unix__) || defined(__APPLE__)
+    MappedFile::MappedFile() : data_(nullptr), size_(0), writable_(false)
+    {
+    }
+
+    MappedFile::~MappedFile()
+    {
+        close();
+    }
+
+    void MappedFile::open(const char* path)
+    {
+        close();
+
+        int fd = ::open(path, O_RDONLY);
+        TAF_ASSERT(fd >= 0, "Can't open file");
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            ::close(fd);
+            TAF_ASSERT(false, "Can't map empty file");
+        }
+
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+
+        TAF_ASSERT(p != MAP_FAILED, "Can't map file");
+
+        data_ = static_cast<unsigned char*>(p);
+        size_ = st.st_size;
+        writable_ = false;
+    }
+
+    void MappedFile::create(const char* path, size_t size)
+    {
+        close();
+
+        int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        TAF_ASSERT(fd >= 0, "Can't create scratch file");
+
+        // the file lives on as long as it is mapped
+        unlink(path);
+
+        if (ftruncate(fd, size) != 0)
+        {
+            ::close(fd);
+            TAF_ASSERT(false, "Can't resize scratch file");
+        }
+
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+
+        TAF_ASSERT(p != MAP_FAILED, "Can't map scratch file");
+
+        data_ = static_cast<unsigned char*>(p);
+        size_ = size;
+        writable_ = true;
+    }
+
+    void MappedFile::close()
+    {
+        if (data_)
+            munmap(data_, size_);
+
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    void MappedFile::will_need(size_t offset, size_t length) const
+    {
+        const size_t page = sysconf(_SC_PAGESIZE);
+        size_t begin = std::min(offset, size_) / page * page;
+        size_t end = std::min(offset + length, size_);
+
+        if (end > begin)
+            madvise(data_ + begin, end - begin, MADV_WILLNEED);
+    }
+
+    void MappedFile::dont_need(size_t offset, size_t length) const
+    {
+        // only whole pages inside the range can be dropped
+        const size_t page = sysconf(_SC_PAGESIZE);
+        size_t begin = (std::min(offset, size_) + page - 1) / page * page;
+        size_t end = std::min(offset + length, size_) / page * page;
+
+        if (end <= begin)
+            return;
+
+        if (writable_)
+            msync(data_ + begin, end - begin, MS_ASYNC);
+
+        madvise(data_ + begin, end - begin, MADV_DONTNEED);
+    }
+#else
+    MappedFile::MappedFile() : data_(nullptr), size_(0), writable_(false) {}
+    MappedFile::~MappedFile() {}
+    void MappedFile::open(const char*) { TAF_ASSERT(false, "Memory mapped files are not supported on this platform"); }
+    void MappedFile::create(const char*, size_t) { TAF_ASSERT(false, "Memory mapped files are not supported on this platform"); }
+    void MappedFile::close() {}
+    void MappedFile::will_need(size_t, size_t) const {}
+    void MappedFile::dont_need(size_t, size_t) const {}
+#endif
+
+    PTMHeader12 ptm_load(const char* file, const char* scratch_file, size_t memory_limit, MappedFile* scratch, unsigned char** coeff_h, unsigned char** coeff_l, unsigned char** rgb)
+    {
+        std::ifstream stream(file, std::ios::binary);
+
+        TAF_ASSERT(stream.good(), "Can't open file");
+
+        TAF_ASSERT(!detail::ptm_is_lossless(stream), "Lossless PTMs are read in parts with ptm_load_region");
+
+        PTMHeader12 header;
+        detail::ptm_read_header(stream, &header);
+
+        TAF_ASSERT(header.format == PTM_FORMAT_LRGB || header.format == PTM_FORMAT_JPEG_LRGB, "Can't read format into RGB buffer");
+
+        detail::metrics_count(PTM_COUNTER_FILES_LOADED);
+
+        const size_t w = header.width;
+        const size_t h = header.height;
+        const size_t num_pixels = w * h;
+        const size_t epp = get_epp(&header);
+
+        if (header.format == PTM_FORMAT_LRGB)
+        {
+            const size_t offset = static_cast<size_t>(stream.tellg());
+            stream.close();
+
+            MappedFile input;
+            input.open(file);
+
+            TAF_ASSERT(input.size() >= offset + num_pixels * epp, "Unexpected end of file");
+
+            detail::metrics_count(PTM_COUNTER_BYTES_READ, num_pixels * epp);
+
+            scratch->create(scratch_file, num_pixels * 9);
+
+            *coeff_h = scratch->data();
+            *coeff_l = scratch->data() + num_pixels * 3;
+            *rgb     = scratch->data() + num_pixels * 6;
+
+            const unsigned char* coeff = input.data() + offset;
+            const unsigned char* color = coeff + num_pixels * 6;
+
+            // each output row needs 9 bytes per pixel of input and 9 bytes of output
+            const size_t tile = std::max<size_t>(memory_limit / (w * 18), 1);
+
+            // output rows [a, b) are read from the rows [h - b, h - a) of the PTM
+            auto advise = [&](size_t a, size_t b, bool need)
+            {
+                size_t src = (h - b) * w, n = (b - a) * w;
+
+                if (need)
+                {
+                    input.will_need(offset + src * 6, n * 6);
+                    input.will_need(offset + num_pixels * 6 + src * 3, n * 3);
+                    return;
+                }
+
+                input.dont_need(offset + src * 6, n * 6);
+                input.dont_need(offset + num_pixels * 6 + src * 3, n * 3);
+
+                for (size_t i = 0; i < 3; ++i)
+                    scratch->dont_need(i * num_pixels * 3 + a * w * 3, n * 3);
+            };
+
+            advise(0, std::min(tile, h), true);
+
+            for (size_t y = 0; y < h; y += tile)
+            {
+                size_t y1 = std::min(y + tile, h);
+
+                if (y1 < h)
+                    advise(y1, std::min(y1 + tile, h), true);
+
+                detail::ptm_convert_rows(&header, coeff, color, y, y1, *coeff_h, *coeff_l, *rgb);
+
+                advise(y, y1, false);
+            }
+        }
+        else
+        {
+            TAF_ASSERT(w <= 65535 && h <= 65535, "JPEG planes can't be larger than 65535x65535");
+
+            scratch->create(scratch_file, num_pixels * 18);
+
+            unsigned char* planes[9];
+            std::vector<detail::SideInformation> side_info(epp);
+            std::map<size_t, size_t> order;
+
+            // first pass: decode one plane at a time into the scratch file
+            for (size_t p = 0; p < epp; ++p)
+            {
+                std::vector<unsigned char> records;
+                unsigned char* plane = detail::ptm_read_jpeg_plane(stream, &header, p, &records);
+
+                planes[p] = scratch->data() + p * num_pixels;
+                std::copy(plane, plane + num_pixels, planes[p]);
+                stbi_image_free(plane);
+
+                scratch->dont_need(p * num_pixels, num_pixels);
+
+                if (!records.empty())
+                    detail::ptm_decode_side_information(&records[0], records.size(), w, h, &side_info[p]);
+
+                order[header.ci.order[p]] = p;
+            }
+
+            stream.close();
+
+            // second pass: prediction and side information on tiles of all planes
+            const size_t tile = std::max<size_t>(memory_limit / epp, 1 << 16);
+
+            for (size_t a = 0; a < num_pixels; a += tile)
+            {
+                size_t b = std::min(a + tile, num_pixels);
+
+                for (size_t n = 0; n < epp; ++n)
+                {
+                    size_t i = order[n];
+                    int j = header.ci.reference_planes[i];
+
+                    if (j >= 0)
+                    {
+                        TAF_ASSERT(static_cast<size_t>(j) < epp, "Invalid reference plane");
+
+                        detail::ptm_predict_plane(planes[i], planes[j], header.ci.transforms[i], a, b);
+                    }
+
+                    detail::ptm_apply_side_information(side_info[i], planes[i], a, b);
+                }
+
+                for (size_t p = 0; p < epp; ++p)
+                    scratch->dont_need(p * num_pixels + a, b - a);
+            }
+
+            // third pass: interleave rows of the planes into the output images
+            *coeff_h = scratch->data() + num_pixels * 9;
+            *coeff_l = scratch->data() + num_pixels * 12;
+            *rgb     = scratch->data() + num_pixels * 15;
+
+            const size_t rows = std::max<size_t>(memory_limit / (w * 18), 1);
+
+            for (size_t y = 0; y < h; y += rows)
+            {
+                size_t y1 = std::min(y + rows, h);
+                size_t src = (h - y1) * w, n = (y1 - y) * w;
+
+                for (size_t p = 0; p < epp; ++p)
+                    scratch->will_need(p * num_pixels + src, n);
+
+                detail::ptm_convert_plane_rows(&header, planes, y, y1, *coeff_h, *coeff_l, *rgb);
+
+                for (size_t p = 0; p < epp; ++p)
+                    scratch->dont_need(p * num_pixels + src, n);
+
+                for (size_t i = 0; i < 3; ++i)
+                    scratch->dont_need(num_pixels * (9 + i * 3) + y * w * 3, n * 3);
+            }
+        }
+
+        return header;
+    }
+
+    namespace detail
+    {
+        // file layout: magic, width, height, tile size, scale, bias, num_tiles + 1 absolute tile
+        // offsets, then the tiles in row major order; all integers little endian
+        const char lossless_magic[8] = { 'T', 'A', 'F', 'P', 'T', 'M', 'L', '1' };
+
+        const unsigned rans_scale_bits = 12;
+        const unsigned rans_scale = 1 << rans_scale_bits;
+        const uint32_t rans_lower_bound = 1u << 23;
+
+        enum LosslessMode
+        {
+            LOSSLESS_RAW,
+            LOSSLESS_RANS
+        };
+
+        void put_le(std::vector<unsigned char>* out, uint64_t v, size_t bytes)
+        {
+            for (size_t i = 0; i < bytes; ++i)
+                out->push_back(static_cast<unsigned char>(v >> (i * 8)));
+        }
+
+        uint64_t get_le(const unsigned char* p, size_t bytes)
+        {
+            uint64_t v = 0;
+            for (size_t i = 0; i < bytes; ++i)
+                v |= static_cast<uint64_t>(p[i]) << (i * 8);
+            return v;
+        }
+
+        /**
+         * Bounds checked reader over a tile record
+         */
+        struct ByteReader
+        {
+            const unsigned char* p;
+            const unsigned char* end;
+
+            const unsigned char* skip(size_t n)
+            {
+                TAF_ASSERT(static_cast<size_t>(end - p) >= n, "Corrupt lossless tile");
+                const unsigned char* r = p;
+                p += n;
+                return r;
+            }
+
+            uint64_t get(size_t bytes)
+            {
+                return get_le(skip(bytes), bytes);
+            }
+        };
+
+        // residuals are stored zigzagged, so small positive and negative values become small symbols
+        inline unsigned char zigzag(unsigned char r)
+        {
+            int v = static_cast<signed char>(r);
+            return static_cast<unsigned char>(v >= 0 ? v * 2 : -v * 2 - 1);
+        }
+
+        inline unsigned char unzigzag(unsigned char z)
+        {
+            return static_cast<unsigned char>((z >> 1) ^ -(z & 1));
+        }
+
+        template<unsigned Predictor>
+        inline int lossless_predict(int a, int b, int c)
+        {
+            switch (Predictor)
+            {
+                case 1: return a;
+                case 2: return b;
+                case 3: return c >= std::max(a, b) ? std::min(a, b) : c <= std::min(a, b) ? std::max(a, b) : a + b - c;
+                case 4: return (a + b) >> 1;
+                default: return 0;
+            }
+        }
+
+        const unsigned num_predictors = 5;
+
+        /**
+         * Replace a plane by the residuals of Predictor (none, left, up, MED, average), or with
+         * Inverse rebuild the plane from its residuals
+         */
+        template<unsigned Predictor, bool Inverse>
+        void lossless_filter(const unsigned char* in, size_t w, size_t h, unsigned char* out)
+        {
+            const unsigned char* plane = Inverse ? out : in;
+
+            auto apply = [&](size_t i, int pred)
+            {
+                if (Inverse)
+                    out[i] = static_cast<unsigned char>(unzigzag(in[i]) + pred);
+                else
+                    out[i] = zigzag(static_cast<unsigned char>(in[i] - pred));
+            };
+
+            // the first row is predicted from the left, the first column from above
+            for (size_t x = 0; x < w; ++x)
+                apply(x, Predictor == 0 || x == 0 ? 0 : plane[x - 1]);
+
+            for (size_t y = 1; y < h; ++y)
+            {
+                const size_t i = y * w;
+
+                apply(i, Predictor == 0 ? 0 : plane[i - w]);
+
+                for (size_t x = 1; x < w; ++x)
+                    apply(i + x, lossless_predict<Predictor>(plane[i + x - 1], plane[i + x - w], plane[i + x - w - 1]));
+            }
+        }
+
+        template<bool Inverse>
+        void lossless_filter(unsigned predictor, const unsigned char* in, size_t w, size_t h, unsigned char* out)
+        {
+            switch (predictor)
+            {
+                case 0: lossless_filter<0, Inverse>(in, w, h, out); break;
+                case 1: lossless_filter<1, Inverse>(in, w, h, out); break;
+                case 2: lossless_filter<2, Inverse>(in, w, h, out); break;
+                case 3: lossless_filter<3, Inverse>(in, w, h, out); break;
+                case 4: lossless_filter<4, Inverse>(in, w, h, out); break;
+                default: TAF_ASSERT(false, "Corrupt lossless tile");
+            }
+        }
+
+        double entropy(const size_t* hist, size_t n)
+        {
+            double bits = 0;
+            for (size_t s = 0; s < 256; ++s)
+                if (hist[s])
+                    bits += hist[s] * std::log2(static_cast<double>(n) / hist[s]);
+            return bits;
+        }
+
+        /**
+         * Scale a histogram to frequencies summing up to rans_scale, keeping every occurring symbol
+         */
+        void rans_normalize(const size_t* hist, size_t n, unsigned* freq)
+        {
+            unsigned sum = 0;
+
+            for (size_t s = 0; s < 256; ++s)
+            {
+                freq[s] = hist[s] ? std::max<unsigned>(static_cast<unsigned>(hist[s] * rans_scale / n), 1) : 0;
+                sum += freq[s];
+            }
+
+            // rounding errors are taken from, or given to, the most frequent symbols
+            while (sum != rans_scale)
+            {
+                size_t best = std::max_element(freq, freq + 256) - freq;
+
+                if (sum < rans_scale)
+                {
+                    freq[best] += rans_scale - sum;
+                    sum = rans_scale;
+                }
+                else
+                {
+                    unsigned take = std::min(sum - rans_scale, freq[best] / 2);
+                    freq[best] -= take;
+                    sum -= take;
+                }
+            }
+        }
+
+        void rans_encode(const unsigned char* in, size_t n, const unsigned* freq, std::vector<unsigned char>* out)
+        {
+            unsigned start[256];
+            for (size_t s = 0, c = 0; s < 256; c += freq[s++])
+                start[s] = static_cast<unsigned>(c);
+
+            // a symbol never takes more than two bytes, the states take another 16
+            std::vector<unsigned char> buffer(n * 2 + 16);
+            unsigned char* end = buffer.data() + buffer.size();
+            unsigned char* ptr = end;
+
+            uint32_t x[4] = { rans_lower_bound, rans_lower_bound, rans_lower_bound, rans_lower_bound };
+
+            // symbols are encoded back to front, so the decoder reads the stream forward
+            for (size_t i = n; i-- > 0;)
+            {
+                uint32_t& state = x[i & 3];
+                unsigned f = freq[in[i]];
+                uint32_t x_max = ((rans_lower_bound >> rans_scale_bits) << 8) * f;
+
+                while (state >= x_max)
+                {
+                    *--ptr = static_cast<unsigned char>(state);
+                    state >>= 8;
+                }
+
+                state = ((state / f) << rans_scale_bits) + (state % f) + start[in[i]];
+            }
+
+            for (size_t k = 4; k-- > 0;)
+                for (size_t b = 4; b-- > 0;)
+                    *--ptr = static_cast<unsigned char>(x[k] >> (b * 8));
+
+            out->insert(out->end(), ptr, end);
+        }
+
+        void rans_decode(const unsigned char* data, size_t size, const unsigned* freq, unsigned char* out, size_t n)
+        {
+            // one lookup per symbol: the symbol, its frequency and the slot's offset into its range
+            struct Slot
+            {
+                uint16_t freq;
+                uint16_t offset;
+                unsigned char symbol;
+            };
+
+            Slot slots[rans_scale];
+
+            for (size_t s = 0, c = 0; s < 256; c += freq[s++])
+                for (size_t k = 0; k < freq[s]; ++k)
+                    slots[c + k] = Slot { static_cast<uint16_t>(freq[s]), static_cast<uint16_t>(k), static_cast<unsigned char>(s) };
+
+            TAF_ASSERT(size >= 16, "Corrupt lossless tile");
+
+            const unsigned char* ptr = data + 16;
+            const unsigned char* end = data + size;
+
+            uint32_t x[4];
+            for (size_t k = 0; k < 4; ++k)
+                x[k] = static_cast<uint32_t>(get_le(data + k * 4, 4));
+
+            auto step = [&](uint32_t state, unsigned char* o) -> uint32_t
+            {
+                const Slot& slot = slots[state & (rans_scale - 1)];
+                *o = slot.symbol;
+
+                state = slot.freq * (state >> rans_scale_bits) + slot.offset;
+
+                while (state < rans_lower_bound)
+                {
+                    TAF_ASSERT(ptr < end, "Corrupt lossless tile");
+                    state = (state << 8) | *ptr++;
+                }
+
+                return state;
+            };
+
+            // four independent states let consecutive symbols decode in parallel in the pipeline
+            uint32_t x0 = x[0], x1 = x[1], x2 = x[2], x3 = x[3];
+
+            size_t i = 0;
+            for (; i + 4 <= n; i += 4)
+            {
+                x0 = step(x0, out + i);
+                x1 = step(x1, out + i + 1);
+                x2 = step(x2, out + i + 2);
+                x3 = step(x3, out + i + 3);
+            }
+
+            uint32_t* tail[3] = { &x0, &x1, &x2 };
+            for (; i < n; ++i)
+                *tail[i & 3] = step(*tail[i & 3], out + i);
+        }
+
+        void ptm_encode_tile(const PTM12* ptm, size_t x0, size_t y0, size_t tw, size_t th, std::vector<unsigned char>* out)
+        {
+            const size_t w = ptm->header.width;
+            const size_t num_pixels = w * ptm->header.height;
+            const size_t n = tw * th;
+            const bool rotated = ptm->header.format == PTM_FORMAT_JPEG_LRGB;
+
+            std::vector<unsigned char> plane(n), residuals(n), best(n);
+
+            for (size_t p = 0; p < 9; ++p)
+            {
+                const unsigned char* src = p < 6 ? &ptm->coefficients[p] : &ptm->coefficients[num_pixels * 6 + p - 6];
+                const size_t step = p < 6 ? 6 : 3;
+
+                // JPEG PTMs are stored rotated by 180 degrees compared to LRGB PTMs
+                for (size_t y = 0; y < th; ++y)
+                    for (size_t x = 0; x < tw; ++x)
+                    {
+                        size_t i = (y0 + y) * w + x0 + x;
+                        plane[y * tw + x] = src[(rotated ? num_pixels - 1 - i : i) * step];
+                    }
+
+                unsigned predictor = 0;
+                size_t hist[256], best_hist[256];
+                double best_bits = std::numeric_limits<double>::max();
+
+                for (unsigned k = 0; k < num_predictors; ++k)
+                {
+                    lossless_filter<false>(k, plane.data(), tw, th, residuals.data());
+
+                    std::fill(hist, hist + 256, 0);
+                    for (size_t i = 0; i < n; ++i)
+                        hist[residuals[i]]++;
+
+                    double bits = entropy(hist, n);
+
+                    if (bits < best_bits)
+                    {
+                        best_bits = bits;
+                        predictor = k;
+                        best.swap(residuals);
+                        std::copy(hist, hist + 256, best_hist);
+                    }
+                }
+
+                unsigned freq[256];
+                rans_normalize(best_hist, n, freq);
+
+                size_t num_symbols = 256;
+                while (freq[num_symbols - 1] == 0)
+                    --num_symbols;
+
+                std::vector<unsigned char> coded;
+                rans_encode(best.data(), n, freq, &coded);
+
+                out->push_back(static_cast<unsigned char>(predictor));
+
+                // incompressible planes are kept as they are
+                if (coded.size() + num_symbols * 2 + 6 >= n)
+                {
+                    out->push_back(LOSSLESS_RAW);
+                    out->insert(out->end(), plane.begin(), plane.end());
+                    continue;
+                }
+
+                out->push_back(LOSSLESS_RANS);
+                put_le(out, num_symbols, 2);
+
+                for (size_t s = 0; s < num_symbols; ++s)
+                    put_le(out, freq[s], 2);
+
+                put_le(out, coded.size(), 4);
+                out->insert(out->end(), coded.begin(), coded.end());
+            }
+        }
+
+        void ptm_decode_tile(const unsigned char* data, size_t size, size_t tw, size_t th, unsigned char* coeff, unsigned char* rgb, size_t stride)
+        {
+            const size_t n = tw * th;
+
+            metrics_count(PTM_COUNTER_PLANES_DECODED, 9);
+
+            ByteReader reader = { data, data + size };
+            std::vector<unsigned char> plane(n), residuals(n);
+
+            for (size_t p = 0; p < 9; ++p)
+            {
+                unsigned predictor = static_cast<unsigned>(reader.get(1));
+                unsigned mode = static_cast<unsigned>(reader.get(1));
+
+                if (mode == LOSSLESS_RAW)
+                {
+                    const unsigned char* raw = reader.skip(n);
+                    std::copy(raw, raw + n, plane.begin());
+                }
+                else
+                {
+                    TAF_ASSERT(mode == LOSSLESS_RANS, "Corrupt lossless tile");
+
+                    size_t num_symbols = static_cast<size_t>(reader.get(2));
+                    TAF_ASSERT(num_symbols <= 256, "Corrupt lossless tile");
+
+                    unsigned freq[256] = { 0 }, sum = 0;
+                    for (size_t s = 0; s < num_symbols; ++s)
+                        sum += freq[s] = static_cast<unsigned>(reader.get(2));
+
+                    TAF_ASSERT(sum == rans_scale, "Corrupt lossless tile");
+
+                    size_t length = static_cast<size_t>(reader.get(4));
+                    rans_decode(reader.skip(length), length, freq, residuals.data(), n);
+
+                    lossless_filter<true>(predictor, residuals.data(), tw, th, plane.data());
+                }
+
+                unsigned char* dst = p < 6 ? coeff + p : rgb + p - 6;
+                const size_t step = p < 6 ? 6 : 3;
+
+                for (size_t y = 0; y < th; ++y)
+                    for (size_t x = 0; x < tw; ++x)
+                        dst[(y * stride + x) * step] = plane[y * tw + x];
+            }
+        }
+
+        bool ptm_is_lossless(std::istream& stream)
+        {
+            char magic[sizeof(lossless_magic)];
+            stream.read(magic, sizeof(magic));
+
+            bool lossless = stream.gcount() == sizeof(magic) && std::equal(magic, magic + sizeof(magic), lossless_magic);
+
+            stream.clear();
+            stream.seekg(0);
+
+            return lossless;
+        }
+
+        void ptm_read_lossless_index(std::istream& stream, PTMHeader12* header, size_t* tile_size, std::vector<uint64_t>* offsets)
+        {
+            unsigned char fixed[sizeof(lossless_magic) + 12 + 48];
+            stream.read(reinterpret_cast<char*>(fixed), sizeof(fixed));
+
+            TAF_ASSERT(stream.good() && std::equal(fixed, fixed + sizeof(lossless_magic), lossless_magic), "Not a lossless PTM");
+
+            const unsigned char* p = fixed + sizeof(lossless_magic);
+
+            header->format = PTM_FORMAT_LRGB;
+            header->width  = static_cast<size_t>(get_le(p, 4));
+            header->height = static_cast<size_t>(get_le(p + 4, 4));
+            *tile_size     = static_cast<size_t>(get_le(p + 8, 4));
+
+            for (size_t i = 0; i < 6; ++i)
+            {
+                uint32_t bits = static_cast<uint32_t>(get_le(p + 12 + i * 4, 4));
+                std::memcpy(&header->scale[i], &bits, 4);
+                header->bias[i] = static_cast<int32_t>(get_le(p + 36 + i * 4, 4));
+            }
+
+            TAF_ASSERT(header->width > 0 && header->height > 0 && *tile_size > 0, "Invalid PTM size");
+
+            size_t num_tiles = ((header->width + *tile_size - 1) / *tile_size) * ((header->height + *tile_size - 1) / *tile_size);
+
+            std::vector<unsigned char> index((num_tiles + 1) * 8);
+            stream.read(reinterpret_cast<char*>(index.data()), index.size());
+
+            TAF_ASSERT(stream.good(), "Unexpected end of file");
+
+            offsets->resize(num_tiles + 1);
+            for (size_t i = 0; i <= num_tiles; ++i)
+            {
+                (*offsets)[i] = get_le(&index[i * 8], 8);
+                TAF_ASSERT(i == 0 || (*offsets)[i] >= (*offsets)[i - 1], "Corrupt lossless index");
+            }
+        }
+    }
+
+    void ptm_save_lossless(const char* file, const PTM12* ptm, size_t tile_size)
+    {
+        const PTMHeader12& header = ptm->header;
+
+        TAF_ASSERT(is_lrgb(&header), "Only LRGB PTMs are supported");
+        TAF_ASSERT(tile_size > 0 && header.width <= UINT32_MAX && header.height <= UINT32_MAX, "Invalid tile or PTM size");
+
+        const size_t tiles_x = (header.width + tile_size - 1) / tile_size;
+        const size_t tiles_y = (header.height + tile_size - 1) / tile_size;
+        const size_t num_tiles = tiles_x * tiles_y;
+
+        std::vector<std::vector<unsigned char>> tiles(num_tiles);
+
+        detail::parallel_for(0, num_tiles, 1, [&](size_t begin, size_t end)
+        {
+            for (size_t t = begin; t < end; ++t)
+            {
+                size_t x0 = (t % tiles_x) * tile_size, y0 = (t / tiles_x) * tile_size;
+
+                detail::ptm_encode_tile(ptm, x0, y0, std::min(tile_size, header.width - x0), std::min(tile_size, header.height - y0), &tiles[t]);
+            }
+        });
+
+        std::vector<unsigned char> head(detail::lossless_magic, detail::lossless_magic + sizeof(detail::lossless_magic));
+        detail::put_le(&head, header.width, 4);
+        detail::put_le(&head, header.height, 4);
+        detail::put_le(&head, tile_size, 4);
+
+        for (size_t i = 0; i < 6; ++i)
+        {
+            uint32_t bits;
+            std::memcpy(&bits, &header.scale[i], 4);
+            detail::put_le(&head, bits, 4);
+        }
+
+        for (size_t i = 0; i < 6; ++i)
+            detail::put_le(&head, static_cast<uint32_t>(header.bias[i]), 4);
+
+        uint64_t offset = head.size() + (num_tiles + 1) * 8;
+        for (size_t t = 0; t <= num_tiles; ++t)
+        {
+            detail::put_le(&head, offset, 8);
+            if (t < num_tiles)
+                offset += tiles[t].size();
+        }
+
+        std::ofstream stream(file, std::ios::binary);
+
+        TAF_ASSERT(stream.good(), "Can't open file");
+
+        stream.write(reinterpret_cast<const char*>(head.data()), head.size());
+        for (auto& tile : tiles)
+            stream.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+
+        TAF_ASSERT(stream.good(), "Couldn't write file");
+    }
+
+    void ptm_load_region(const char* file, size_t x, size_t y, size_t width, size_t height, PTM12* region)
+    {
+        std::ifstream stream(file, std::ios::binary);
+
+        TAF_ASSERT(stream.good(), "Can't open file");
+
+        PTMHeader12 header;
+        size_t tile_size;
+        std::vector<uint64_t> offsets;
+        detail::ptm_read_lossless_index(stream, &header, &tile_size, &offsets);
+
+        TAF_ASSERT(width > 0 && height > 0 && x + width <= header.width && y + height <= header.height, "Region outside of the PTM");
+
+        const size_t tiles_x = (header.width + tile_size - 1) / tile_size;
+        const size_t tx0 = x / tile_size, tx1 = (x + width - 1) / tile_size + 1;
+        const size_t ty0 = y / tile_size, ty1 = (y + height - 1) / tile_size + 1;
+        const bool whole = width == header.width && height == header.height;
+
+        region->header = header;
+        region->header.width = width;
+        region->header.height = height;
+        detail::metrics_resize(&region->coefficients, width * height * 9);
+        detail::metrics_count(PTM_COUNTER_FILES_LOADED);
+
+        unsigned char* coeff = &region->coefficients[0];
+        unsigned char* rgb = coeff + width * height * 6;
+
+        // the tiles of a tile row are stored back to back and read in one go
+        const size_t row_tiles = tx1 - tx0;
+        std::vector<std::vector<unsigned char>> rows(ty1 - ty0);
+
+        {
+            detail::StageTimer timer(PTM_STAGE_READ);
+
+            for (size_t ty = ty0; ty < ty1; ++ty)
+            {
+                const uint64_t first = offsets[ty * tiles_x + tx0];
+                std::vector<unsigned char>& data = rows[ty - ty0];
+
+                data.resize(static_cast<size_t>(offsets[ty * tiles_x + tx1] - first));
+                stream.seekg(static_cast<std::streamoff>(first));
+                stream.read(reinterpret_cast<char*>(data.data()), data.size());
+
+                TAF_ASSERT(static_cast<size_t>(stream.gcount()) == data.size(), "Unexpected end of file");
+
+                detail::metrics_count(PTM_COUNTER_BYTES_READ, data.size());
+            }
+        }
+
+        detail::StageTimer timer(PTM_STAGE_DECODE);
+
+        detail::parallel_for(0, rows.size() * row_tiles, 1, [&](size_t begin, size_t end)
+        {
+            std::vector<unsigned char> tile;
+
+            for (size_t k = begin; k < end; ++k)
+            {
+                ptm_preemption_point();
+
+                const size_t tx = tx0 + k % row_tiles, ty = ty0 + k / row_tiles;
+                const size_t t = ty * tiles_x + tx;
+
+                const unsigned char* src = rows[ty - ty0].data() + (offsets[t] - offsets[ty * tiles_x + tx0]);
+                const size_t size = static_cast<size_t>(offsets[t + 1] - offsets[t]);
+
+                const size_t x0 = tx * tile_size, y0 = ty * tile_size;
+                const size_t tw = std::min(tile_size, header.width - x0);
+                const size_t th = std::min(tile_size, header.height - y0);
+
+                // whole PTMs are decoded in place, regions through a copy of the tile
+                if (whole)
+                {
+                    size_t i = y0 * width + x0;
+                    detail::ptm_decode_tile(src, size, tw, th, coeff + i * 6, rgb + i * 3, width);
+                    continue;
+                }
+
+                tile.resize(tw * th * 9);
+                detail::ptm_decode_tile(src, size, tw, th, &tile[0], &tile[tw * th * 6], tw);
+
+                const size_t cx0 = std::max(x0, x), cx1 = std::min(x0 + tw, x + width);
+                const size_t cy0 = std::max(y0, y), cy1 = std::min(y0 + th, y + height);
+
+                for (size_t cy = cy0; cy < cy1; ++cy)
+                {
+                    size_t from = (cy - y0) * tw + cx0 - x0;
+                    size_t to = (cy - y) * width + cx0 - x;
+
+                    std::copy(&tile[from * 6], &tile[from * 6] + (cx1 - cx0) * 6, coeff + to * 6);
+                    std::copy(&tile[tw * th * 6 + from * 3], &tile[tw * th * 6 + from * 3] + (cx1 - cx0) * 3, rgb + to * 3);
+                }
+            }
+        });
+    }
+
+    namespace detail
+    {
+        /**
+         * Turns preemption points of the calling thread, and of the threads it starts with
+         * parallel_for, off for its lifetime. Held while a job owns work that other jobs may
+         * block on: a job run at a preemption point below it would wait for the frame it
+         * interrupted and never return.
+         */
+        class NonPreemptible
+        {
+        public:
+            NonPreemptible() { ++scheduler_context().non_preemptible; }
+            ~NonPreemptible() { --scheduler_context().non_preemptible; }
+
+        private:
+            NonPreemptible(const NonPreemptible&);
+            NonPreemptible& operator=(const NonPreemptible&);
+        };
+
+        /**
+         * Key a file by path, size, modification time and inode, so a changed file gets a new key.
+         * Without POSIX, or if the file can't be found, the key is the path.
+         */
+        std::string share_key(const std::string& path)
+        {
+#if defined(__unix__) || defined(__APPLE__)
+            struct stat st;
+
+            if (stat(path.c_str(), &st) != 0)
+                return path;
+
+#ifdef __APPLE__
+            const long nsec = static_cast<long>(st.st_mtimespec.tv_nsec);
+#else
+            const long nsec = static_cast<long>(st.st_mtim.tv_nsec);
+#endif
+
+            std::ostringstream key;
+            key << path << '\0' << st.st_size << ':' << static_cast<long long>(st.st_mtime) << '.' << nsec << ':' << st.st_ino;
+
+            return key.str();
+#else
+            return path;
+#endif
+        }
+    }
+
+    PTMCache::PTMCache(size_t compressed_limit, size_t decoded_limit)
+        : compressed_(compressed_limit), decoded_(decoded_limit)
+    {
+        statistics_ = Statistics();
+    }
+
+    std::shared_ptr<const PTM12> PTMCache::get(const std::string& file)
+    {
+        const std::string key = detail::share_key(file);
+
+        std::shared_ptr<const PTMCompressed> compressed;
+        std::promise<std::shared_ptr<const PTM12>> promise;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+
+            if (auto ptm = decoded_.find(key))
+            {
+                statistics_.decoded_hits++;
+                detail::metrics_count(PTM_COUNTER_CACHE_HITS);
+                return ptm;
+            }
+
+            // another thread is decoding this file already, so wait for its result
+            auto pending = pending_.find(key);
+
+            if (pending != pending_.end())
+            {
+                std::shared_future<std::shared_ptr<const PTM12>> result = pending->second;
+
+                statistics_.shared_decodes++;
+                detail::metrics_count(PTM_COUNTER_CACHE_SHARED_DECODES);
+
+                lock.unlock();
+                return result.get();
+            }
+
+            pending_[key] = promise.get_future().share();
+
+            compressed = compressed_.find(key);
+
+            if (compressed)
+            {
+                statistics_.compressed_hits++;
+                detail::metrics_count(PTM_COUNTER_CACHE_COMPRESSED_HITS);
+            }
+            else
+            {
+                statistics_.misses++;
+                detail::metrics_count(PTM_COUNTER_CACHE_MISSES);
+            }
+        }
+
+        std::shared_ptr<PTM12> ptm = std::make_shared<PTM12>();
+
+        // other requests for this file wait for this decode now, so it can't be interrupted
+        detail::NonPreemptible non_preemptible;
+
+        try
+        {
+            if (compressed)
+                ptm_decode(compressed.get(), ptm.get());
+            else
+            {
+                auto loaded = std::make_shared<PTMCompressed>();
+                detail::ptm_load(file.c_str(), ptm.get(), loaded.get());
+
+                if (ptm->header.format == PTM_FORMAT_JPEG_LRGB)
+                    compressed = loaded;
+            }
+        }
+        catch (...)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                pending_.erase(key);
+            }
+
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (compressed)
+                compressed_.insert(key, compressed, compressed->data.size() + sizeof(PTMCompressed));
+
+            decoded_.insert(key, ptm, ptm->coefficients.size() + sizeof(PTM12));
+            pending_.erase(key);
+        }
+
+        promise.set_value(ptm);
+
+        return ptm;
+    }
+
+    void PTMCache::clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        compressed_.clear();
+        decoded_.clear();
+    }
+
+    PTMCache::Statistics PTMCache::statistics() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        Statistics s = statistics_;
+        s.decoded_bytes = decoded_.bytes();
+        s.compressed_bytes = compressed_.bytes();
+
+        return s;
+    }
+
+    namespace detail
+    {
+        SchedulerContext& scheduler_context()
+        {
+            thread_local SchedulerContext context = { nullptr, PTM_LANE_INTERACTIVE, 0 };
+            return context;
+        }
+    }
+
+    PTMScheduler::PTMScheduler(size_t num_threads, uint64_t aging)
+        : start_(std::chrono::steady_clock::now()), aging_(aging), unfinished_(0), sequence_(0), stop_(false)
+    {
+        for (auto& w : waiting_)
+            w = 0;
+
+        if (num_threads == 0)
+            num_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+
+        for (size_t i = 0; i < num_threads; ++i)
+            threads_.emplace_back([this]() { work(); });
+    }
+
+    PTMScheduler::~PTMScheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+
+        work_.notify_all();
+
+        for (auto& t : threads_)
+            t.join();
+    }
+
+    namespace detail
+    {
+        // heap order of scheduler jobs: lowest aged cost first, then first come first served.
+        // All jobs age at the same rate, so the order doesn't change while they wait.
+        struct JobOrder
+        {
+            template<typename Job>
+            bool operator()(const Job& a, const Job& b) const
+            {
+                return a.priority != b.priority ? a.priority > b.priority : a.sequence > b.sequence;
+            }
+        };
+    }
+
+    void PTMScheduler::submit(PTMLane lane, uint64_t cost, std::function<void()> job)
+    {
+        TAF_ASSERT(lane < PTM_LANE_COUNT, "Invalid lane");
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            const auto now = std::chrono::steady_clock::now();
+            const uint64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - start_).count();
+
+            // saturate instead of wrapping for absurd costs
+            uint64_t priority = aging_ * ms;
+            priority = cost > UINT64_MAX - priority ? UINT64_MAX : priority + cost;
+
+            std::vector<Job>& queue = queues_[lane];
+            queue.push_back(Job { priority, sequence_++, now, std::move(job) });
+            std::push_heap(queue.begin(), queue.end(), detail::JobOrder());
+
+            ++waiting_[lane];
+            ++unfinished_;
+        }
+
+        work_.notify_one();
+    }
+
+    void PTMScheduler::wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this]() { return unfinished_ == 0; });
+    }
+
+    size_t PTMScheduler::preempt(PTMLane lane)
+    {
+        size_t run = 0;
+
+        for (;;)
+        {
+            // most calls find nothing, and that is decided without the lock
+            bool urgent = false;
+            for (size_t l = 0; l < static_cast<size_t>(lane); ++l)
+                urgent |= waiting_[l] > 0;
+
+            if (!urgent)
+                return run;
+
+            PTMLane next;
+            Job job;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                if (!pop(lane, &next, &job))
+                    return run;
+            }
+
+            execute(next, &job);
+            ++run;
+        }
+    }
+
+    bool PTMScheduler::pop(size_t lanes, PTMLane* lane, Job* job)
+    {
+        for (size_t l = 0; l < lanes; ++l)
+        {
+            std::vector<Job>& queue = queues_[l];
+
+            if (queue.empty())
+                continue;
+
+            std::pop_heap(queue.begin(), queue.end(), detail::JobOrder());
+            *job = std::move(queue.back());
+            queue.pop_back();
+
+            --waiting_[l];
+            *lane = static_cast<PTMLane>(l);
+
+            return true;
+        }
+
+        return false;
+    }
+
+    void PTMScheduler::execute(PTMLane lane, Job* job)
+    {
+        detail::metrics_queue_latency(lane, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - job->queued).count());
+
+        // a job run at a preemption point interrupts the job of the same thread
+        detail::SchedulerContext& context = detail::scheduler_context();
+        const detail::SchedulerContext interrupted = context;
+
+        context.scheduler = this;
+        context.lane = lane;
+
+        try { job->run(); }
+        catch (...) {}
+
+        context = interrupted;
+        job->run = nullptr;
+
+        bool done;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done = --unfinished_ == 0;
+        }
+
+        if (done)
+            done_.notify_all();
+    }
+
+    void PTMScheduler::work()
+    {
+        for (;;)
+        {
+            PTMLane lane;
+            Job job;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+
+                // queued jobs still run after stop, the destructor waits for them
+                while (!pop(PTM_LANE_COUNT, &lane, &job))
+                {
+                    if (stop_)
+                        return;
+
+                    work_.wait(lock);
+                }
+            }
+
+            execute(lane, &job);
+        }
+    }
+
+    void ptm_preemption_point()
+    {
+        const detail::SchedulerContext& context = detail::scheduler_context();
+
+        if (context.scheduler && context.lane != PTM_LANE_INTERACTIVE && context.non_preemptible == 0)
+            context.scheduler->preempt(context.lane);
+    }
+
+    namespace detail
+    {
+        // CRC-32 of some data appended to data whose CRC-32 is crc, 0 for none
+        uint32_t crc32_update(uint32_t crc, const unsigned char* data, size_t size)
+        {
+            static const struct Table
+            {
+                uint32_t v[256];
+
+                Table()
+                {
+                    for (uint32_t n = 0; n < 256; ++n)
+                    {
+                        uint32_t c = n;
+
+                        for (size_t k = 0; k < 8; ++k)
+                            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+
+                        v[n] = c;
+                    }
+                }
+            } table;
+
+            uint32_t c = crc ^ 0xFFFFFFFFu;
+
+            for (size_t i = 0; i < size; ++i)
+                c = table.v[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+
+            return c ^ 0xFFFFFFFFu;
+        }
+
+        uint32_t crc32(const unsigned char* data, size_t size)
+        {
+            return crc32_update(0, data, size);
+        }
+
+        // octal number right aligned in a tar header field of width bytes, NUL terminated
+        void tar_octal(char* field, size_t width, uint64_t v)
+        {
+            for (size_t i = width - 1; i-- > 0; v >>= 3)
+                field[i] = static_cast<char>('0' + (v & 7));
+
+            field[width - 1] = 0;
+        }
+
+        std::vector<unsigned char> tar_header(const std::string& name, uint64_t size, uint64_t mtime, char type)
+        {
+            std::vector<unsigned char> block(512, 0);
+            char* h = reinterpret_cast<char*>(&block[0]);
+
+            std::memcpy(h, name.data(), std::min<size_t>(name.size(), 100));
+            tar_octal(h + 100, 8, 0644);
+            tar_octal(h + 108, 8, 0);
+            tar_octal(h + 116, 8, 0);
+            tar_octal(h + 124, 12, std::min<uint64_t>(size, 077777777777ull));
+            tar_octal(h + 136, 12, mtime);
+            h[156] = type;
+            std::memcpy(h + 257, "ustar", 6);
+            std::memcpy(h + 263, "00", 2);
+
+            // the checksum is computed with its own field set to spaces
+            std::memset(h + 148, ' ', 8);
+
+            uint64_t sum = 0;
+            for (auto b : block)
+                sum += b;
+
+            tar_octal(h + 148, 7, sum);
+
+            return block;
+        }
+
+        // pax extended header record "<length> key=value\n", where length counts itself
+        void pax_record(std::string* records, const std::string& key, const std::string& value)
+        {
+            const size_t size = key.size() + value.size() + 3;
+            size_t digits = std::to_string(size).size();
+
+            if (std::to_string(size + digits).size() > digits)
+                ++digits;
+
+            *records += std::to_string(size + digits) + " " + key + "=" + value + "\n";
+        }
+
+        // header blocks of a tar member, preceded by a pax extended header if the name or size
+        // don't fit the ustar fields; the data follows, padded to 512 bytes
+        std::vector<unsigned char> tar_member_header(const std::string& name, uint64_t size, uint64_t mtime)
+        {
+            std::string pax;
+
+            if (name.size() > 100)
+                pax_record(&pax, "path", name);
+
+            if (size > 077777777777ull)
+                pax_record(&pax, "size", std::to_string(size));
+
+            std::vector<unsigned char> blocks;
+
+            if (!pax.empty())
+            {
+                blocks = tar_header("PaxHeader", pax.size(), mtime, 'x');
+                blocks.insert(blocks.end(), pax.begin(), pax.end());
+                blocks.resize((blocks.size() + 511) / 512 * 512, 0);
+            }
+
+            std::vector<unsigned char> header = tar_header(name, size, mtime, '0');
+            blocks.insert(blocks.end(), header.begin(), header.end());
+
+            return blocks;
+        }
+    }
+
+    PTMArchive::PTMArchive(const char* file, PTMArchiveFormat format, size_t queue_limit) :
+        format_(format),
+        stream_(new std::ofstream(file, std::ios::binary)),
+        offset_(0),
+        mtime_(static_cast<uint64_t>(std::time(nullptr))),
+        dos_time_(0),
+        queued_bytes_(0),
+        queue_limit_(queue_limit),
+        closing_(false),
+        writing_(false),
+        streaming_(false),
+        remaining_(0)
+    {
+        TAF_ASSERT(stream_->good(), "Can't open archive");
+
+        // zip entries carry the local time in MS-DOS format
+        std::time_t now = static_cast<std::time_t>(mtime_);
+        const std::tm* tm = std::localtime(&now);
+
+        if (tm && tm->tm_year >= 80)
+            dos_time_ = static_cast<uint32_t>((tm->tm_year - 80) << 25 | (tm->tm_mon + 1) << 21 | tm->tm_mday << 16 |
+                                              tm->tm_hour << 11 | tm->tm_min << 5 | tm->tm_sec / 2);
+
+        writer_ = std::thread([this]() { work(); });
+    }
+
+    PTMArchive::~PTMArchive()
+    {
+        try
+        {
+            close();
+        }
+        catch (std::exception&)
+        {
+        }
+    }
+
+    void PTMArchive::add(const std::string& name, std::vector<unsigned char>&& data)
+    {
+        TAF_ASSERT(!name.empty() && name.size() < 0xFFFF, "Invalid archive entry name");
+
+        Entry entry;
+        entry.name = name;
+        entry.crc = format_ == PTM_ARCHIVE_ZIP ? detail::crc32(data.data(), data.size()) : 0;
+        entry.data = std::move(data);
+
+        const size_t size = entry.data.size();
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+
+            // an entry larger than the limit still goes through once the queue is empty
+            space_.wait(lock, [&]() { return error_ || queued_bytes_ == 0 || queued_bytes_ + size <= queue_limit_; });
+
+            if (error_)
+                std::rethrow_exception(error_);
+
+            TAF_ASSERT(!closing_, "Archive is closed");
+
+            queued_bytes_ += size;
+            queue_.push_back(std::move(entry));
+        }
+
+        ready_.notify_one();
+    }
+
+    void PTMArchive::begin_entry(const std::string& name, uint64_t size)
+    {
+        TAF_ASSERT(!name.empty() && name.size() < 0xFFFF, "Invalid archive entry name");
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+
+            // the writer thread owns the file while it has entries
+            space_.wait(lock, [&]() { return error_ || (queue_.empty() && !writing_ && !streaming_); });
+
+            if (error_)
+                std::rethrow_exception(error_);
+
+            TAF_ASSERT(!closing_, "Archive is closed");
+
+            streaming_ = true;
+        }
+
+        try
+        {
+            // a zip header gets its CRC once all data has passed
+            write_header(name, size, 0, &streamed_);
+            remaining_ = size;
+        }
+        catch (std::exception&)
+        {
+            fail();
+            throw;
+        }
+    }
+
+    void PTMArchive::append(const unsigned char* data, size_t size)
+    {
+        try
+        {
+            TAF_ASSERT(streaming_ && size <= remaining_, "Archive entry larger than announced");
+
+            if (format_ == PTM_ARCHIVE_ZIP)
+                streamed_.crc = detail::crc32_update(streamed_.crc, data, size);
+
+            write(data, size);
+            remaining_ -= size;
+        }
+        catch (std::exception&)
+        {
+            fail();
+            throw;
+        }
+    }
+
+    void PTMArchive::end_entry()
+    {
+        static const char zeros[512] = {};
+
+        try
+        {
+            TAF_ASSERT(streaming_ && remaining_ == 0, "Archive entry smaller than announced");
+
+            if (format_ == PTM_ARCHIVE_TAR)
+                write(zeros, (512 - offset_ % 512) % 512);
+            else
+            {
+                // patch the CRC field of the local header
+                std::vector<unsigned char> crc;
+                detail::put_le(&crc, streamed_.crc, 4);
+
+                stream_->seekp(static_cast<std::streamoff>(streamed_.header_offset + 14));
+                stream_->write(reinterpret_cast<const char*>(&crc[0]), 4);
+                stream_->seekp(static_cast<std::streamoff>(offset_));
+
+                TAF_ASSERT(stream_->good(), "Couldn't write archive");
+            }
+        }
+        catch (std::exception&)
+        {
+            fail();
+            throw;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            records_.push_back(streamed_);
+            streaming_ = false;
+        }
+
+        ready_.notify_one();
+        space_.notify_all();
+    }
+
+    void PTMArchive::fail()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (!error_)
+                error_ = std::current_exception();
+
+            streaming_ = false;
+        }
+
+        ready_.notify_one();
+        space_.notify_all();
+    }
+
+    void PTMArchive::close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closing_ = true;
+        }
+
+        ready_.notify_all();
+
+        if (writer_.joinable())
+            writer_.join();
+
+        if (error_)
+            std::rethrow_exception(error_);
+    }
+
+    void PTMArchive::work()
+    {
+        for (;;)
+        {
+            Entry entry;
+            bool failed;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+
+                // a streamed entry has the file until it ends
+                ready_.wait(lock, [this]() { return !streaming_ && (!queue_.empty() || closing_); });
+
+                if (queue_.empty())
+                    break;
+
+                entry = std::move(queue_.front());
+                queue_.pop_front();
+                failed = error_ != nullptr;
+                writing_ = true;
+            }
+
+            // after an error the queue is only drained, so no thread blocks in add()
+            try
+            {
+                if (!failed)
+                    write_entry(entry);
+            }
+            catch (std::exception&)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                error_ = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                queued_bytes_ -= entry.data.size();
+                writing_ = false;
+            }
+
+            space_.notify_all();
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (error_)
+            return;
+
+        try
+        {
+            write_index();
+            stream_->flush();
+
+            TAF_ASSERT(stream_->good(), "Couldn't write archive");
+        }
+        catch (std::exception&)
+        {
+            error_ = std::current_exception();
+        }
+    }
+
+    void PTMArchive::write(const void* data, size_t size)
+    {
+        if (size == 0)
+            return;
+
+        stream_->write(static_cast<const char*>(data), size);
+        offset_ += size;
+
+        TAF_ASSERT(stream_->good(), "Couldn't write archive");
+    }
+
+    void PTMArchive::write_header(const std::string& name, uint64_t size, uint32_t crc, Record* record)
+    {
+        *record = Record { name, offset_, 0, size, crc };
+
+        if (format_ == PTM_ARCHIVE_TAR)
+        {
+            std::vector<unsigned char> header = detail::tar_member_header(name, size, mtime_);
+            write(&header[0], header.size());
+        }
+        else
+        {
+            // entries are stored, so the compressed size is the size
+            const bool zip64 = size >= 0xFFFFFFFFu;
+            std::vector<unsigned char> header;
+
+            detail::put_le(&header, 0x04034b50, 4);
+            detail::put_le(&header, zip64 ? 45 : 20, 2);
+            detail::put_le(&header, 0x0800, 2);
+            detail::put_le(&header, 0, 2);
+            detail::put_le(&header, dos_time_, 4);
+            detail::put_le(&header, crc, 4);
+            detail::put_le(&header, zip64 ? 0xFFFFFFFFu : size, 4);
+            detail::put_le(&header, zip64 ? 0xFFFFFFFFu : size, 4);
+            detail::put_le(&header, name.size(), 2);
+            detail::put_le(&header, zip64 ? 20 : 0, 2);
+            header.insert(header.end(), name.begin(), name.end());
+
+            if (zip64)
+            {
+                detail::put_le(&header, 0x0001, 2);
+                detail::put_le(&header, 16, 2);
+                detail::put_le(&header, size, 8);
+                detail::put_le(&header, size, 8);
+            }
+
+            write(&header[0], header.size());
+        }
+
+        record->data_offset = offset_;
+    }
+
+    void PTMArchive::write_entry(const Entry& entry)
+    {
+        static const char zeros[512] = {};
+
+        Record record;
+        write_header(entry.name, entry.data.size(), entry.crc, &record);
+        write(entry.data.data(), entry.data.size());
+
+        if (format_ == PTM_ARCHIVE_TAR)
+            write(zeros, (512 - offset_ % 512) % 512);
+
+        records_.push_back(record);
+    }
+
+    void PTMArchive::write_index()
+    {
+        if (format_ == PTM_ARCHIVE_TAR)
+        {
+            std::ostringstream index;
+
+            for (auto& r : records_)
+                index << r.name << "\t" << r.data_offset << "\t" << r.size << "\n";
+
+            Entry entry;
+            entry.name = "index.tsv";
+            entry.crc = 0;
+
+            const std::string s = index.str();
+            entry.data.assign(s.begin(), s.end());
+
+            write_entry(entry);
+
+            // end of archive
+            static const char zeros[1024] = {};
+            write(zeros, sizeof(zeros));
+
+            return;
+        }
+
+        const uint64_t cd_offset = offset_;
+
+        for (auto& r : records_)
+        {
+            std::vector<unsigned char> extra;
+
+            if (r.size >= 0xFFFFFFFFu)
+            {
+                detail::put_le(&extra, r.size, 8);
+                detail::put_le(&extra, r.size, 8);
+            }
+
+            if (r.header_offset >= 0xFFFFFFFFu)
+                detail::put_le(&extra, r.header_offset, 8);
+
+            std::vector<unsigned char> header;
+
+            detail::put_le(&header, 0x02014b50, 4);
+            detail::put_le(&header, 45, 2);
+            detail::put_le(&header, extra.empty() ? 20 : 45, 2);
+            detail::put_le(&header, 0x0800, 2);
+            detail::put_le(&header, 0, 2);
+            detail::put_le(&header, dos_time_, 4);
+            detail::put_le(&header, r.crc, 4);
+            detail::put_le(&header, std::min<uint64_t>(r.size, 0xFFFFFFFFu), 4);
+            detail::put_le(&header, std::min<uint64_t>(r.size, 0xFFFFFFFFu), 4);
+            detail::put_le(&header, r.name.size(), 2);
+            detail::put_le(&header, extra.empty() ? 0 : extra.size() + 4, 2);
+            detail::put_le(&header, 0, 2);
+            detail::put_le(&header, 0, 2);
+            detail::put_le(&header, 0, 2);
+            detail::put_le(&header, 0, 4);
+            detail::put_le(&header, std::min<uint64_t>(r.header_offset, 0xFFFFFFFFu), 4);
+            header.insert(header.end(), r.name.begin(), r.name.end());
+
+            if (!extra.empty())
+            {
+                detail::put_le(&header, 0x0001, 2);
+                detail::put_le(&header, extra.size(), 2);
+                header.insert(header.end(), extra.begin(), extra.end());
+            }
+
+            write(&header[0], header.size());
+        }
+
+        const uint64_t cd_size = offset_ - cd_offset;
+        const uint64_t n = records_.size();
+
+        std::vector<unsigned char> end;
+
+        if (n >= 0xFFFF || cd_size >= 0xFFFFFFFFu || cd_offset >= 0xFFFFFFFFu)
+        {
+            const uint64_t zip64_offset = offset_;
+
+            detail::put_le(&end, 0x06064b50, 4);
+            detail::put_le(&end, 44, 8);
+            detail::put_le(&end, 45, 2);
+            detail::put_le(&end, 45, 2);
+            detail::put_le(&end, 0, 4);
+            detail::put_le(&end, 0, 4);
+            detail::put_le(&end, n, 8);
+            detail::put_le(&end, n, 8);
+            detail::put_le(&end, cd_size, 8);
+            detail::put_le(&end, cd_offset, 8);
+
+            detail::put_le(&end, 0x07064b50, 4);
+            detail::put_le(&end, 0, 4);
+            detail::put_le(&end, zip64_offset, 8);
+            detail::put_le(&end, 1, 4);
+        }
+
+        detail::put_le(&end, 0x06054b50, 4);
+        detail::put_le(&end, 0, 2);
+        detail::put_le(&end, 0, 2);
+        detail::put_le(&end, std::min<uint64_t>(n, 0xFFFF), 2);
+        detail::put_le(&end, std::min<uint64_t>(n, 0xFFFF), 2);
+        detail::put_le(&end, std::min<uint64_t>(cd_size, 0xFFFFFFFFu), 4);
+        detail::put_le(&end, std::min<uint64_t>(cd_offset, 0xFFFFFFFFu), 4);
+        detail::put_le(&end, 0, 2);
+
+        write(&end[0], end.size());
+    }
+
+    PTMFileSink::PTMFileSink(const std::string& prefix) : prefix_(prefix)
+    {
+    }
+
+    void PTMFileSink::begin(const std::string& name, uint64_t)
+    {
+        stream_.reset(new std::ofstream((prefix_ + name).c_str(), std::ios::binary));
+
+        TAF_ASSERT(stream_->good(), ("Can't open " + prefix_ + name).c_str());
+    }
+
+    void PTMFileSink::write(const unsigned char* data, size_t size)
+    {
+        stream_->write(reinterpret_cast<const char*>(data), size);
+
+        TAF_ASSERT(stream_->good(), "Couldn't write file");
+    }
+
+    void PTMFileSink::end()
+    {
+        stream_->flush();
+
+        TAF_ASSERT(stream_->good(), "Couldn't write file");
+
+        stream_.reset();
+    }
+
+    void PTMMemorySink::begin(const std::string& name, uint64_t size)
+    {
+        files.push_back(std::make_pair(name, uchar_vec()));
+        files.back().second.reserve(static_cast<size_t>(size));
+    }
+
+    void PTMMemorySink::write(const unsigned char* data, size_t size)
+    {
+        files.back().second.insert(files.back().second.end(), data, data + size);
+    }
+
+    void PTMMemorySink::end()
+    {
+    }
+
+    PTMDescriptorSink::PTMDescriptorSink(int fd) :
+        fd_(fd),
+        mtime_(static_cast<uint64_t>(std::time(nullptr))),
+        finished_(false),
+        size_(0),
+        written_(0)
+    {
+    }
+
+    PTMDescriptorSink::~PTMDescriptorSink()
+    {
+        try
+        {
+            finish();
+        }
+        catch (...)
+        {
+        }
+    }
+
+    void PTMDescriptorSink::begin(const std::string& name, uint64_t size)
+    {
+        TAF_ASSERT(!finished_, "Archive already finished");
+
+        std::vector<unsigned char> header = detail::tar_member_header(name, size, mtime_);
+        put(&header[0], header.size());
+
+        size_ = size;
+        written_ = 0;
+    }
+
+    void PTMDescriptorSink::write(const unsigned char* data, size_t size)
+    {
+        TAF_ASSERT(size <= size_ - written_, "File larger than announced");
+
+        put(data, size);
+        written_ += size;
+    }
+
+    void PTMDescriptorSink::end()
+    {
+        static const char zeros[512] = {};
+
+        TAF_ASSERT(written_ == size_, "File smaller than announced");
+
+        put(zeros, (512 - size_ % 512) % 512);
+    }
+
+    void PTMDescriptorSink::finish()
+    {
+        static const char zeros[1024] = {};
+
+        if (finished_)
+            return;
+
+        // set first, so a failed write isn't retried by the destructor
+        finished_ = true;
+        put(zeros, sizeof(zeros));
+    }
+
+    void PTMDescriptorSink::put(const void* buffer, size_t size)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        const unsigned char* data = static_cast<const unsigned char*>(buffer);
+
+        while (size > 0)
+        {
+            ssize_t written = ::write(fd_, data, size);
+
+            if (written < 0 && errno == EINTR)
+                continue;
+
+            TAF_ASSERT(written > 0, "Couldn't write to file descriptor");
+
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+#else
+        (void)buffer; (void)size;
+        TAF_ASSERT(false, "File descriptors are not supported on this platform");
+#endif
+    }
+
+    PTMCallbackSink::PTMCallbackSink(Callback callback) : callback_(std::move(callback))
+    {
+    }
+
+    void PTMCallbackSink::begin(const std::string& name, uint64_t)
+    {
+        name_ = name;
+    }
+
+    void PTMCallbackSink::write(const unsigned char* data, size_t size)
+    {
+        if (size > 0)
+            callback_(name_, data, size);
+    }
+
+    void PTMCallbackSink::end()
+    {
+        callback_(name_, nullptr, 0);
+    }
+
+    PTMArchiveSink::PTMArchiveSink(PTMArchive* archive) : archive_(archive)
+    {
+    }
+
+    void PTMArchiveSink::begin(const std::string& name, uint64_t size)
+    {
+        archive_->begin_entry(name, size);
+    }
+
+    void PTMArchiveSink::write(const unsigned char* data, size_t size)
+    {
+        archive_->append(data, size);
+    }
+
+    void PTMArchiveSink::end()
+    {
+        archive_->end_entry();
+    }
+
+    namespace detail
+    {
+        // hands the pieces of one PNG from stb to a sink; the sink is locked from the file size,
+        // which comes after compression, until the file is ended, so encoding runs in parallel
+        // but files don't interleave
+        struct PNGWriter
+        {
+            PTMSink* sink;
+            std::mutex* mutex;
+            std::unique_lock<std::mutex> lock;
+            std::string name;
+            std::exception_ptr error;
+        };
+
+        void png_begin(void* context, int size)
+        {
+            PNGWriter* w = static_cast<PNGWriter*>(context);
+
+            // exceptions can't pass through stb
+            try
+            {
+                w->lock = std::unique_lock<std::mutex>(*w->mutex);
+                w->sink->begin(w->name, static_cast<uint64_t>(size));
+            }
+            catch (std::exception&)
+            {
+                w->error = std::current_exception();
+            }
+        }
+
+        void png_write(void* context, void* data, int size)
+        {
+            PNGWriter* w = static_cast<PNGWriter*>(context);
+
+            if (w->error)
+                return;
+
+            try
+            {
+                w->sink->write(static_cast<const unsigned char*>(data), static_cast<size_t>(size));
+            }
+            catch (std::exception&)
+            {
+                w->error = std::current_exception();
+            }
+        }
+    }
+
+    void ptm_write_png(const PTMHeader12* header, const unsigned char* coeff_h, const unsigned char* coeff_l, const unsigned char* rgb, PTMSink* sink, const std::string& prefix, bool sidecar)
+    {
+        const size_t max_bytes = 1 << 30;
+        const size_t row_bytes = header->width * 3;
+
+        TAF_ASSERT(row_bytes < max_bytes, "Image too wide for PNG");
+
+        const size_t strip_rows = max_bytes / (row_bytes + 1);
+
+        std::mutex mutex;
+
+        auto write_strip = [&](const std::string& name, const unsigned char* data, size_t rows)
+        {
+            detail::PNGWriter writer;
+            writer.sink = sink;
+            writer.mutex = &mutex;
+            writer.name = name;
+
+            const bool encoded = stbi_write_png_to_func_sized(detail::png_write, detail::png_begin, &writer, static_cast<int>(header->width), static_cast<int>(rows), 3, data, static_cast<int>(row_bytes)) != 0;
+
+            if (writer.error)
+                std::rethrow_exception(writer.error);
+
+            TAF_ASSERT(encoded, "Couldn't encode PNG");
+
+            sink->end();
+        };
+
+        const char* names[] = { "coeff_h", "coeff_l", "rgb" };
+        const unsigned char* images[] = { coeff_h, coeff_l, rgb };
+
+        detail::parallel_for(0, 3, 1, [&](size_t b, size_t e)
+        {
+            for (size_t i = b; i < e; ++i)
+            {
+                const std::string name = prefix + names[i];
+
+                if (header->height <= strip_rows)
+                {
+                    write_strip(name + ".png", images[i], header->height);
+                    continue;
+                }
+
+                for (size_t y = 0, strip = 0; y < header->height; y += strip_rows, ++strip)
+                {
+                    char suffix[16];
+                    std::snprintf(suffix, sizeof(suffix), "_%03u.png", static_cast<unsigned int>(strip));
+
+                    write_strip(name + suffix, images[i] + y * row_bytes, std::min(strip_rows, header->height - y));
+                }
+            }
+        });
+
+        if (!sidecar)
+            return;
+
+        // the images are upright whatever the source format was, so the sidecar always describes an LRGB PTM
+        PTMHeader12 lrgb = *header;
+        lrgb.format = PTM_FORMAT_LRGB;
+        lrgb.ci = CompressionInfo();
+
+        std::ostringstream text;
+        detail::ptm_write_header(text, &lrgb);
+
+        const std::string s = text.str();
+
+        sink->begin(prefix + "header.txt", s.size());
+        sink->write(reinterpret_cast<const unsigned char*>(s.data()), s.size());
+        sink->end();
+    }
+
+    PTMHeader12 ptm_dump_png(const char* file, PTMSink* sink, const std::string& prefix, bool sidecar)
+    {
+        PTMImage image;
+        ptm_load(file, &image);
+
+        ptm_write_png(&image.header(), image.plane(PTM_PLANE_COEFF_H).data, image.plane(PTM_PLANE_COEFF_L).data, image.plane(PTM_PLANE_RGB).data, sink, prefix, sidecar);
+
+        return image.header();
+    }
+
+#if defined(__unix__) || defined(__APPLE__)
+    namespace detail
+    {
+        const char shared_magic[8] = { 'T', 'A', 'F', 'P', 'T', 'M', 'S', 'H' };
+
+        // coefficients start on a cache line
+        const size_t shared_data_offset = (sizeof(PTMSharedHeader) + 63) / 64 * 64;
+
+        bool send_line(int socket, const std::string& line, int fd)
+        {
+            struct iovec iov;
+            iov.iov_base = const_cast<char*>(line.data());
+            iov.iov_len = line.size();
+
+            union
+            {
+                struct cmsghdr align;
+                char buffer[CMSG_SPACE(sizeof(int))];
+            } control;
+
+            struct msghdr msg = msghdr();
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+
+            // a descriptor travels as ancillary data of the line
+            if (fd >= 0)
+            {
+                msg.msg_control = control.buffer;
+                msg.msg_controllen = sizeof(control.buffer);
+
+                struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+                std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+            }
+
+#ifdef MSG_NOSIGNAL
+            const int flags = MSG_NOSIGNAL;
+#else
+            const int flags = 0;
+#endif
+            return sendmsg(socket, &msg, flags) == static_cast<ssize_t>(line.size());
+        }
+
+        std::string receive_line(int socket, int* fd)
+        {
+            std::string line;
+            *fd = -1;
+
+            while (line.find('\n') == std::string::npos)
+            {
+                char buffer[256];
+
+                struct iovec iov;
+                iov.iov_base = buffer;
+                iov.iov_len = sizeof(buffer);
+
+                union
+                {
+                    struct cmsghdr align;
+                    char buffer[CMSG_SPACE(sizeof(int))];
+                } control;
+
+                struct msghdr msg = msghdr();
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = control.buffer;
+                msg.msg_controllen = sizeof(control.buffer);
+
+                ssize_t n = recvmsg(socket, &msg, 0);
+
+                if (n <= 0)
+                {
+                    if (*fd >= 0)
+                        ::close(*fd);
+
+                    TAF_ASSERT(false, "Connection to PTM share server lost");
+                }
+
+                for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+                    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                        std::memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+                line.append(buffer, n);
+            }
+
+            return line.substr(0, line.find('\n'));
+        }
+
+        std::string absolute_path(const char* file)
+        {
+            char* resolved = realpath(file, nullptr);
+
+            if (!resolved)
+                return file;
+
+            std::string path = resolved;
+            std::free(resolved);
+
+            return path;
+        }
+    }
+
+    PTMShareServer::PTMShareServer(const char* socket_path, size_t idle_limit)
+        : listen_(-1), path_(socket_path), idle_limit_(idle_limit), tick_(0), next_client_(0), stop_(false)
+    {
+        struct sockaddr_un addr = sockaddr_un();
+        addr.sun_family = AF_UNIX;
+
+        TAF_ASSERT(path_.size() < sizeof(addr.sun_path), "Socket path too long");
+        std::memcpy(addr.sun_path, path_.c_str(), path_.size() + 1);
+
+        // finished decodes wake up poll through this pipe
+        const int piped = pipe(wake_);
+        TAF_ASSERT(piped == 0, "Can't create pipe");
+        fcntl(wake_[0], F_SETFL, O_NONBLOCK);
+        fcntl(wake_[1], F_SETFL, O_NONBLOCK);
+
+        // a socket left behind by a previous server
+        unlink(socket_path);
+
+        listen_ = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (listen_ < 0 || bind(listen_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listen_, 16) != 0)
+        {
+            if (listen_ >= 0)
+                ::close(listen_);
+
+            ::close(wake_[0]);
+            ::close(wake_[1]);
+            TAF_ASSERT(false, "Can't listen on socket");
+        }
+
+        scheduler_.reset(new PTMScheduler());
+    }
+
+    PTMShareServer::~PTMShareServer()
+    {
+        // queued decodes are skipped once stopped, running ones are waited for; probe jobs still
+        // queue their decode, so the scheduler has to outlive them
+        stop_ = true;
+        scheduler_->wait();
+        scheduler_.reset();
+
+        for (auto& c : clients_)
+            ::close(c.first);
+
+        for (auto& s : segments_)
+        {
+            munmap(s.second.header, s.second.size);
+            ::close(s.second.fd);
+        }
+
+        ::close(wake_[0]);
+        ::close(wake_[1]);
+        ::close(listen_);
+        unlink(path_.c_str());
+    }
+
+    void PTMShareServer::run()
+    {
+        std::vector<struct pollfd> fds;
+
+        while (!stop_)
+        {
+            fds.clear();
+            fds.push_back(pollfd { listen_, POLLIN, 0 });
+            fds.push_back(pollfd { wake_[0], POLLIN, 0 });
+
+            for (auto& c : clients_)
+                fds.push_back(pollfd { c.first, POLLIN, 0 });
+
+            // wake up regularly to notice stop()
+            if (poll(fds.data(), fds.size(), 200) < 0)
+            {
+                TAF_ASSERT(errno == EINTR, "Polling the socket failed");
+                continue;
+            }
+
+            if (fds[0].revents & POLLIN)
+            {
+                int fd = accept(listen_, nullptr, nullptr);
+
+                if (fd >= 0)
+                    clients_[fd] = Client { next_client_++, false, std::string(), std::vector<std::string>() };
+            }
+
+            // may disconnect clients, whose descriptors can't be reused before the next accept
+            if (fds[1].revents & POLLIN)
+                complete();
+
+            for (size_t i = 2; i < fds.size(); ++i)
+                if (fds[i].revents && clients_.count(fds[i].fd))
+                    serve(fds[i].fd);
+        }
+    }
+
+    void PTMShareServer::serve(int fd)
+    {
+        char buffer[4096];
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+
+        if (n <= 0)
+        {
+            disconnect(fd);
+            return;
+        }
+
+        std::string& pending = clients_[fd].buffer;
+        pending.append(buffer, n);
+
+        // nobody sends paths that long
+        if (pending.find('\n') == std::string::npos && pending.size() > sizeof(buffer))
+        {
+            disconnect(fd);
+            return;
+        }
+
+        process(fd);
+    }
+
+    void PTMShareServer::process(int fd)
+    {
+        Client& client = clients_[fd];
+        size_t end;
+
+        // requests after one that waits for a decode stay buffered, so replies keep their order
+        while (!client.waiting && (end = client.buffer.find('\n')) != std::string::npos)
+        {
+            std::string line = client.buffer.substr(0, end);
+            client.buffer.erase(0, end + 1);
+
+            const std::string interactive = "acquire ", bulk = "acquire-bulk ";
+            PTMLane lane;
+            std::string file;
+
+            if (line.compare(0, interactive.size(), interactive) == 0)
+            {
+                lane = PTM_LANE_INTERACTIVE;
+                file = line.substr(interactive.size());
+            }
+            else if (line.compare(0, bulk.size(), bulk) == 0)
+            {
+                lane = PTM_LANE_BULK;
+                file = line.substr(bulk.size());
+            }
+            else
+            {
+                if (!detail::send_line(fd, "error Unknown request\n", -1))
+                {
+                    disconnect(fd);
+                    return;
+                }
+
+                continue;
+            }
+
+            const std::string path = detail::absolute_path(file.c_str());
+            file = detail::share_key(path);
+
+            if (segments_.count(file))
+            {
+                if (!reply(fd, file))
+                {
+                    disconnect(fd);
+                    return;
+                }
+
+                continue;
+            }
+
+            client.waiting = true;
+
+            auto& waiters = decoding_[file];
+            waiters.push_back(std::make_pair(fd, client.id));
+
+            if (waiters.size() > 1)
+                continue;
+
+            // the header is probed by a cheap job first, so a slow disk doesn't hold up the poll
+            // loop; files that can't be probed cost nothing, they fail quickly
+            scheduler_->submit(lane, 0, [this, file, path, lane]()
+            {
+                uint64_t cost = 0;
+
+                try
+                {
+                    PTMHeader12 header = ptm_probe(path.c_str());
+                    cost = ptm_cost(&header);
+                }
+                catch (std::exception&)
+                {
+                }
+
+                decode(lane, cost, file, path);
+            });
+        }
+    }
+
+    void PTMShareServer::decode(PTMLane lane, uint64_t cost, const std::string& file, const std::string& path)
+    {
+        scheduler_->submit(lane, cost, [this, file, path]()
+        {
+            Decoded decoded;
+            decoded.file = file;
+
+            if (stop_)
+                decoded.error = "Server stopped";
+            else
+            {
+                try
+                {
+                    decoded.ptm.reset(new PTM12());
+                    ptm_load(path.c_str(), decoded.ptm.get());
                 }
+                catch (std::exception& e)
+                {
+                    decoded.ptm.reset();
+                    decoded.error = e.what();
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(decoded_mutex_);
+                decoded_.push_back(std::move(decoded));
+            }
+
+            const char wake = 0;
+            ssize_t written = write(wake_[1], &wake, 1);
+            (void)written;
+        });
+    }
+
+    void PTMShareServer::complete()
+    {
+        char drain[64];
+        while (read(wake_[0], drain, sizeof(drain)) > 0)
+            continue;
+
+        std::vector<Decoded> done;
+
+        {
+            std::lock_guard<std::mutex> lock(decoded_mutex_);
+            done.swap(decoded_);
+        }
+
+        for (auto& decoded : done)
+        {
+            std::string error = decoded.error;
+
+            if (decoded.ptm)
+            {
+                try { share(decoded.file, *decoded.ptm); }
+                catch (std::exception& e) { error = e.what(); }
+
+                decoded.ptm.reset();
+            }
+
+            std::replace(error.begin(), error.end(), '\n', ' ');
+
+            auto waiters = std::move(decoding_[decoded.file]);
+            decoding_.erase(decoded.file);
+
+            for (auto& w : waiters)
+            {
+                // the client may have left, and its descriptor may belong to a new one
+                auto c = clients_.find(w.first);
+
+                if (c == clients_.end() || c->second.id != w.second)
+                    continue;
+
+                c->second.waiting = false;
+
+                bool sent = error.empty() ? reply(w.first, decoded.file) : detail::send_line(w.first, "error " + error + "\n", -1);
+
+                if (sent)
+                    process(w.first);
+                else
+                    disconnect(w.first);
+            }
+
+            // segments nobody waited for anymore
+            trim();
+        }
+    }
+
+    bool PTMShareServer::reply(int fd, const std::string& file)
+    {
+        Segment& s = segments_[file];
+
+        s.header->refcount++;
+        s.last_used = ++tick_;
+        clients_[fd].files.push_back(file);
+
+        return detail::send_line(fd, "ok " + std::to_string(s.size) + "\n", s.fd);
+    }
+
+    void PTMShareServer::disconnect(int fd)
+    {
+        for (auto& file : clients_[fd].files)
+            release(file);
+
+        clients_.erase(fd);
+        ::close(fd);
+
+        trim();
+    }
+
+    void PTMShareServer::share(const std::string& file, const PTM12& ptm)
+    {
+        const size_t size = detail::shared_data_offset + ptm.coefficients.size();
+
+        char name[64];
+        std::snprintf(name, sizeof(name), "/taf_ptm_%ld_%zu", static_cast<long>(getpid()), tick_++);
+
+        // the writable descriptor only lives until the segment is filled, clients get a read-only one
+        int rw = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        TAF_ASSERT(rw >= 0, "Can't create shared memory");
+
+        int ro = shm_open(name, O_RDONLY, 0);
+        shm_unlink(name);
+
+        void* p = MAP_FAILED;
+
+        if (ro >= 0 && ftruncate(rw, size) == 0)
+            p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, rw, 0);
+
+        ::close(rw);
+
+        if (p == MAP_FAILED)
+        {
+            if (ro >= 0)
+                ::close(ro);
+
+            TAF_ASSERT(false, "Can't map shared memory");
+        }
+
+        PTMSharedHeader* header = new (p) PTMSharedHeader();
+        std::copy(detail::shared_magic, detail::shared_magic + 8, header->magic);
+        header->version = 1;
+        header->format = ptm.header.format;
+        header->width = ptm.header.width;
+        header->height = ptm.header.height;
+        std::copy(ptm.header.scale, ptm.header.scale + 6, header->scale);
+        std::copy(ptm.header.bias, ptm.header.bias + 6, header->bias);
+        header->data_offset = detail::shared_data_offset;
+        header->data_size = ptm.coefficients.size();
+        header->refcount = 0;
+
+        std::copy(ptm.coefficients.begin(), ptm.coefficients.end(), static_cast<unsigned char*>(p) + detail::shared_data_offset);
+
+        segments_[file] = Segment { ro, header, size, ++tick_ };
+    }
+
+    void PTMShareServer::release(const std::string& file)
+    {
+        auto it = segments_.find(file);
+
+        if (it != segments_.end())
+        {
+            it->second.header->refcount--;
+            it->second.last_used = ++tick_;
+        }
+    }
+
+    void PTMShareServer::trim()
+    {
+        for (;;)
+        {
+            size_t idle = 0;
+            auto oldest = segments_.end();
+
+            for (auto it = segments_.begin(); it != segments_.end(); ++it)
+            {
+                if (it->second.header->refcount > 0)
+                    continue;
+
+                idle += it->second.size;
+
+                if (oldest == segments_.end() || it->second.last_used < oldest->second.last_used)
+                    oldest = it;
+            }
+
+            if (idle <= idle_limit_)
+                return;
+
+            // clients that still have it mapped keep the memory alive
+            munmap(oldest->second.header, oldest->second.size);
+            ::close(oldest->second.fd);
+            segments_.erase(oldest);
+        }
+    }
+
+    PTMSharedView::PTMSharedView() : socket_(-1), shared_(nullptr), size_(0)
+    {
+    }
+
+    PTMSharedView::~PTMSharedView()
+    {
+        release();
+    }
+
+    void PTMSharedView::acquire(const char* socket_path, const char* file, PTMLane lane)
+    {
+        release();
+
+        struct sockaddr_un addr = sockaddr_un();
+        addr.sun_family = AF_UNIX;
+
+        TAF_ASSERT(std::strlen(socket_path) < sizeof(addr.sun_path), "Socket path too long");
+        std::strcpy(addr.sun_path, socket_path);
+
+        socket_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        TAF_ASSERT(socket_ >= 0, "Can't create socket");
+
+        if (connect(socket_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0)
+        {
+            release();
+            TAF_ASSERT(false, "Can't connect to PTM share server");
+        }
+
+        // the server resolves paths in its own working directory
+        std::string request = (lane == PTM_LANE_BULK ? "acquire-bulk " : "acquire ") + detail::absolute_path(file) + "\n";
+
+        int fd = -1;
+        std::string reply;
+
+        try
+        {
+            TAF_ASSERT(detail::send_line(socket_, request, -1), "Can't send request to PTM share server");
+            reply = detail::receive_line(socket_, &fd);
+        }
+        catch (...)
+        {
+            release();
+            throw;
+        }
+
+        if (reply.compare(0, 3, "ok ") != 0 || fd < 0)
+        {
+            if (fd >= 0)
+                ::close(fd);
+
+            release();
+            TAF_ASSERT(false, (reply.compare(0, 6, "error ") == 0 ? reply.substr(6) : std::string("Invalid reply from PTM share server")).c_str());
+        }
+
+        size_t size = std::strtoull(reply.c_str() + 3, nullptr, 10);
+        void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+
+        if (p == MAP_FAILED)
+        {
+            release();
+            TAF_ASSERT(false, "Can't map shared memory");
+        }
+
+        shared_ = static_cast<const PTMSharedHeader*>(p);
+        size_ = size;
+
+        if (!std::equal(detail::shared_magic, detail::shared_magic + 8, shared_->magic) || shared_->data_offset + shared_->data_size > size_)
+        {
+            release();
+            TAF_ASSERT(false, "Invalid shared PTM");
+        }
+    }
+
+    void PTMSharedView::release()
+    {
+        if (shared_)
+            munmap(const_cast<PTMSharedHeader*>(shared_), size_);
+
+        if (socket_ >= 0)
+            ::close(socket_);
+
+        socket_ = -1;
+        shared_ = nullptr;
+        size_ = 0;
+    }
+
+    PTMHeader12 PTMSharedView::header() const
+    {
+        TAF_ASSERT(shared_, "No shared PTM acquired");
+
+        PTMHeader12 header;
+        header.format = static_cast<PTMFormat>(shared_->format);
+        header.width = static_cast<size_t>(shared_->width);
+        header.height = static_cast<size_t>(shared_->height);
+        std::copy(shared_->scale, shared_->scale + 6, header.scale);
+        std::copy(shared_->bias, shared_->bias + 6, header.bias);
+
+        return header;
     }
 
+    const unsigned char* PTMSharedView::coefficients() const
+    {
+        TAF_ASSERT(shared_, "No shared PTM acquired");
+
+        return reinterpret_cast<const unsigned char*>(shared_) + shared_->data_offset;
+    }
+#else
+    PTMShareServer::PTMShareServer(const char*, size_t) : listen_(-1), idle_limit_(0), tick_(0), next_client_(0), stop_(false) { TAF_ASSERT(false, "Shared memory is not supported on this platform"); }
+    PTMShareServer::~PTMShareServer() {}
+    void PTMShareServer::run() {}
+    PTMSharedView::PTMSharedView() : socket_(-1), shared_(nullptr), size_(0) {}
+    PTMSharedView::~PTMSharedView() {}
+    void PTMSharedView::acquire(const char*, const char*, PTMLane) { TAF_ASSERT(false, "Shared memory is not supported on this platform"); }
+    void PTMSharedView::release() {}
+    PTMHeader12 PTMSharedView::header() const { TAF_ASSERT(false, "No shared PTM acquired"); return PTMHeader12(); }
+    const unsigned char* PTMSharedView::coefficients() const { return nullptr; }
+#endif
 }
 #endif
 
@@ -0,0 +1,89 @@
+/*
+ * scheduler_cache_test - Tobias Alexander Franke 2012
+ * For copyright and license see LICENSE
+ * http://www.tobias-franke.eu
+ */
+
+#include <iostream>
+#include <future>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+
+#define TAF_PTM_IMPLEMENTATION
+#include "taf_ptm.h"
+
+/**
+ * A bulk job submits an interactive job that requests a file from a PTMCache, then requests the
+ * same file itself. Its decode passes preemption points while it owns the cache's pending entry,
+ * and must not run the interactive job there: that job would wait for the very decode it
+ * interrupted.
+ */
+bool run(size_t num_threads, const char* file)
+{
+    taf::PTMScheduler scheduler(num_threads);
+    taf::PTMCache cache(64 << 20, 64 << 20);
+    std::atomic<int> finished(0);
+
+    scheduler.submit(taf::PTM_LANE_BULK, 0, [&]()
+    {
+        scheduler.submit(taf::PTM_LANE_INTERACTIVE, 0, [&]()
+        {
+            cache.get(file);
+            ++finished;
+        });
+
+        cache.get(file);
+        ++finished;
+    });
+
+    auto done = std::async(std::launch::async, [&]() { scheduler.wait(); });
+
+    if (done.wait_for(std::chrono::seconds(30)) != std::future_status::ready)
+    {
+        std::cerr << "Deadlock with " << num_threads << " threads" << std::endl;
+        std::_Exit(1);
+    }
+
+    return finished == 2;
+}
+
+int main()
+{
+    const char* file = "scheduler_cache_test.ptm";
+
+    try
+    {
+        taf::PTM12 ptm;
+        ptm.header.format = taf::PTM_FORMAT_LRGB;
+        ptm.header.width = 512;
+        ptm.header.height = 512;
+
+        for (size_t i = 0; i < 6; ++i)
+        {
+            ptm.header.scale[i] = 1.f;
+            ptm.header.bias[i] = 0;
+        }
+
+        ptm.coefficients.assign(ptm.header.width * ptm.header.height * 9, 128);
+        taf::ptm_save(file, &ptm);
+
+        bool ok = run(1, file) && run(4, file);
+
+        std::remove(file);
+
+        if (!ok)
+        {
+            std::cerr << "A job failed" << std::endl;
+            return 1;
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::remove(file);
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}